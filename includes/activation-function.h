@@ -2,6 +2,7 @@
 #define ba9d5d_ACT
 
 #include <math.h>
+#include <linear-algebra.h>
 
 #ifndef data_type
 #define data_type float
@@ -19,4 +20,8 @@ data_type d_sigmoid(data_type input);
 
 data_type d_tanh(data_type input);
 
+void softmax_v(Vector* logits, Vector* probs);
+data_type softmax_cross_entropy_v(Vector* logits, Vector* target, Vector* probs, Vector* grad, data_type scale);
+data_type softmax_cross_entropy_m(Matrix* logits, Matrix* targets, Matrix* probs, Matrix* grad, data_type scale);
+
 #endif
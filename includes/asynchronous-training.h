@@ -0,0 +1,32 @@
+#ifndef e41b7a_ASYNC
+#define e41b7a_ASYNC
+
+#include <pthread.h>
+#include <unistd.h>
+#include <neural-network.h>
+
+/*
+ * Hogwild style training: every worker runs forward and backward passes on
+ * its own examples and writes the updates straight into the shared weights
+ * without any locking or barrier. Weight updates are relaxed atomic stores,
+ * reads in the forward pass are racy by design.
+ *
+ * Worker t handles examples start+t, start+t+threads, ... so igen and lgen
+ * are called concurrently and have to be thread safe.
+ */
+typedef struct {
+	struct NeuralNetwork* NN;
+	inputGenerator igen;
+	labelGenerator lgen;
+	size_t start;
+	size_t size;				// examples per epoch
+	uint32_t epochs;
+	uint16_t threads;			// 0 = number of online cpus
+	data_type lrate;			// applied per example
+	float* loss;				// loss of the last epoch, optional
+	double* examples_per_second;	// optional
+} NN_async_args;
+
+short NeuralNetwork_train_async(NN_async_args args);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef a71f3c_AUTOTUNE
+#define a71f3c_AUTOTUNE
+
+#include <neural-network.h>
+#include <kernels.h>
+#include <low-rank.h>
+#include <random.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// the row blocks and gemm tiles tried per shape
+#define NN_AUTOTUNE_ROWS {1, 2, 4, 8}
+#define NN_AUTOTUNE_TILES {1, 8, 32, 0}
+
+/*
+ * Auto-tuning of the optimized kernels' blocking (kernels.h) for the layer
+ * shapes of a network: gemv for the per example passes and A.B^T for the
+ * batched forward pass, U and V separately for a factored layer. Every
+ * candidate runs for config.seconds on random data and the fastest one is put
+ * in the kernels' table.
+ *
+ * The winners are kept in a text cache, a line per CPU model (the model name
+ * of /proc/cpuinfo) and shape, so the next run on the same kind of machine
+ * loads them on its first backend selection, without calling NN_autotune,
+ * which then only measures the shapes still missing. Lines of other models
+ * are kept as they are. The kernels run on one thread, parallelism is at the
+ * training level, so there's no threading threshold to tune.
+ */
+typedef struct {
+	char* cache;			// NULL = NN_TUNE_CACHE, else ~/.cache/neural-network-kernels
+	size_t batch_size;		// rows of A for the gemm shapes, 0 = 64
+	double seconds;			// per candidate, 0 = 0.02
+	char retune;			// measure the shapes the cache already has too
+} NN_autotune_config;
+
+short NN_autotune(struct NeuralNetwork* NN, NN_autotune_config config);
+// this CPU's entries of the cache into the kernels, a missing cache is no error
+short NN_autotune_load(char* path, uint32_t* loaded);
+short NN_autotune_save(char* path);
+char* NN_cpu_model(char* dst, size_t size);
+
+#endif
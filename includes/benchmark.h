@@ -0,0 +1,27 @@
+#ifndef b61c0e_BENCH
+#define b61c0e_BENCH
+
+#include <neural-network.h>
+#include <perf-counters.h>
+#include <random.h>
+
+/*
+ * Kernels (multiply_mv and NN_layer_backward on the first layer) and the
+ * phases of a training step (forward, backward, update, whole step), each run
+ * for at least seconds and reported with NN_perf_report. The weights are left
+ * as they were, updates are applied with a learning rate of 0. With backends
+ * the whole set runs once per kernel backend available (kernels.h), each with
+ * its own report, for a side by side comparison.
+ */
+typedef struct {
+	struct NeuralNetwork* NN;	// NULL = a 784-128-64-10 network
+	size_t batch_size;			// 0 = 64
+	double seconds;				// per region, 0 = 0.25
+	uint64_t seed;
+	FILE* out;					// NULL = stdout
+	char backends;
+} NN_bench_config;
+
+short NN_benchmark(NN_bench_config config);
+
+#endif
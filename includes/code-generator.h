@@ -0,0 +1,26 @@
+#ifndef c6e913_CODEGEN
+#define c6e913_CODEGEN
+
+#include <ctype.h>
+#include <neural-network.h>
+
+// networks above this many weights aren't worth unrolling
+#define NN_CODEGEN_MAX_WEIGHTS 4096
+
+/*
+ * Writes a standalone C header for a trained network:
+ *
+ *	#define <name>_INPUT_SIZE / <name>_OUTPUT_SIZE
+ *	static const, 64 byte aligned <name>_w<l> / <name>_b<l> arrays
+ *	static inline void <name>_forward(const float* in, float* out)
+ *
+ * The forward function is fully unrolled and branch free, specialised to the
+ * exact layer sizes, and only needs <math.h>. Every neuron is summed in the
+ * same order as NeuralNetwork_feed. A softmax output is normalised in place
+ * at the end (max-subtracted, like softmax_v).
+ *
+ * Needs activation_source, so it fails if activation was overridden without it.
+ */
+short NeuralNetwork_codegen(struct NeuralNetwork* NN, char* outputfile, char* name);
+
+#endif
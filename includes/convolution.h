@@ -0,0 +1,83 @@
+#ifndef f6b1d3_CONV
+#define f6b1d3_CONV
+
+#include <neural-network.h>
+
+/*
+ * Convolution and max pooling layers in front of the dense layers.
+ *
+ * Feature maps are stored channel major, channels x height x width, and are
+ * flattened in that order into the input of the dense network. Convolutions
+ * run as im2col + multiply_mm (weights: filters x channels*kernel*kernel), the
+ * backward pass as multiply_mmt_add / multiply_mtm + col2im. Every buffer they
+ * need lives in a NN_convnet_workspace that is allocated once and reused.
+ * Convolutions use the same activation as the dense layers.
+ */
+
+enum NN_feature_type {
+	NN_FEATURE_CONV,
+	NN_FEATURE_POOL,
+};
+
+struct NN_feature_layer {
+	enum NN_feature_type type;
+	uint32_t channels, height, width;			// input
+	uint32_t out_channels, out_height, out_width;
+	uint32_t kernel, stride, padding;			// pooling: kernel = stride, no padding
+	Matrix weights;								// conv only
+	Vector biases;								// conv only
+};
+
+struct NN_convnet {
+	uint32_t channels, height, width;
+	uint64_t seed;			// initialisation, set before adding layers for a reproducible net
+	uint16_t num_feature_layers;
+	struct NN_feature_layer* feature_layers;
+	struct NeuralNetwork dense;
+};
+
+struct NN_convnet_workspace {
+	struct NN_workspace dense;
+	Vector input;
+	Matrix* z;				// per feature layer, conv pre-activations
+	Matrix* a;				// per feature layer, output maps
+	uint32_t** argmax;		// per feature layer, pooling winners
+	Matrix col;				// im2col of the largest convolution
+	Matrix dcol;
+	Vector grad[2];			// map sized derivatives, ping-pong
+};
+
+typedef struct {
+	struct NN_convnet* net;
+	inputGenerator igen;
+	labelGenerator lgen;
+	size_t batch_start;
+	size_t batch_size;
+	struct layer_gradient* feature_gradient;	// one per feature layer, pooling ones stay empty
+	struct layer_gradient* gradient;			// dense layers, like NN_args
+	float* loss;
+	char accumulate;							// like NN_args, see NN_convnet_gradient_init
+	size_t normalize;
+} NN_convnet_args;
+
+short NN_convnet_init(struct NN_convnet* dst, uint32_t channels, uint32_t height, uint32_t width);
+short NN_convnet_add_conv(struct NN_convnet* net, uint32_t filters, uint32_t kernel, uint32_t stride, uint32_t padding);
+short NN_convnet_add_pool(struct NN_convnet* net, uint32_t size);
+short NN_convnet_finish(struct NN_convnet* net, uint16_t hidden_layers, ...);
+void NN_convnet_free(struct NN_convnet* net);
+uint32_t NN_convnet_input_size(struct NN_convnet* net);
+
+short NN_convnet_workspace_init(struct NN_convnet* net, struct NN_convnet_workspace* dst, char gradients);
+void NN_convnet_workspace_free(struct NN_convnet* net, struct NN_convnet_workspace* ws);
+
+short NN_convnet_feed(struct NN_convnet* net, struct NN_convnet_workspace* ws, Vector* input, Vector* dst);
+short NN_convnet_train(NN_convnet_args args);
+short NN_convnet_apply_gradient(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient, data_type lrate);
+short NN_convnet_gradient_init(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient);
+void NN_convnet_gradient_zero(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient);
+void NN_convnet_gradient_free(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient);
+
+void im2col(data_type* input, struct NN_feature_layer* layer, Matrix* col);
+void col2im(Matrix* col, struct NN_feature_layer* layer, data_type* input);
+
+#endif
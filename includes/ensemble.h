@@ -0,0 +1,60 @@
+#ifndef c7d215_ENSEMBLE
+#define c7d215_ENSEMBLE
+
+#include <neural-network.h>
+#include <random.h>
+#include <lanes.h>
+
+// models trained by one vector instruction
+#define NN_ENSEMBLE_LANES NN_LANES
+
+/*
+ * M networks of the same topology trained side by side, for sweeps over small
+ * models. Every parameter is stored as a row of lanes, one per model:
+ * weight (r, c) of layer l is params[weights[l] + (r*columns + c)*lanes + m],
+ * the biases follow the weights of their layer. lanes is M rounded up to
+ * NN_ENSEMBLE_LANES, the padding models train on but are never read.
+ *
+ * All models see the same examples, each one has its own learning rate and
+ * initialisation seed. Model m ends up bit-identical to a NeuralNetwork that
+ * was randomized with seed m and trained with NeuralNetwork_train and
+ * NeuralNetwork_apply_gradient at lrate m on the same batches.
+ */
+struct NN_ensemble {
+	enum NN_output output;
+	uint16_t models;
+	uint16_t lanes;
+	uint16_t num_layers;	// hidden layers + output
+	uint32_t* sizes;		// num_layers + 1 neuron counts, sizes[0] = input
+	size_t* weights;		// offset of layer l (1..num_layers) in params and gradient
+	size_t* activations;	// offset of layer l (0..num_layers) in a and z
+	size_t parameters;		// floats in params
+	data_type* params;
+	data_type* gradient;
+	data_type* lrate;		// lanes entries
+	data_type* a;
+	data_type* z;
+	data_type* delta;		// biggest layer x lanes
+	data_type* temp_delta;
+	Vector input;
+	Vector desired;
+};
+
+typedef struct {
+	struct NN_ensemble* ensemble;
+	inputGenerator igen;
+	labelGenerator lgen;
+	size_t batch_start;
+	size_t batch_size;
+	float* loss;			// models entries, same scale as NeuralNetwork_train
+} NN_ensemble_args;
+
+short NN_ensemble_new(struct NN_ensemble* dst, uint16_t models, uint32_t input_size, uint16_t hidden_layers, ...);
+void NN_ensemble_free(struct NN_ensemble* ensemble);
+short NN_ensemble_randomize(struct NN_ensemble* ensemble, const uint64_t* seeds);
+void NN_ensemble_set_lrate(struct NN_ensemble* ensemble, const data_type* lrates);
+short NN_ensemble_train(NN_ensemble_args args);
+short NN_ensemble_get(struct NN_ensemble* ensemble, uint16_t model, struct NeuralNetwork* dst);
+short NN_ensemble_set(struct NN_ensemble* ensemble, uint16_t model, struct NeuralNetwork* src);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef e7c052_EVAL
+#define e7c052_EVAL
+
+#include <pthread.h>
+#include <unistd.h>
+#include <neural-network.h>
+
+// examples pushed through the network together by every worker
+#define NN_EVAL_BLOCK 32
+
+/*
+ * Batched, multi-threaded evaluation.
+ *
+ * Every stride-th example of [start, start + size) is evaluated (stride 0 or 1
+ * evaluates all of them). With more than one thread igen and lgen are called
+ * concurrently and have to be thread safe.
+ *
+ * Classes are the output neurons, predicted and desired class being the argmax
+ * of the output and the label. A single output network is a binary classifier
+ * thresholded at 0.5, which gives two classes.
+ *
+ * confusion, if given, is classes x classes, indexed [desired][predicted], and
+ * is overwritten. An example is top_k correct when fewer than top_k outputs
+ * score higher than the desired class.
+ */
+typedef struct {
+	struct NeuralNetwork* NN;
+	inputGenerator igen;
+	labelGenerator lgen;
+	size_t start;
+	size_t size;
+	size_t stride;
+	uint16_t threads;	// 0 = number of online cpus
+	uint32_t top_k;		// 0 = no top_k accuracy
+	size_t* confusion;
+} NN_eval_args;
+
+typedef struct {
+	size_t examples;	// evaluated, failed generators excluded
+	size_t correct;
+	size_t top_k_correct;
+	double accuracy;
+	double top_k_accuracy;
+	float loss;			// same scale as NeuralNetwork_train
+} NN_eval_result;
+
+uint32_t NeuralNetwork_classes(struct NeuralNetwork* NN);
+short NeuralNetwork_evaluate(NN_eval_args args, NN_eval_result* result);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef e6b05d_FEATURES
+#define e6b05d_FEATURES
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <neural-network.h>
+
+// examples run through the frozen layers at a time
+#define NN_FEATURE_BLOCK 64
+
+/*
+ * Fine-tuning the last layers of a network: the output of its leading frozen
+ * layers (NeuralNetwork_frozen_layers) is kept per example, so the frozen part
+ * runs once per example instead of once per epoch.
+ *
+ * NN_feature_cache_train has the contract of NeuralNetwork_train for examples
+ * in [start, start + size). The examples of the batch not seen yet are run
+ * through the frozen layers, NN_FEATURE_BLOCK at a time, and stored; then the
+ * trainable layers are trained from the stored features. From the second
+ * epoch on a step costs the trainable layers only. The gradient has the
+ * layout of NeuralNetwork_gradient_init, the frozen layers' entries are left
+ * empty, so NeuralNetwork_apply_gradient takes it as it is.
+ *
+ * The store is one size x width array of data_type, in memory or, with a
+ * path, in a file mapped shared: features of a dataset bigger than memory are
+ * then written back and dropped by the kernel instead of swapped. The file is
+ * scratch, truncated at init. The frozen layers must not change meanwhile
+ * (import, randomize, freezing others), NN_feature_cache_clear after that.
+ * Dropout needs a fresh mask every epoch and isn't taken.
+ */
+typedef struct {
+	struct NeuralNetwork* NN;
+	size_t start;			// first example of the store
+	size_t size;			// examples
+	char* path;				// NULL = in memory
+} NN_feature_cache_config;
+
+typedef struct {
+	uint64_t hits;			// examples trained from stored features
+	uint64_t misses;		// examples run through the frozen layers first
+	size_t filled;			// examples stored
+	size_t bytes;
+} NN_feature_cache_stats;
+
+struct NN_feature_cache {
+	NN_feature_cache_config config;
+	uint32_t layers;		// frozen ones in front of the features
+	uint32_t width;			// features per example
+	struct NeuralNetwork tail;	// the layers after them, NN's weights
+	data_type* features;
+	char* filled;			// per example
+	size_t filled_count;
+	size_t bytes;			// of the features
+	char mapped;			// features are a file mapping
+	Matrix block;			// inputs of the examples being filled
+	Matrix buffers[2];
+	size_t rows[NN_FEATURE_BLOCK];	// example - start of every row of block
+	uint64_t hits, misses;
+};
+
+short NN_feature_cache_init(struct NN_feature_cache* dst, NN_feature_cache_config config);
+short NN_feature_cache_train(struct NN_feature_cache* cache, NN_args args);
+void NN_feature_cache_clear(struct NN_feature_cache* cache);
+void NN_feature_cache_get_stats(struct NN_feature_cache* cache, NN_feature_cache_stats* dst);
+void NN_feature_cache_free(struct NN_feature_cache* cache);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef d2a7f4_FROZEN
+#define d2a7f4_FROZEN
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <neural-network.h>
+
+#define NN_FROZEN_MAGIC 0x5a464e4eu	// "NNFZ"
+#define NN_FROZEN_VERSION 1
+#define NN_FROZEN_ALIGNMENT 64
+
+// header flags
+#define NN_FROZEN_SOFTMAX 0x01		// softmax output layer
+#define NN_FROZEN_FLAGS (NN_FROZEN_SOFTMAX)
+
+/*
+ * A frozen network is one read-only blob:
+ *
+ *	header | layer descriptors | W1 b1 | W2 b2 | ... | Wout bout
+ *
+ * every weight matrix and bias vector starting on a NN_FROZEN_ALIGNMENT
+ * boundary, in the order the forward pass reads them. Offsets are relative to
+ * the start of the blob, so the same bytes are the on-disk format and loading
+ * is a single mmap. Byte order is the host's, data_size guards against a
+ * data_type mismatch.
+ */
+struct NN_frozen_header {
+	uint32_t magic;
+	uint16_t version;
+	uint8_t data_size;
+	uint8_t flags;
+	uint32_t input_size;
+	uint32_t layers;		// hidden layers + output layer
+	uint32_t max_width;
+	uint32_t reserved;
+	uint64_t size;			// bytes in the blob
+};
+
+struct NN_frozen_layer {
+	uint32_t rows;
+	uint32_t columns;
+	uint64_t weights;		// offset of the rows x columns weight matrix
+	uint64_t biases;		// offset of the rows biases
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+typedef struct {
+	const struct NN_frozen_header* header;
+	const struct NN_frozen_layer* layers;
+	const char* blob;
+	size_t mapped;			// bytes to munmap
+} NN_frozen;
+
+short NeuralNetwork_freeze(struct NeuralNetwork* NN, NN_frozen* dst);
+short NN_frozen_thaw(NN_frozen* model, struct NeuralNetwork* dst);
+void NN_frozen_free(NN_frozen* model);
+
+short NN_frozen_save(NN_frozen* model, char* outputfile);
+short NN_frozen_load(NN_frozen* dst, char* inputfile);
+
+// scratch has to hold NN_frozen_scratch_size(model) elements, dst the output layer
+uint32_t NN_frozen_scratch_size(NN_frozen* model);
+short NN_frozen_feed(NN_frozen* model, Vector* input, Vector* dst, data_type* scratch);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef c61e08_GRADCODEC
+#define c61e08_GRADCODEC
+
+#include <neural-network.h>
+
+#define NN_GRADIENT_MAGIC 0x43474e4eu	// "NNGC"
+#define NN_GRADIENT_VERSION 2
+
+// header flags
+#define NN_GRADIENT_SPARSE 0x01		// tensors are (index, value) pairs
+#define NN_GRADIENT_DELTA 0x02		// indices are varint gaps
+#define NN_GRADIENT_FLAGS (NN_GRADIENT_SPARSE | NN_GRADIENT_DELTA)
+
+/*
+ * Gradient exchange format:
+ *
+ *	header | per layer: weights tensor, biases tensor
+ *	tensor = u64 count | u64 stored | stored values or (index, value) pairs
+ *
+ * Values are fp32, fp16 or bf16 (round to nearest even). Sparse tensors keep
+ * the `density` fraction of entries with the largest magnitude, indices
+ * ascending, either as u32 (u64 in tensors of more than 2^32 entries) or,
+ * with delta, as LEB128 varints of the gap to the previous index. Byte order
+ * is the host's.
+ *
+ * With error feedback the encoder keeps, per weight, whatever it didn't send
+ * (dropped entries and rounding error) and adds it to the next gradient
+ * before choosing what to send, so nothing is lost, only delayed.
+ *
+ * Encoding and decoding stream between the layer buffers and the FILE, a
+ * decode consumes exactly one message so several can follow each other on a
+ * pipe. The top-k threshold is exact, found by a radix select over the
+ * magnitude bits (three histogram passes), so nothing is sorted or copied;
+ * entries tied with it are taken in index order.
+ */
+
+enum NN_gradient_precision {
+	NN_GRADIENT_FP32 = 0,
+	NN_GRADIENT_FP16 = 1,
+	NN_GRADIENT_BF16 = 2,
+};
+
+typedef struct {
+	enum NN_gradient_precision precision;
+	float density;			// fraction of every tensor sent, 0 or >= 1 = dense
+	char delta;				// varint gap indices, sparse only
+	char error_feedback;
+} NN_gradient_codec_config;
+
+struct NN_gradient_codec {
+	NN_gradient_codec_config config;
+	struct layer_gradient* residual;	// error feedback only
+};
+
+struct NN_gradient_header {
+	uint32_t magic;
+	uint16_t version;
+	uint8_t precision;
+	uint8_t flags;
+	uint32_t tensors;		// 2 per layer
+	uint32_t reserved;
+};
+
+short NN_gradient_codec_init(struct NN_gradient_codec* dst, struct NeuralNetwork* NN, NN_gradient_codec_config config);
+void NN_gradient_codec_free(struct NN_gradient_codec* codec, struct NeuralNetwork* NN);
+
+// bytes, if given, gets the size of the message
+short NN_gradient_encode(struct NN_gradient_codec* codec, struct NeuralNetwork* NN, struct layer_gradient* gradient, FILE* file, size_t* bytes);
+// accumulate adds the message into gradient instead of overwriting it
+short NN_gradient_decode(struct NeuralNetwork* NN, struct layer_gradient* gradient, FILE* file, char accumulate);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef d4a7e2_CACHE
+#define d4a7e2_CACHE
+
+#include <pthread.h>
+#include <neural-network.h>
+
+#define NN_CACHE_SHARDS 16
+#define NN_CACHE_NONE UINT32_MAX
+
+/*
+ * Bounded LRU cache of NeuralNetwork_feed results for repeated inputs.
+ *
+ * Inputs are hashed by their bits and compared in full on a hit, so only
+ * exact repeats are served from the cache. Entries live in one slab allocated
+ * up front: input followed by output, capacity of them. The cache is split into
+ * shards with a lock each, picked by the high bits of the hash, so concurrent
+ * callers only contend when they hit the same shard.
+ *
+ * A shard empties itself when it sees the network's generation changed
+ * (apply_gradient, import, randomize, async training). Results of a feed that
+ * overlapped a weight write are returned but not stored.
+ */
+struct NN_cache_entry {
+	uint64_t hash;
+	uint32_t chain;			// next entry in the same bucket
+	uint32_t newer;			// LRU neighbours
+	uint32_t older;
+};
+
+struct NN_cache_shard {
+	pthread_mutex_t lock;
+	uint64_t generation;
+	uint32_t* buckets;
+	uint32_t mask;			// buckets - 1
+	struct NN_cache_entry* entries;
+	data_type* slab;
+	uint32_t capacity;
+	uint32_t used;
+	uint32_t newest;
+	uint32_t oldest;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t invalidations;	// times the shard was emptied, weight change or NN_cache_clear
+};
+
+struct NN_cache {
+	struct NeuralNetwork* NN;
+	uint32_t input_size;
+	uint32_t output_size;
+	uint16_t shards;
+	struct NN_cache_shard* shard;
+	size_t bytes;
+};
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t invalidations;
+	size_t entries;
+	size_t capacity;
+	size_t bytes;
+	double hit_rate;
+} NN_cache_stats;
+
+short NN_cache_init(struct NN_cache* dst, struct NeuralNetwork* NN, size_t capacity, uint16_t shards);
+void NN_cache_free(struct NN_cache* cache);
+short NN_cache_feed(struct NN_cache* cache, Vector* input, Vector* dst);
+void NN_cache_clear(struct NN_cache* cache);
+void NN_cache_get_stats(struct NN_cache* cache, NN_cache_stats* dst);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef f3c81d_KERNELS
+#define f3c81d_KERNELS
+
+#include <linear-algebra.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * The primitives linear-algebra.c and the layer code are built on, behind one
+ * table per backend:
+ *
+ *	reference	the scalar loops, summing in the order the library always
+ *				has; what the others are checked against
+ *	optimized	the same kernels on NN_lanes vectors, the default
+ *	cblas		gemv, gemm, axpy and dot from a system CBLAS loaded with
+ *				dlopen (NN_CBLAS = path of the library, or the usual
+ *				sonames), the rest from optimized; float builds only
+ *
+ * The backend is chosen by NN_BACKEND (reference, optimized or cblas) on first
+ * use, or by NN_kernels_select at any time. Matrices are row major and dense.
+ *
+ * The optimized gemv and A.B^T gemm work on blocks whose size is looked up
+ * per shape (n rows of A or B, k the length of the sums) in a small table,
+ * filled by the auto-tuner (autotune.h), whose cache is loaded on the first
+ * backend selection. Any blocking sums every element in the same order,
+ * tuning only changes the speed.
+ */
+typedef struct {
+	char* name;
+	// y = A.x, A rows x columns
+	void (*gemv)(uint32_t rows, uint32_t columns, const data_type* A, const data_type* x, data_type* y);
+	// C = op(A).op(B) + beta*C, op(A) m x k, op(B) k x n, op = transpose when trans_
+	void (*gemm)(char trans_a, char trans_b, uint32_t m, uint32_t n, uint32_t k, const data_type* A, const data_type* B, data_type beta, data_type* C);
+	// y += alpha*x
+	void (*axpy)(size_t n, data_type alpha, const data_type* x, data_type* y);
+	// y = activation(x), y may be x
+	void (*activate)(size_t n, const data_type* x, data_type* y);
+	data_type (*dot)(size_t n, const data_type* x, const data_type* y);
+} NN_kernels;
+
+enum NN_backend {
+	NN_BACKEND_REFERENCE,
+	NN_BACKEND_OPTIMIZED,
+	NN_BACKEND_CBLAS,
+	NN_BACKENDS
+};
+
+enum NN_tune_kind {
+	NN_TUNE_GEMV,
+	NN_TUNE_GEMM_ABT,		// op(A) plain, op(B) transposed: the batched forward pass
+	NN_TUNE_KINDS
+};
+
+#define NN_TUNE_MAX_ROWS 8
+#define NN_TUNE_SHAPES 64
+
+typedef struct {
+	uint8_t rows;			// rows of A summed side by side, 1 to NN_TUNE_MAX_ROWS
+	uint16_t tile;			// gemm: rows of B kept in cache across the rows of A, 0 = all
+} NN_kernel_tuning;
+
+// the default blocking: four rows, one row of B at a time
+#define NN_TUNING_DEFAULT ((NN_kernel_tuning) {.rows = 4, .tile = 1})
+
+NN_kernel_tuning NN_kernels_tuning(enum NN_tune_kind kind, uint32_t n, uint32_t k);
+// 1 = the table is full
+short NN_kernels_tune(enum NN_tune_kind kind, uint32_t n, uint32_t k, NN_kernel_tuning tuning);
+// entry i of the table, 0 past the end
+char NN_kernels_tuned(uint32_t i, enum NN_tune_kind* kind, uint32_t* n, uint32_t* k, NN_kernel_tuning* tuning);
+char* NN_tune_kind_name(enum NN_tune_kind kind);
+
+// NULL when the backend isn't available here
+const NN_kernels* NN_kernels_get(enum NN_backend backend);
+char* NN_kernels_name(enum NN_backend backend);
+short NN_kernels_select(enum NN_backend backend);
+short NN_kernels_select_name(char* name);
+enum NN_backend NN_kernels_selected(void);
+const NN_kernels* NN_kernels_current(void);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef e5b820_LANES
+#define e5b820_LANES
+
+#include <neural-network.h>
+
+/*
+ * One vector register of data_type, for code that puts independent models or
+ * examples along the lanes. GCC vector extensions, as wide as the target's
+ * registers so nothing is split or passed in memory.
+ */
+#if defined(__AVX512F__)
+#define NN_LANE_BYTES 64
+#elif defined(__AVX__)
+#define NN_LANE_BYTES 32
+#else
+#define NN_LANE_BYTES 16
+#endif
+#define NN_LANES (NN_LANE_BYTES / sizeof(data_type))
+
+typedef data_type NN_lanes __attribute__((vector_size(NN_LANE_BYTES)));
+typedef double NN_lanes_d __attribute__((vector_size(NN_LANES * sizeof(double))));
+typedef __typeof__((NN_lanes){} > (NN_lanes){}) NN_lanes_mask;
+
+static inline NN_lanes NN_lanes_select(NN_lanes_mask m, NN_lanes a, NN_lanes b) {
+	return (NN_lanes)(((NN_lanes_mask)a & m) | ((NN_lanes_mask)b & ~m));
+}
+static inline NN_lanes NN_lanes_max(NN_lanes a, NN_lanes b) {
+	return NN_lanes_select(a > b, a, b);
+}
+static inline data_type NN_lanes_sum(NN_lanes x) {
+	data_type sum = 0;
+	for (uint32_t k = 0; k < NN_LANES; k++)
+		sum += x[k];
+	return sum;
+}
+// rounded like the scalar versions, which multiply in double
+static inline NN_lanes NN_lanes_LReLU(NN_lanes x) {
+	return NN_lanes_select(x > 0, x, __builtin_convertvector(__builtin_convertvector(x, NN_lanes_d) * 0.01, NN_lanes));
+}
+static inline NN_lanes NN_lanes_d_LReLU(NN_lanes x) {
+	return NN_lanes_select(x > 0, (NN_lanes){} + 1, (NN_lanes){} + (data_type)0.01);
+}
+static inline NN_lanes NN_lanes_ReLU(NN_lanes x) {
+	return NN_lanes_select(x > 0, x, (NN_lanes){});
+}
+static inline NN_lanes NN_lanes_d_ReLU(NN_lanes x) {
+	return NN_lanes_select(x > 0, (NN_lanes){} + 1, (NN_lanes){});
+}
+
+// the activation of neural-network.h on every lane, change them together
+#ifndef activation_lanes
+//#define activation_lanes(x) NN_lanes_ReLU(x)
+#define activation_lanes(x) NN_lanes_LReLU(x)
+#endif
+#ifndef activation_derivative_lanes
+//#define activation_derivative_lanes(x) NN_lanes_d_ReLU(x)
+#define activation_derivative_lanes(x) NN_lanes_d_LReLU(x)
+#endif
+
+#endif
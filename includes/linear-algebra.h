@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <term_colors.h>
 #include <math.h>
+#include <memory-accounting.h>
 
 #define sfree(P) ({free(P);P=(void*)0;})
 #ifndef data_type
@@ -27,6 +28,9 @@ typedef struct {
 } Vector;
 
 
+short linear_err(char* msg, short code, char* func);
+short linear_death(char* msg, short code);
+
 void vector_free(Vector* vector);
 void matrix_free(Matrix* matrix);
 short to_vector(Matrix* matrix, Vector* dst);
@@ -39,10 +43,15 @@ void matrix_add(Matrix* m, uint32_t row, uint32_t column, data_type value);
 void vector_set(Vector* m, uint32_t index, data_type value);
 void vector_add(Vector* m, uint32_t index, data_type value);
 
-short vector_init(Vector* dst, uint32_t size);
-short matrix_init(Matrix* dst, uint32_t rows, uint32_t columns);
-short vector_new(Vector* dst, uint32_t size);
-short matrix_new(Matrix* dst, uint32_t rows, uint32_t columns);
+short vector_init_at(Vector* dst, uint32_t size, const char* file, int line);
+short matrix_init_at(Matrix* dst, uint32_t rows, uint32_t columns, const char* file, int line);
+short vector_new_at(Vector* dst, uint32_t size, const char* file, int line);
+short matrix_new_at(Matrix* dst, uint32_t rows, uint32_t columns, const char* file, int line);
+// allocations are accounted to the call site, see memory-accounting.h
+#define vector_init(dst, size) vector_init_at(dst, size, __FILE__, __LINE__)
+#define matrix_init(dst, rows, columns) matrix_init_at(dst, rows, columns, __FILE__, __LINE__)
+#define vector_new(dst, size) vector_new_at(dst, size, __FILE__, __LINE__)
+#define matrix_new(dst, rows, columns) matrix_new_at(dst, rows, columns, __FILE__, __LINE__)
 
 short scale_v(Vector* v, data_type scalar);
 short add_mm(Matrix* M1, Matrix* M2, Matrix* sum);
@@ -55,6 +64,8 @@ short sub_vv_new(Vector* v1, Vector* v2, Vector* sum);
 short add_vv2(Vector* v1, Vector* v2, Vector* sum);
 
 short multiply_mm(Matrix* M1, Matrix* M2, Matrix* dst);
+short multiply_mmt_add(Matrix* M1, Matrix* M2, Matrix* dst);
+short multiply_mtm(Matrix* M1, Matrix* M2, Matrix* dst);
 short multiply_mv(Matrix* M, Vector* v, Vector* dst);
 short multiply_mv2(Matrix* M, Vector* v, Vector* dst);
 short multiply_mm_new(Matrix* M1, Matrix* M2, Matrix* dst);
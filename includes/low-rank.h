@@ -0,0 +1,55 @@
+#ifndef e4b27a_LOWRANK
+#define e4b27a_LOWRANK
+
+#include <neural-network.h>
+#include <evaluation.h>
+#include <random.h>
+
+// subspace iterations of the truncated SVD
+#define NN_LOWRANK_ITERATIONS 16
+
+/*
+ * Factored dense layers: W = U.V, U rows x rank and V rank x columns, so the
+ * forward and backward pass and the storage cost rank x (rows + columns)
+ * instead of rows x columns.
+ *
+ * U and V are one allocation and, to everything outside the kernels, one flat
+ * parameter tensor (NN_layer_parameters): gradients have that shape, so
+ * NeuralNetwork_gradient_init, apply_gradient and the gradient codec treat a
+ * factored layer like any other. backpropagation runs through both factors,
+ * which needs V.input from the forward pass (layer_vectors inner).
+ *
+ * Asynchronous, pipeline and structure of arrays training, ensembles and code
+ * generation only take dense layers. A frozen network stores U.V multiplied
+ * out.
+ */
+
+typedef struct {
+	size_t parameters_before;
+	size_t parameters_after;
+	double accuracy_before;
+	double accuracy_after;
+	float loss_before;
+	float loss_after;
+} NN_factorize_result;
+
+short NN_layer_init_lowrank(struct NN_layer* dst, uint32_t input_nodes, uint32_t nodes, uint32_t rank);
+void NN_layer_parameters(struct NN_layer* layer, Matrix* dst);
+char NeuralNetwork_is_factored(struct NeuralNetwork* NN);
+
+short NN_layer_multiply(struct NN_layer* layer, Vector* input, Vector* inner, Vector* dst);
+// dCda is left holding dC/dz
+void NN_layer_backward_lowrank(struct NN_layer* layer, Vector* z, Vector* prev_a, Vector* inner, Vector* dCda, Vector* temp_dCda, Matrix* factor_gradient, Vector* bias_gradient);
+
+// layer l of a new network factored, weights left for NeuralNetwork_randomize
+short NeuralNetwork_lowrank(struct NeuralNetwork* NN, uint32_t l, uint32_t rank);
+// dense layer to its best rank approximation, retained gets the fraction of |W|^2 kept
+short NN_layer_factorize(struct NN_layer* layer, uint32_t rank, uint64_t seed, uint64_t stream, float* retained);
+/*
+ * Post training: every layer l with ranks[l-1] != 0 is factorized, and with
+ * eval the accuracy and loss before and after are measured. A line per layer
+ * and the totals are printed, result gets them too if given.
+ */
+short NeuralNetwork_factorize(struct NeuralNetwork* NN, uint32_t* ranks, uint64_t seed, NN_eval_args* eval, NN_factorize_result* result);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef d2e9b4_MEM
+#define d2e9b4_MEM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * Accounting allocator behind matrix_init / vector_init. Every block is kept
+ * in a table next to the heap, with its size, category and allocation site
+ * (file and line of the matrix_init / vector_init call), so the library can
+ * say what it holds: live and peak bytes in total and per category, and
+ * allocation counts per training step (NN_mem_step marks the steps).
+ *
+ * Blocks are plain malloc blocks, pointers the table doesn't know are simply
+ * freed. The category is per thread: a function that allocates weights sets
+ * it with NN_mem_category and puts the previous one back when it's done.
+ *
+ * In debug mode (NN_mem_debug or NN_MEM_DEBUG=1 in the environment) the
+ * blocks still live after a NeuralNetwork_free are listed by site.
+ *
+ * Blocks of NN_MEM_MAP_THRESHOLD bytes and up (an embedding sized input
+ * layer) are anonymous mappings without swap reservation instead: pages are
+ * only backed once they're touched, so such a layer can be bigger than what
+ * malloc or the overcommit heuristic would hand out in one piece.
+ *
+ * Placement, for big machines:
+ * - huge pages (NN_mem_huge_pages, or NN_MEM_HUGE_PAGES=thp / hugetlb in the
+ *   environment): weight, gradient and activation blocks of a huge page and
+ *   up become mappings aligned to one, advised for transparent huge pages or
+ *   backed by reserved ones (MAP_HUGETLB, transparent when none are left).
+ * - first touch (NN_mem_local, per thread like the category): blocks of a
+ *   page and up become fresh mappings with the local NUMA policy, so they
+ *   land on the node of the thread that writes them first, which needn't be
+ *   the one allocating. Workers set it for their workspaces.
+ * NN_mem_get_placement samples which node the live blocks' pages are on.
+ */
+#ifndef NN_MEM_MAP_THRESHOLD
+#define NN_MEM_MAP_THRESHOLD ((size_t)1 << 30)
+#endif
+#define NN_MEM_HUGE_PAGE ((size_t)2 << 20)
+#ifndef NN_MEM_HUGE_THRESHOLD
+#define NN_MEM_HUGE_THRESHOLD NN_MEM_HUGE_PAGE
+#endif
+// pages looked up per block by NN_mem_get_placement
+#define NN_MEM_PLACEMENT_SAMPLES 64
+// nodes reported, higher ones are counted in the last
+#define NN_MEM_NODES 8
+
+enum NN_mem_category {
+	NN_MEM_SCRATCH,		// anything not tagged
+	NN_MEM_WEIGHTS,
+	NN_MEM_GRADIENTS,
+	NN_MEM_ACTIVATIONS,
+	NN_MEM_CATEGORIES
+};
+
+enum NN_mem_pages {
+	NN_MEM_PAGES_SMALL,
+	NN_MEM_PAGES_TRANSPARENT,
+	NN_MEM_PAGES_HUGETLB,
+};
+
+typedef struct {
+	size_t live;
+	size_t peak;
+	uint64_t allocations;
+	uint64_t frees;
+} NN_mem_usage;
+
+typedef struct {
+	NN_mem_usage total;
+	NN_mem_usage category[NN_MEM_CATEGORIES];
+	size_t blocks;					// live
+	size_t mapped;					// live bytes in mapped blocks
+	size_t transparent;				// of which advised for transparent huge pages
+	size_t hugetlb;					// of which on reserved huge pages
+	size_t local;					// of which placed by first touch
+	uint64_t steps;
+	uint64_t step_allocations;		// during the last step
+	uint64_t max_step_allocations;
+} NN_mem_stats;
+
+typedef struct {
+	uint32_t nodes;					// highest node seen + 1
+	size_t node[NN_MEM_CATEGORIES][NN_MEM_NODES];	// live bytes per node, estimated from samples
+	size_t untouched[NN_MEM_CATEGORIES];			// not backed by a page yet
+} NN_mem_placement;
+
+void* NN_mem_alloc(size_t bytes, const char* file, int line);
+void NN_mem_free(void* block);
+enum NN_mem_category NN_mem_category(enum NN_mem_category category);
+char* NN_mem_category_name(enum NN_mem_category category);
+void NN_mem_huge_pages(enum NN_mem_pages pages);
+char NN_mem_local(char on);
+// 1 = the kernel can't tell (no NUMA support)
+short NN_mem_get_placement(NN_mem_placement* dst);
+void NN_mem_step(void);
+void NN_mem_get_stats(NN_mem_stats* dst);
+void NN_mem_debug(char on);
+char NN_mem_debugging(void);
+size_t NN_mem_report_blocks(FILE* out);
+short NN_mem_dump_json(FILE* out);
+
+#endif
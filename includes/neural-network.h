@@ -12,6 +12,7 @@
 #include <time.h>
 #include <math.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #include <linear-algebra.h>
 #include <activation-function.h>
@@ -20,6 +21,10 @@
 //#define activation(x) ReLU(x)
 #define activation(x) LReLU(x)
 //#define activation(x) sigmoid(x)
+// branch-free C source of the same activation for generated code, in terms of x
+//#define activation_source "fmaxf(x, 0.0f)"
+#define activation_source "fmaxf(x, 0.0f) + (float)(0.01*fminf(x, 0.0f))"
+//#define activation_source "(float)(1 / (1 + exp(-(double)x)))"
 #endif
 #ifndef activation_derivative
 //#define activation_derivative(x) d_ReLU(x)
@@ -35,15 +40,33 @@
 #endif
 
 struct NN_layer {
-	Matrix weights;
+	Matrix weights;		// M = NULL in a factored layer, rows and columns still are its shape
 	Vector biases;
+	uint32_t rank;		// 0 = dense, else weights = U.V, see low-rank.h
+	Matrix U;			// rows x rank
+	Matrix V;			// rank x columns, in U's allocation right behind it
+	char frozen;		// fine-tuning: no gradient and no update, see NeuralNetwork_freeze_layer
 };
 
+enum NN_output {
+	NN_OUTPUT_ACTIVATION = 0,	// activation on the output layer, squared error loss
+	NN_OUTPUT_SOFTMAX = 1,		// softmax output, cross-entropy loss (2+ outputs)
+};
+
+/*
+ * generation changes whenever the weights do: NeuralNetwork_init starts a new
+ * epoch in the high 32 bits and every write is bracketed by
+ * NeuralNetwork_write_begin / _end, each adding one. It is odd while weights
+ * are being written, so a reader that saw the same even value before and
+ * after reading the weights read a consistent network.
+ */
 struct NeuralNetwork {
+	enum NN_output output;
 	uint16_t num_hidden_layers;
 	uint32_t input_size;
 	struct NN_layer* hidden_layers;
 	struct NN_layer output_layer;
+	_Atomic uint64_t generation;
 };
 
 struct layer_vectors {
@@ -51,15 +74,40 @@ struct layer_vectors {
 	Vector z;
 	Matrix weight_gradient;
 	Vector bias_gradient;
+	Vector mask;			// dropout keep scale of a, NULL when off
+	Vector inner;			// V times the layer input, factored layers only
+	uint16_t checkpoint;	// checkpoint interval of the workspace, 0 = everything kept
 };
 struct layer_gradient {
 	Matrix weight_gradient;
 	Vector bias_gradient;
 };
 
+// everything one thread needs to run a forward and backward pass
+// lv has num_hidden_layers + 2 entries, lv[0].a being the input
+// with a checkpoint interval K only a of every K-th layer is kept, the other
+// a and every z alias K slots of scratch that backpropagation refills segment
+// by segment from the checkpoint below it
+struct NN_workspace {
+	struct layer_vectors* lv;
+	Vector dCda;
+	Vector temp_dCda;
+	Vector desired;
+	uint16_t checkpoint;
+	Vector scratch;
+	size_t bytes;			// everything allocated for the workspace
+};
+
 
 typedef short (*inputGenerator)(size_t index, Vector* dst);
 typedef short (*labelGenerator)(size_t index, Vector* dst);
+/*
+ * gradient gets the mean gradient of the batch: newly allocated (free it with
+ * NeuralNetwork_gradient_free) or, with accumulate, added into a gradient the
+ * caller set up with NeuralNetwork_gradient_init. Accumulating micro batches
+ * of one big batch wants normalize = the size of the big batch, every example
+ * is then weighted 1/normalize instead of 1/batch_size.
+ */
 typedef struct {
 	struct NeuralNetwork* NN;
 	inputGenerator igen;
@@ -67,19 +115,62 @@ typedef struct {
 	size_t batch_start;
 	size_t batch_size;
 	struct layer_gradient* gradient;
-	float* loss;
+	float* loss;		// mean over this call's examples
+	char accumulate;
+	size_t normalize;	// 0 = batch_size
+	float dropout;		// hidden neuron drop probability, 0 = off
+	uint64_t seed;		// dropout mask seed, masks depend on it and the example only:
+						// change it every epoch or an example always gets the same one
+	uint16_t checkpoint_interval;	// keep activations every n layers only, 0 = off
+	size_t* workspace_bytes;		// peak workspace size, if not NULL
+	Matrix* inputs;		// read instead of calling igen when that is NULL,
+	Matrix* labels;		// row = example - batch_start, same for lgen
+	char soa;			// examples along vector lanes for narrow networks, see soa-training.h
 } NN_args;
 
 short NN_layer_init(struct NN_layer* dst, uint32_t input_nodes, uint32_t nodes);
+void NN_layer_free(struct NN_layer layer);
 short NeuralNetwork_init(struct NeuralNetwork* dst, uint32_t input_size, uint16_t hidden_layers);
 short NeuralNetwork_new(struct NeuralNetwork* dst, uint32_t input_size, uint16_t hidden_layers, ...);
+short NeuralNetwork_vnew(struct NeuralNetwork* dst, uint32_t input_size, uint16_t hidden_layers, va_list args);
+short NeuralNetwork_randomize(struct NeuralNetwork* NN, uint64_t seed, uint16_t threads);
 void NeuralNetwork_free(struct NeuralNetwork* NN);
+void NeuralNetwork_write_begin(struct NeuralNetwork* NN);
+void NeuralNetwork_write_end(struct NeuralNetwork* NN);
+uint64_t NeuralNetwork_generation(struct NeuralNetwork* NN);
+uint32_t get_biggest_layer(struct NeuralNetwork* NN);
+/*
+ * A frozen layer gets an empty gradient from NeuralNetwork_gradient_init (so
+ * freeze before it), nothing from backpropagation and no update from
+ * apply_gradient; backpropagation stops below the lowest trainable layer.
+ * The outputs of the leading frozen layers can be cached, see feature-cache.h.
+ */
+short NeuralNetwork_freeze_layer(struct NeuralNetwork* NN, uint32_t l, char frozen);
+// leading frozen layers
+uint32_t NeuralNetwork_frozen_layers(struct NeuralNetwork* NN);
+
+short NN_workspace_init(struct NeuralNetwork* NN, struct NN_workspace* dst, char gradients);
+short NN_workspace_init_checkpointed(struct NeuralNetwork* NN, struct NN_workspace* dst, char gradients, uint16_t interval);
+void NN_workspace_free(struct NeuralNetwork* NN, struct NN_workspace* ws);
+
+struct NN_layer* NeuralNetwork_layer(struct NeuralNetwork* NN, uint32_t l);
+short NN_layer_forward(struct NN_layer* layer, Vector* input, Vector* inner, Vector* z, Vector* a);
+void NN_layer_backward(struct NN_layer* layer, Vector* z, Vector* prev_a, Vector* dCda, Vector* temp_dCda, Matrix* weight_gradient, Vector* bias_gradient);
+short NN_layer_forward_batch(struct NN_layer* layer, Matrix* input, Matrix* output, char logits);
+short NeuralNetwork_calculate(struct NeuralNetwork* NN, struct layer_vectors* lv);
+data_type NeuralNetwork_output_delta(struct NeuralNetwork* NN, struct layer_vectors* output, Vector* desired, Vector* delta, data_type scale);
+short NeuralNetwork_backpropagation(struct NeuralNetwork* NN, struct layer_vectors* lv, Vector* dCda, Vector* temp_dCda);
+short NeuralNetwork_backpropagation_to(struct NeuralNetwork* NN, struct layer_vectors* lv, Vector* dCda, Vector* temp_dCda, uint32_t lowest);
 
 short NeuralNetwork_feed(struct NeuralNetwork* NN, Vector* input, Vector* dst);
 short NeuralNetwork_train(NN_args args);
 short NeuralNetwork_apply_gradient(struct NeuralNetwork* NeuralNetwork, struct layer_gradient* gradient, data_type lrate);
+short NeuralNetwork_gradient_init(struct NeuralNetwork* NN, struct layer_gradient* gradient);
+void NeuralNetwork_gradient_zero(struct NeuralNetwork* NN, struct layer_gradient* gradient);
+short NeuralNetwork_gradient_free(struct NeuralNetwork* NeuralNetwork, struct layer_gradient* gradient);
 
 short NeuralNetwork_export(struct NeuralNetwork* NeuralNetwork, char* outputfile);
+// replaces the layers of a live network, or fills a zeroed one
 short NeuralNetwork_import(struct NeuralNetwork* NeuralNetwork, char* inputfile);
 
 short gradient_to_file(struct NeuralNetwork* NeuralNetwork, struct layer_gradient* gradient, char* file);
@@ -0,0 +1,64 @@
+#ifndef a83f5d_PERF
+#define a83f5d_PERF
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <term_colors.h>
+
+/*
+ * Hardware counters through perf_event_open, counting the calling thread
+ * (and threads it starts, once they are joined) in user space only.
+ *
+ * Counters that can't be opened, all of them in most containers, are left out
+ * and reported as n/a; wall clock time is always there. There is no portable
+ * event for vector FP operations: on Intel FP_ARITH_INST_RETIRED 128/256 bit
+ * packed is used, anywhere else a raw event can be given in NN_PERF_FP_EVENT
+ * (hex config), without it that counter is unavailable.
+ */
+enum NN_perf_counter {
+	NN_PERF_CYCLES,
+	NN_PERF_INSTRUCTIONS,
+	NN_PERF_L1D_MISSES,
+	NN_PERF_LLC_MISSES,
+	NN_PERF_DTLB_MISSES,
+	NN_PERF_FP_VECTOR,
+	NN_PERF_COUNTERS
+};
+
+typedef struct {
+	double seconds;
+	uint64_t count[NN_PERF_COUNTERS];
+} NN_perf_sample;
+
+struct NN_perf {
+	int fd[NN_PERF_COUNTERS];
+	uint32_t available;		// bit per counter that opened
+	int error;				// errno of the first one that didn't
+};
+
+/*
+ * A measured piece of code, a kernel or a training phase. flops and bytes are
+ * the nominal work of one call, given by the caller, from which arithmetic
+ * intensity and achieved throughput are derived.
+ */
+typedef struct {
+	char* name;
+	double flops;
+	double bytes;
+	uint64_t calls;
+	NN_perf_sample total;
+	NN_perf_sample begin;
+} NN_perf_region;
+
+short NN_perf_init(struct NN_perf* dst);
+void NN_perf_free(struct NN_perf* perf);
+void NN_perf_read(struct NN_perf* perf, NN_perf_sample* dst);
+void NN_perf_begin(struct NN_perf* perf, NN_perf_region* region);
+void NN_perf_end(struct NN_perf* perf, NN_perf_region* region, uint64_t calls);
+void NN_perf_report(struct NN_perf* perf, NN_perf_region* regions, uint32_t count, FILE* out);
+
+#endif
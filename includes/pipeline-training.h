@@ -0,0 +1,28 @@
+#ifndef b83e0d_PIPELINE
+#define b83e0d_PIPELINE
+
+#include <pthread.h>
+#include <unistd.h>
+#include <neural-network.h>
+#include <spsc-queue.h>
+
+/*
+ * Pipeline parallel training for networks that are deep rather than wide.
+ *
+ * Consecutive layers are split into stages (balanced by weight count), every
+ * stage runs on its own thread. The batch is cut into micro batches which flow
+ * forward and their derivatives backward through bounded SPSC queues, every
+ * stage following a 1F1B schedule: after a warm-up of (stages - 1 - stage)
+ * forward passes it alternates one forward and one backward pass.
+ *
+ * The result is the same gradient NeuralNetwork_train produces for the batch,
+ * handed out through args.gradient the same way. igen is only called by the
+ * first stage and lgen only by the last one; an example either fails for is left
+ * out of the loss and the gradient. Dropout isn't taken.
+ *
+ * stages = 0 uses one stage per online cpu (at most one per layer),
+ * micro_batch = 0 picks a size that gives every stage a few micro batches.
+ */
+short NeuralNetwork_train_pipeline(NN_args args, uint16_t stages, uint32_t micro_batch);
+
+#endif
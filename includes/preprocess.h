@@ -0,0 +1,104 @@
+#ifndef a4d2f7_PREPROCESS
+#define a4d2f7_PREPROCESS
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <neural-network.h>
+#include <spsc-queue.h>
+#include <random.h>
+
+/*
+ * Input pipeline for IDX image sets.
+ *
+ * Worker threads turn ranges of an IDX image file (and label file) into
+ * ready batches: uint8 pixels converted and normalised four at a time,
+ * optionally warped by one of a bank of precomputed affine sampling grids and
+ * overlaid with gaussian noise. Batch b is built by worker b % workers into
+ * its own SPSC ring, so batches come out in order while several are being
+ * prepared ahead of the trainer.
+ *
+ * Batches cycle over [start, start + size) forever; sample = the running
+ * sample count, which also picks the grid and the noise, so the same seed
+ * gives the same stream of batches whatever the number of workers.
+ */
+
+struct NN_idx {
+	uint8_t type;			// 0x08 = unsigned byte, the only one read
+	uint8_t dims;
+	uint32_t shape[4];
+	size_t count;			// shape[0]
+	size_t item_size;		// bytes per item, product of the other dims
+	const uint8_t* data;
+	void* map;
+	size_t map_size;
+};
+
+short NN_idx_load(char* file, struct NN_idx* dst);
+void NN_idx_free(struct NN_idx* idx);
+
+void NN_u8_to_data(const uint8_t* restrict src, data_type* restrict dst, size_t count, data_type scale, data_type offset);
+
+typedef struct {
+	uint32_t grids;			// precomputed transforms, 0 = no affine augmentation
+	float rotation;			// max degrees either way
+	float shift;			// max pixels either way
+	float zoom;				// max relative scale either way
+	float noise;			// gaussian stddev added after normalisation, 0 = off
+} NN_augment_config;
+
+// per pixel, the 4 bilinear taps of every grid; taps outside the image read
+// the zero at index height * width
+struct NN_augment {
+	uint32_t height, width;
+	NN_augment_config config;
+	uint64_t seed;
+	uint32_t* index;		// grids x pixels x 4
+	data_type* weight;		// grids x pixels x 4
+};
+
+short NN_augment_init(struct NN_augment* dst, uint32_t height, uint32_t width, NN_augment_config config, uint64_t seed);
+void NN_augment_free(struct NN_augment* augment);
+// src has height * width + 1 values, the last one 0
+void NN_augment_apply(struct NN_augment* augment, data_type* src, data_type* dst, uint64_t sample);
+
+typedef struct {
+	uint64_t first;			// sample number of row 0
+	uint32_t count;
+	Matrix inputs;			// count x pixels
+	Matrix labels;			// count x classes
+} NN_batch;
+
+typedef struct {
+	struct NN_idx* images;
+	struct NN_idx* labels;
+	size_t start;
+	size_t size;			// 0 = everything from start
+	uint32_t batch_size;
+	uint32_t classes;		// one hot labels, 0 = the label bytes converted as they are
+	data_type scale;		// pixel * scale + offset, scale 0 = 1/255
+	data_type offset;
+	NN_augment_config augment;
+	uint64_t seed;
+	uint16_t workers;		// 0 = number of online cpus
+	uint16_t depth;			// batches buffered per worker, 0 = 2
+} NN_preprocess_config;
+
+struct NN_preprocess {
+	NN_preprocess_config config;
+	struct NN_augment augment;
+	struct preprocess_worker* worker;
+	uint16_t started;
+	uint64_t next;			// batch the consumer gets next
+	atomic_char stop;
+};
+
+short NN_preprocess_init(struct NN_preprocess* dst, NN_preprocess_config config);
+NN_batch* NN_preprocess_next(struct NN_preprocess* pp);
+void NN_preprocess_release(struct NN_preprocess* pp);
+void NN_preprocess_free(struct NN_preprocess* pp);
+
+#endif
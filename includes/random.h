@@ -0,0 +1,42 @@
+#ifndef d7a913_RANDOM
+#define d7a913_RANDOM
+
+#include <linear-algebra.h>
+#include <pthread.h>
+
+/*
+ * Philox4x32-10 counter based generator.
+ *
+ * Every value is a pure function of (seed, stream, index): there is no state to
+ * share or lock, and any range of a sequence can be generated on its own. Filling
+ * a buffer from several threads therefore gives exactly the bytes a single
+ * thread would. One Philox block gives 4 uniforms or 4 normals (two Box-Muller
+ * pairs), value i of a sequence comes from block i/4, lane i%4.
+ *
+ * Streams separate the users of one seed, see NN_RNG_STREAM.
+ */
+
+enum NN_rng_purpose {
+	NN_RNG_WEIGHTS = 1,		// index = layer (1 based, like layer_vectors)
+	NN_RNG_DROPOUT = 2,		// index = layer, sequence index = example * layer size + neuron
+	NN_RNG_CONV = 3,		// index = feature layer
+	NN_RNG_AUGMENT = 4,		// index 0 = grid parameters, 1 = grid picked per sample
+	NN_RNG_NOISE = 5,		// sequence index = sample * pixels + pixel
+	NN_RNG_FACTORS = 6,		// index = layer, V of a factored layer and the start of its truncated SVD
+};
+#define NN_RNG_STREAM(purpose, index) (((uint64_t)(purpose) << 32) | (uint32_t)(index))
+
+// below this many values the parallel fill stays on the calling thread
+#define NN_RNG_PARALLEL_MIN 65536
+
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]);
+uint64_t rng_time_seed(void);
+
+void rng_fill_uniform(uint64_t seed, uint64_t stream, uint64_t offset, data_type* dst, size_t count);
+void rng_fill_normal(uint64_t seed, uint64_t stream, uint64_t offset, data_type* dst, size_t count, data_type mean, data_type stddev);
+short rng_fill_normal_parallel(uint64_t seed, uint64_t stream, data_type* dst, size_t count, data_type mean, data_type stddev, uint16_t threads);
+
+// inverted dropout: mask[i] = 1/(1-rate) with probability 1-rate, 0 otherwise
+void rng_dropout_mask(uint64_t seed, uint64_t stream, uint64_t index, float rate, Vector* mask);
+
+#endif
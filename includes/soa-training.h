@@ -0,0 +1,29 @@
+#ifndef f0a93c_SOA
+#define f0a93c_SOA
+
+#include <neural-network.h>
+#include <lanes.h>
+
+// examples per block, a multiple of NN_LANES
+#define NN_SOA_BLOCK 16
+#define NN_SOA_VECTORS (NN_SOA_BLOCK / NN_LANES)
+// widest layer (input included) the structure of arrays path takes
+#define NN_SOA_MAX_WIDTH 64
+
+/*
+ * Training for narrow networks with the batch in structure of arrays layout:
+ * NN_SOA_BLOCK examples sit along the vector lanes, every neuron of a layer is
+ * a row of NN_SOA_VECTORS vectors, and each weight is broadcast and applied to
+ * the whole block at once. Weight gradients are summed per lane over the batch
+ * and reduced once at the end.
+ *
+ * Same contract as NeuralNetwork_train (gradient, accumulate, normalize, loss,
+ * inputs/labels), NeuralNetwork_train takes this path for args.soa when the
+ * network is narrow and dense, nothing is frozen and dropout is off. The
+ * gradient equals the per example one up to the order the examples are summed
+ * in. Frozen layers called here directly are run through but not accumulated.
+ */
+char NeuralNetwork_is_narrow(struct NeuralNetwork* NN);
+short NeuralNetwork_train_soa(NN_args args);
+
+#endif
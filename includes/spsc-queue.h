@@ -0,0 +1,42 @@
+#ifndef f52c19_SPSC
+#define f52c19_SPSC
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <term_colors.h>
+
+#define SPSC_CACHE_LINE 64
+
+/*
+ * Bounded lock-free single producer / single consumer ring of fixed size
+ * elements. Elements live inside the ring, so the producer can fill a slot in
+ * place (spsc_push_slot + spsc_push_commit) and the consumer can read it in
+ * place (spsc_pop_slot + spsc_pop_commit) without an extra copy.
+ */
+typedef struct {
+	_Alignas(SPSC_CACHE_LINE) atomic_size_t head;	// written by the producer only
+	_Alignas(SPSC_CACHE_LINE) atomic_size_t tail;	// written by the consumer only
+	_Alignas(SPSC_CACHE_LINE) size_t mask;
+	size_t element_size;
+	char* slots;
+} SPSC_queue;
+
+short spsc_init(SPSC_queue* dst, size_t capacity, size_t element_size);
+void spsc_free(SPSC_queue* queue);
+
+void* spsc_push_slot(SPSC_queue* queue);
+void spsc_push_commit(SPSC_queue* queue);
+void* spsc_pop_slot(SPSC_queue* queue);
+void spsc_pop_commit(SPSC_queue* queue);
+
+short spsc_push(SPSC_queue* queue, void* element);
+short spsc_pop(SPSC_queue* queue, void* dst);
+void* spsc_push_slot_wait(SPSC_queue* queue);
+void* spsc_pop_slot_wait(SPSC_queue* queue);
+size_t spsc_size(SPSC_queue* queue);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef c9e1a4_STREAM
+#define c9e1a4_STREAM
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <neural-network.h>
+#include <spsc-queue.h>
+
+/*
+ * Online training from a stream of examples on a file descriptor (pipe, FIFO,
+ * socket or file), for models refreshed continuously instead of trained over
+ * a dataset.
+ *
+ * A record is a uint32 byte count followed by that many bytes: the
+ * input_size inputs and then the outputs labels, data_type in host byte
+ * order. Records of any other length are skipped and counted. The stream
+ * ends at end of file or with NN_stream_stop.
+ *
+ * A reader thread reads records straight into the slots of a bounded ring of
+ * capacity examples. The training thread (NN_stream_run) takes batch_size of
+ * them at a time and applies the update of each batch as soon as it's formed.
+ * When training falls behind the ring fills, the reader stops reading and the
+ * writer blocks on the full pipe or socket: memory stays at the ring, one
+ * batch and one gradient however long the stream runs. With flush_ms a
+ * partial batch is trained once no example has arrived for that long, so a
+ * slow stream still updates the model; the last partial batch always is.
+ */
+typedef struct {
+	struct NeuralNetwork* NN;
+	int fd;						// left open
+	uint32_t batch_size;		// 0 = 32
+	uint32_t capacity;			// examples buffered, 0 = 4 * batch_size
+	uint32_t flush_ms;			// 0 = only full batches until the stream ends
+	data_type lrate;
+	char soa;					// like NN_args
+} NN_stream_config;
+
+typedef struct {
+	uint64_t received;			// records queued by the reader
+	uint64_t rejected;			// records of the wrong length, and a truncated last one
+	uint64_t stalls;			// times the reader found the ring full
+	uint64_t examples;			// trained on
+	uint64_t batches;
+	uint64_t partial;			// batches trained short of batch_size
+	float loss;					// mean over the last batch
+} NN_stream_stats;
+
+struct NN_stream {
+	NN_stream_config config;
+	SPSC_queue ring;			// examples, inputs then labels
+	pthread_t reader;
+	Matrix inputs;				// batch_size x input_size
+	Matrix labels;				// batch_size x outputs
+	struct layer_gradient* gradient;
+	data_type* discard;			// chunk for skipping bad records
+	atomic_char stop;
+	atomic_char done;			// the reader is finished, set after its last push
+	atomic_char failed;			// it finished on a read error
+	_Atomic uint64_t received, rejected, stalls, examples, batches, partial;
+	_Atomic float loss;
+};
+
+short NN_stream_init(struct NN_stream* dst, NN_stream_config config);
+// returns once the stream has ended and been trained on, or after NN_stream_stop
+short NN_stream_run(struct NN_stream* stream);
+// only an atomic store, safe from a signal handler
+void NN_stream_stop(struct NN_stream* stream);
+void NN_stream_get_stats(struct NN_stream* stream, NN_stream_stats* dst);
+void NN_stream_free(struct NN_stream* stream);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef b83e4d_TRAINER
+#define b83e4d_TRAINER
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <neural-network.h>
+#include <random.h>
+#include <asynchronous-training.h>
+#include <evaluation.h>
+#include <spsc-queue.h>
+#include <preprocess.h>
+#include <feature-cache.h>
+
+/*
+ * Training loop with learning rate schedules and periodic evaluation.
+ *
+ * Every step trains on the next batch of [train_start, train_start +
+ * train_size) and pushes one NN_metric into a ring that a logger thread
+ * drains into the log file and the gnuplot pipe. The training thread never
+ * touches stdio: when the ring is full the metric is dropped and counted.
+ */
+
+enum NN_lr_schedule {
+	NN_LR_CONSTANT,
+	NN_LR_LINEAR,		// lrate - gamma every lr_step steps
+	NN_LR_STEP,			// lrate * gamma every lr_step steps
+	NN_LR_EXPONENTIAL,	// lrate * gamma^step
+	NN_LR_COSINE,		// from lrate down to min_lrate over lr_step steps
+};
+
+typedef struct {
+	uint64_t step;
+	float train_loss;
+	float test_loss;		// of the last evaluation
+	float accuracy;			// of the last evaluation
+	data_type lrate;
+	char evaluated;			// evaluated on this step
+	double seconds;			// since NN_trainer_run started
+} NN_metric;
+
+typedef struct {
+	struct NeuralNetwork* NN;
+	inputGenerator igen;
+	labelGenerator lgen;
+	size_t train_start;
+	size_t train_size;
+	size_t batch_size;
+	size_t micro_batch;			// accumulated per train call, 0 = the whole batch at once
+	struct NN_preprocess* preprocess;	// batches come from here instead of igen/lgen,
+										// batch_size and train_* are then ignored
+	inputGenerator test_igen;
+	labelGenerator test_lgen;
+	size_t test_start;
+	size_t test_size;
+
+	uint64_t steps;				// 0 = until NN_trainer_stop
+	uint32_t eval_interval;		// steps between evaluations, 0 = never
+	uint16_t eval_threads;		// like NN_eval_args, 0 = number of online cpus
+	char async;					// hogwild epochs over the batch instead of NeuralNetwork_train
+	uint16_t threads;			// async workers
+	float dropout;
+	uint64_t seed;				// mixed with the epoch for the dropout masks
+	uint16_t checkpoint_interval;
+	char soa;					// batch along the vector lanes, see soa-training.h
+	struct NN_feature_cache* features;	// train the layers after the frozen ones from here,
+										// its range has to hold train_*, no dropout
+
+	enum NN_lr_schedule schedule;
+	data_type lrate;
+	data_type min_lrate;
+	uint64_t lr_step;
+	float lr_gamma;
+
+	FILE* log;					// "step\ttrain loss\ttest loss" lines, optional
+	FILE* plot;					// gnuplot, optional, needs log_name
+	char* log_name;
+	uint32_t plot_interval;		// seconds between replots
+	size_t ring;				// metric ring capacity, 0 = NN_TRAINER_RING
+} NN_trainer_config;
+
+#define NN_TRAINER_RING 4096
+// consecutive failed steps NN_trainer_run gives up after
+#define NN_TRAINER_MAX_FAILURES 16
+
+struct NN_trainer {
+	NN_trainer_config config;
+	struct layer_gradient* gradient;
+	SPSC_queue metrics;
+	pthread_t logger;
+	atomic_char stop;			// asks NN_trainer_run to return
+	atomic_char done;			// asks the logger to drain and exit
+	atomic_size_t dropped;		// metrics lost to a full ring
+	uint64_t step;
+	uint64_t failed;			// steps skipped because training failed
+	NN_metric last;
+};
+
+data_type NN_trainer_lrate(NN_trainer_config* config, uint64_t step);
+
+short NN_trainer_init(struct NN_trainer* dst, NN_trainer_config config);
+// 1 after NN_TRAINER_MAX_FAILURES failed steps in a row
+short NN_trainer_run(struct NN_trainer* trainer);
+void NN_trainer_stop(struct NN_trainer* trainer);
+void NN_trainer_free(struct NN_trainer* trainer);
+
+#endif
@@ -29,3 +29,70 @@ data_type d_tanh(data_type input) {
 	data_type t = tanh(input);
 	return 1.0 - t*t;
 }
+
+
+/*
+ * Numerically stable softmax: exp(x - max) / sum. probs may be logits.
+ */
+void softmax_v(Vector* logits, Vector* probs) {
+	uint32_t size = logits->size;
+	data_type max = logits->V[0];
+	data_type sum = 0.0f;
+	for (uint32_t i = 1; i < size; i++)
+		max = logits->V[i] > max ? logits->V[i] : max;
+	for (uint32_t i = 0; i < size; i++)
+		sum += probs->V[i] = exp(logits->V[i] - max);
+	data_type inv = 1.0f / sum;
+	for (uint32_t i = 0; i < size; i++)
+		probs->V[i] *= inv;
+	probs->size = size;
+}
+
+/*
+ * Fused softmax + cross-entropy on raw pointers. Returns -sum(y * log p), fills
+ * probs with p and, when given, grad with scale * (p - y) which is the
+ * derivative of the loss with respect to the logits.
+ * The log is never taken per element: -y*log(p) = y*(max - x) + y*log(sum),
+ * so the max is the only extra pass and probs may alias logits.
+ */
+static data_type fused_softmax_cross_entropy(data_type* x, data_type* y, data_type* p, data_type* grad, uint32_t size, data_type scale) {
+	data_type max = x[0];
+	data_type sum = 0.0f, dot = 0.0f, mass = 0.0f;
+	for (uint32_t i = 1; i < size; i++)
+		max = x[i] > max ? x[i] : max;
+	for (uint32_t i = 0; i < size; i++) {
+		dot += y[i] * (max - x[i]);
+		mass += y[i];
+		sum += p[i] = exp(x[i] - max);
+	}
+	data_type inv = 1.0f / sum;
+	if (grad)
+		for (uint32_t i = 0; i < size; i++) {
+			p[i] *= inv;
+			grad[i] = scale * (p[i] - y[i]);
+		}
+	else
+		for (uint32_t i = 0; i < size; i++)
+			p[i] *= inv;
+	return dot + mass * log(sum);
+}
+
+data_type softmax_cross_entropy_v(Vector* logits, Vector* target, Vector* probs, Vector* grad, data_type scale) {
+	probs->size = logits->size;
+	if (grad) grad->size = logits->size;
+	return fused_softmax_cross_entropy(logits->V, target->V, probs->V, grad ? grad->V : NULL, logits->size, scale);
+}
+
+// one example per row, returns the summed loss of all rows
+data_type softmax_cross_entropy_m(Matrix* logits, Matrix* targets, Matrix* probs, Matrix* grad, data_type scale) {
+	uint32_t size = logits->columns;
+	data_type loss = 0.0f;
+	for (uint32_t row = 0; row < logits->rows; row++) {
+		size_t offset = (size_t)row * size;
+		loss += fused_softmax_cross_entropy(logits->M + offset, targets->M + offset, probs->M + offset,
+				grad ? grad->M + offset : NULL, size, scale);
+	}
+	probs->rows = logits->rows;
+	probs->columns = size;
+	return loss;
+}
@@ -0,0 +1,189 @@
+#include <asynchronous-training.h>
+#include <low-rank.h>
+
+struct async_worker {
+	NN_async_args* args;
+	pthread_t thread;
+	uint16_t id;
+	double loss;
+	size_t failed;
+	short err;
+};
+
+static inline data_type relaxed_load(data_type* p) {
+	data_type v;
+	__atomic_load(p, &v, __ATOMIC_RELAXED);
+	return v;
+}
+static inline void relaxed_store(data_type* p, data_type v) {
+	__atomic_store(p, &v, __ATOMIC_RELAXED);
+}
+
+/*
+ * Same walk as NeuralNetwork_backpropagation, but instead of accumulating into
+ * lv[layer].weight_gradient every update goes straight into the shared layer.
+ * The weight is read before it is updated so the propagated derivative matches
+ * the one the forward pass saw (as far as other threads let it).
+ * Zero activations produce no weight update, so sparse inputs don't touch
+ * (and don't fight over) the corresponding cache lines.
+ */
+static void hogwild_backpropagation(struct NeuralNetwork* NN, struct layer_vectors* lv, Vector* dCda, Vector* temp_dCda, data_type lrate) {
+	data_type dadz_dCda, step, w, a;
+	uint32_t layer, neuron, weight;
+	struct NN_layer* current_layer = &NN->output_layer;
+	Vector* prev_activations;
+	data_type* dp_temp;
+	size_t mi;
+
+	// a softmax output hands in the derivative with respect to z already
+	char linear = NN->output == NN_OUTPUT_SOFTMAX;
+
+	layer = NN->num_hidden_layers+1;
+	uint32_t lowest = NeuralNetwork_frozen_layers(NN) + 1;
+	if (lowest > layer) return;
+	while (1) {
+		prev_activations = &lv[layer-1].a;
+		mi = 0;
+		for (neuron = 0; neuron < current_layer->biases.size; neuron++) {
+			dadz_dCda = (linear ? 1.0f : activation_derivative(lv[layer].z.V[neuron]))*dCda->V[neuron];
+			// a frozen layer only passes the derivative on
+			if (current_layer->frozen) {
+				for (weight = 0; weight < current_layer->weights.columns; weight++, mi++)
+					temp_dCda->V[weight] += current_layer->weights.M[mi]*dadz_dCda;
+				continue;
+			}
+			step = lrate*dadz_dCda;
+			relaxed_store(&current_layer->biases.V[neuron], relaxed_load(&current_layer->biases.V[neuron]) - step);
+			for (weight = 0; weight < current_layer->weights.columns; weight++, mi++) {
+				w = relaxed_load(&current_layer->weights.M[mi]);
+				temp_dCda->V[weight] += w*dadz_dCda;
+				if ((a = prev_activations->V[weight]) != 0.0f)
+					relaxed_store(&current_layer->weights.M[mi], w - a*step);
+			}
+		}
+		if (layer > lowest) layer--;
+		else break;
+		linear = 0;
+		current_layer = &NN->hidden_layers[layer-1];
+		dp_temp = dCda->V;
+		dCda->V = temp_dCda->V;
+		temp_dCda->V = dp_temp;
+		memset(dp_temp, 0, current_layer->weights.columns * sizeof(data_type));
+		dCda->size = temp_dCda->size;
+		temp_dCda->size = current_layer->biases.size;
+	}
+}
+
+static void* async_worker_run(void* arg) {
+	struct async_worker* worker = arg;
+	NN_async_args* args = worker->args;
+	struct NeuralNetwork* NN = args->NN;
+	struct NN_workspace ws;
+	uint32_t n = NN->num_hidden_layers + 1;
+	size_t end = args->start + args->size;
+	size_t memset_size = get_biggest_layer(NN) * sizeof(data_type);
+	data_type loss;
+	int err = 0;
+
+	// allocated and first touched by the worker itself so the pages land next to it
+	char local = NN_mem_local(1);
+	short failed = NN_workspace_init(NN, &ws, 0);
+	NN_mem_local(local);
+	if (failed) {
+		worker->err = 1;
+		return NULL;
+	}
+
+	for (uint32_t epoch = 0; epoch < args->epochs; epoch++) {
+		char last = epoch + 1 == args->epochs;
+		for (size_t example = args->start + worker->id; example < end; example += args->threads) {
+			if (args->igen(example, &ws.lv[0].a)) goto INPUT_GEN_err;
+			if (NeuralNetwork_calculate(NN, ws.lv)) goto PRE_CALC_err;
+			if (args->lgen(example, &ws.desired)) goto LABEL_GEN_err;
+			loss = NeuralNetwork_output_delta(NN, &ws.lv[n], &ws.desired, &ws.dCda, 1.0f);
+			if (last) worker->loss += loss;
+			memset(ws.temp_dCda.V, 0, memset_size);
+			hogwild_backpropagation(NN, ws.lv, &ws.dCda, &ws.temp_dCda, args->lrate);
+
+			continue;
+			LABEL_GEN_err: err++;
+			PRE_CALC_err: err++;
+			INPUT_GEN_err: err++;
+			char* msg[] = {
+				NULL,
+				"Failed to generate input",
+				"Failed to precalculate neural network state",
+				"Failed to generate a label",
+			};
+			printf(FG_GRAY "[Neural Network Async Learning] " C_RESET FG_GREEN FG_BRIGHT "Worker %u, example %zu - " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", worker->id, example, msg[err]);
+			worker->failed++;
+			err = 0;
+		}
+	}
+
+	NN_workspace_free(NN, &ws);
+	return NULL;
+}
+
+short NeuralNetwork_train_async(NN_async_args args) {
+	if (!args.NN || !args.igen || !args.lgen || !args.size || !args.epochs) return 11;
+	if (NeuralNetwork_is_factored(args.NN)) {
+		puts(FG_GRAY "[Neural Network Async Learning] " C_RESET FG_RED FG_BRIGHT "Factored layers only train synchronously" C_RESET);
+		return 2;
+	}
+	if (!args.threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		args.threads = cpus > 0 ? cpus : 1;
+	}
+	if (args.threads > args.size) args.threads = args.size;
+
+	struct async_worker* workers;
+	struct timespec begin, end;
+	uint16_t started;
+	double loss = 0.0;
+	size_t failed = 0;
+	short ret = 0;
+
+	if (!(workers = calloc(args.threads, sizeof(struct async_worker)))) {
+		puts(FG_GRAY "[Neural Network Async Learning] " C_RESET FG_RED FG_BRIGHT "Failed to allocate worker array" C_RESET);
+		return 1;
+	}
+
+	NeuralNetwork_write_begin(args.NN);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (started = 0; started < args.threads; started++) {
+		workers[started].args = &args;
+		workers[started].id = started;
+		if (pthread_create(&workers[started].thread, NULL, async_worker_run, &workers[started])) {
+			printf(FG_GRAY "[Neural Network Async Learning] " C_RESET FG_RED FG_BRIGHT "Failed to start worker %u" C_RESET "\n", started);
+			ret = 2;
+			break;
+		}
+	}
+	for (uint16_t t = 0; t < started; t++) {
+		pthread_join(workers[t].thread, NULL);
+		if (workers[t].err) {
+			printf(FG_GRAY "[Neural Network Async Learning] " C_RESET FG_RED FG_BRIGHT "Worker %u failed to initialise its workspace" C_RESET "\n", t);
+			ret = 3;
+		}
+		loss += workers[t].loss;
+		failed += workers[t].failed;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	NeuralNetwork_write_end(args.NN);
+	if (!ret && failed == args.size * args.epochs) {
+		puts(FG_GRAY "[Neural Network Async Learning] " C_RESET FG_RED FG_BRIGHT "Every example failed" C_RESET);
+		ret = 4;
+	}
+
+	// same scale as NeuralNetwork_train
+	if (args.loss)
+		*args.loss = loss / (double)args.size;
+	if (args.examples_per_second) {
+		double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+		*args.examples_per_second = seconds > 0.0 ? (double)args.size * args.epochs / seconds : 0.0;
+	}
+
+	free(workers);
+	return ret;
+}
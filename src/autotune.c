@@ -0,0 +1,233 @@
+#include <autotune.h>
+#include <unistd.h>
+
+static short autotune_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Autotune] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+// NULL when there's no path to use; create makes the default directory
+static char* cache_path(char* path, char* buf, size_t size, char create) {
+	if (path) return path;
+	if ((path = getenv("NN_TUNE_CACHE")) && *path) return path;
+	char* home = getenv("HOME");
+	if (!home || !*home) return NULL;
+	if (snprintf(buf, size, "%s/.cache", home) >= (int)size) return NULL;
+	if (create) mkdir(buf, 0755);
+	if (snprintf(buf, size, "%s/.cache/neural-network-kernels", home) >= (int)size) return NULL;
+	return buf;
+}
+
+// the model name of /proc/cpuinfo, tabs turned into spaces as the cache separates with them
+char* NN_cpu_model(char* dst, size_t size) {
+	char line[512];
+	char* keys[] = {"model name", "cpu model", "Processor", "CPU part"};
+	FILE* f = fopen("/proc/cpuinfo", "r");
+	snprintf(dst, size, "unknown");
+	if (!f) return dst;
+	while (fgets(line, sizeof(line), f)) {
+		char* value = strchr(line, ':');
+		char found = 0;
+		if (!value) continue;
+		for (uint32_t i = 0; i < sizeof(keys) / sizeof(*keys); i++)
+			found |= !strncmp(line, keys[i], strlen(keys[i]));
+		if (!found) continue;
+		for (value++; *value == ' '; value++);
+		value[strcspn(value, "\n")] = '\0';
+		snprintf(dst, size, "%s", value);
+		break;
+	}
+	fclose(f);
+	for (char* c = dst; *c; c++)
+		if (*c == '\t') *c = ' ';
+	return dst;
+}
+
+short NN_autotune_load(char* path, uint32_t* loaded) {
+	char buf[4096], cpu[256], line[512];
+	uint32_t count = 0;
+	if (loaded) *loaded = 0;
+	if (!(path = cache_path(path, buf, sizeof(buf), 0)))
+		return autotune_err("No path for the tuning cache, set NN_TUNE_CACHE", 1);
+	FILE* f = fopen(path, "r");
+	if (!f) return errno == ENOENT ? 0 : autotune_err("Failed to open the tuning cache", 2);
+	NN_cpu_model(cpu, sizeof(cpu));
+	// lines that don't parse are skipped, the next save drops them
+	while (fgets(line, sizeof(line), f)) {
+		char kind[16], *tab = strchr(line, '\t');
+		uint32_t n, k, rows, tile;
+		if (line[0] == '#' || !tab) continue;
+		*tab = '\0';
+		if (strcmp(line, cpu) || sscanf(tab + 1, "%15s %u %u %u %u", kind, &n, &k, &rows, &tile) != 5 || tile > UINT16_MAX)
+			continue;
+		for (uint32_t t = 0; t < NN_TUNE_KINDS; t++)
+			if (!strcmp(kind, NN_tune_kind_name(t)) && !NN_kernels_tune(t, n, k, (NN_kernel_tuning) {.rows = rows, .tile = tile}))
+				count++;
+	}
+	fclose(f);
+	if (loaded) *loaded = count;
+	return 0;
+}
+
+// the cache with this CPU's lines replaced by the kernels' table, through a rename
+short NN_autotune_save(char* path) {
+	char buf[4096], tmp[4200], cpu[256], line[512];
+	enum NN_tune_kind kind;
+	uint32_t n, k;
+	NN_kernel_tuning t;
+	if (!(path = cache_path(path, buf, sizeof(buf), 1)))
+		return autotune_err("No path for the tuning cache, set NN_TUNE_CACHE", 1);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	FILE* f = fopen(tmp, "w");
+	if (!f) return autotune_err("Failed to create the tuning cache", 2);
+	FILE* old = fopen(path, "r");
+	NN_cpu_model(cpu, sizeof(cpu));
+	fprintf(f, "# neural network kernel tuning: cpu, kernel, n, k, rows, tile\n");
+	if (old) {
+		while (fgets(line, sizeof(line), old)) {
+			char* tab = strchr(line, '\t');
+			if (line[0] == '#' || !tab || ((size_t)(tab - line) == strlen(cpu) && !strncmp(line, cpu, tab - line)))
+				continue;
+			fputs(line, f);
+		}
+		fclose(old);
+	}
+	for (uint32_t i = 0; NN_kernels_tuned(i, &kind, &n, &k, &t); i++)
+		fprintf(f, "%s\t%s\t%u\t%u\t%u\t%u\n", cpu, NN_tune_kind_name(kind), n, k, t.rows, t.tile);
+	if (fclose(f) || rename(tmp, path)) {
+		remove(tmp);
+		return autotune_err("Failed to write the tuning cache", 3);
+	}
+	return 0;
+}
+
+static double seconds_since(struct timespec* begin) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec - begin->tv_sec + (now.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static void run(const NN_kernels* kernels, enum NN_tune_kind kind, uint32_t m, uint32_t n, uint32_t k, Matrix* W, Matrix* X, Matrix* Y) {
+	if (kind == NN_TUNE_GEMV) kernels->gemv(n, k, W->M, X->M, Y->M);
+	else kernels->gemm(0, 1, m, n, k, X->M, W->M, 0.0f, Y->M);
+}
+
+// seconds per call with the candidate in the table, in doubling rounds after a warm up call
+static double measure(const NN_kernels* kernels, enum NN_tune_kind kind, uint32_t m, uint32_t n, uint32_t k, Matrix* W, Matrix* X, Matrix* Y, double seconds) {
+	struct timespec begin;
+	uint64_t reps = 1, calls = 0;
+	double elapsed;
+	run(kernels, kind, m, n, k, W, X, Y);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	do {
+		for (uint64_t r = 0; r < reps; r++)
+			run(kernels, kind, m, n, k, W, X, Y);
+		calls += reps;
+		if (reps < 1u << 16) reps *= 2;
+	} while ((elapsed = seconds_since(&begin)) < seconds);
+	return elapsed / calls;
+}
+
+static short tune_shape(enum NN_tune_kind kind, uint32_t n, uint32_t k, NN_autotune_config* config) {
+	const NN_kernels* kernels = NN_kernels_get(NN_BACKEND_OPTIMIZED);
+	uint32_t rows[] = NN_AUTOTUNE_ROWS, tiles[] = NN_AUTOTUNE_TILES;
+	uint32_t tile_count = kind == NN_TUNE_GEMV ? 1 : sizeof(tiles) / sizeof(*tiles);
+	uint32_t m = kind == NN_TUNE_GEMV ? 1 : config->batch_size;
+	Matrix W = {0}, X = {0}, Y = {0};
+	NN_kernel_tuning best = NN_TUNING_DEFAULT;
+	double best_time = 0.0, default_time = 0.0;
+	if (matrix_init(&W, n, k) || matrix_init(&X, m, k) || matrix_init(&Y, m, n)) {
+		matrix_free(&W);
+		matrix_free(&X);
+		return 1;
+	}
+	rng_fill_uniform(1, NN_RNG_STREAM(NN_RNG_NOISE, 0), 0, W.M, (size_t)n * k);
+	rng_fill_uniform(1, NN_RNG_STREAM(NN_RNG_NOISE, 1), 0, X.M, (size_t)m * k);
+
+	for (uint32_t r = 0; r < sizeof(rows) / sizeof(*rows); r++)
+		for (uint32_t t = 0; t < tile_count; t++) {
+			NN_kernel_tuning candidate = {.rows = rows[r], .tile = kind == NN_TUNE_GEMV ? 0 : tiles[t]};
+			NN_kernels_tune(kind, n, k, candidate);
+			double time = measure(kernels, kind, m, n, k, &W, &X, &Y, config->seconds);
+			if (candidate.rows == NN_TUNING_DEFAULT.rows && (kind == NN_TUNE_GEMV || candidate.tile == NN_TUNING_DEFAULT.tile))
+				default_time = time;
+			if (!best_time || time < best_time) {
+				best_time = time;
+				best = candidate;
+			}
+		}
+	NN_kernels_tune(kind, n, k, best);
+	printf(FG_GRAY "[Neural Network Autotune] " C_RESET "%s %ux%u: %u rows", NN_tune_kind_name(kind), n, k, best.rows);
+	if (kind != NN_TUNE_GEMV) printf(", tile %u", best.tile);
+	printf(", %.3g us a call (default %.3g us)\n", best_time * 1e6, default_time * 1e6);
+
+	matrix_free(&W);
+	matrix_free(&X);
+	matrix_free(&Y);
+	return 0;
+}
+
+static char is_tuned(enum NN_tune_kind kind, uint32_t n, uint32_t k) {
+	enum NN_tune_kind t_kind;
+	uint32_t t_n, t_k;
+	NN_kernel_tuning t;
+	for (uint32_t i = 0; NN_kernels_tuned(i, &t_kind, &t_n, &t_k, &t); i++)
+		if (t_kind == kind && t_n == n && t_k == k)
+			return 1;
+	return 0;
+}
+
+short NN_autotune(struct NeuralNetwork* NN, NN_autotune_config config) {
+	if (!NN) return 11;
+	int err = 0;
+	uint32_t layers = NN->num_hidden_layers + 1, shapes = 0, loaded, measured = 0;
+	uint32_t (*shape)[2] = NULL;
+	if (!config.batch_size) config.batch_size = 64;
+	if (config.seconds <= 0.0) config.seconds = 0.02;
+
+	// a cache that can't be read is measured over
+	NN_autotune_load(config.cache, &loaded);
+	if (!(shape = calloc(2 * layers, sizeof(*shape)))) goto SHAPE_err;
+	for (uint32_t l = 1; l <= layers; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		uint32_t rows = layer->weights.rows, columns = layer->weights.columns;
+		uint32_t candidates[2][2] = {{rows, columns}, {0, 0}};
+		if (layer->rank) {
+			candidates[0][0] = layer->rank;
+			candidates[1][0] = rows;
+			candidates[1][1] = layer->rank;
+		}
+		for (uint32_t c = 0; c < 2 && candidates[c][0]; c++) {
+			uint32_t s = 0;
+			while (s < shapes && !(shape[s][0] == candidates[c][0] && shape[s][1] == candidates[c][1])) s++;
+			if (s == shapes) {
+				shape[s][0] = candidates[c][0];
+				shape[s][1] = candidates[c][1];
+				shapes++;
+			}
+		}
+	}
+
+	for (uint32_t s = 0; s < shapes; s++)
+		for (uint32_t kind = 0; kind < NN_TUNE_KINDS; kind++) {
+			if (!config.retune && is_tuned(kind, shape[s][0], shape[s][1])) continue;
+			if (tune_shape(kind, shape[s][0], shape[s][1], &config)) goto TUNE_err;
+			measured++;
+		}
+	if (measured && NN_autotune_save(config.cache)) goto SAVE_err;
+	printf(FG_GRAY "[Neural Network Autotune] " C_RESET "%u shapes, %u entries from the cache, %u measured\n", shapes, loaded, measured);
+	free(shape);
+	return 0;
+
+SAVE_err: err++;
+TUNE_err: err++;
+	free(shape);
+SHAPE_err: err++;
+	char* msg[] = {
+		NULL,
+		"Failed to allocate the shapes",
+		"Failed to allocate the tuning data",
+		"Failed to save the tuning cache",
+	};
+	return autotune_err(msg[err], err);
+}
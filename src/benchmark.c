@@ -0,0 +1,164 @@
+#include <benchmark.h>
+#include <low-rank.h>
+#include <kernels.h>
+
+enum bench_region {
+	BENCH_MV,
+	BENCH_LAYER_BACKWARD,
+	BENCH_FORWARD,
+	BENCH_BACKWARD,
+	BENCH_UPDATE,
+	BENCH_STEP,
+	BENCH_REGIONS
+};
+
+static double bench_elapsed(NN_perf_sample* begin) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9 - begin->seconds;
+}
+
+// body runs in doubling rounds so the clock isn't read around tiny kernels
+#define BENCH_LOOP(perf, region, seconds, body) do { \
+	uint64_t reps_ = 1, calls_ = 0; \
+	body; \
+	NN_perf_begin(perf, region); \
+	do { \
+		for (uint64_t r_ = 0; r_ < reps_; r_++) { body; } \
+		calls_ += reps_; \
+		if (reps_ < 1u << 16) reps_ *= 2; \
+	} while (bench_elapsed(&(region)->begin) < (seconds)); \
+	NN_perf_end(perf, region, calls_); \
+} while (0)
+
+// every region once on the selected kernels, then the report
+static void bench_run(struct NeuralNetwork* NN, struct NN_perf* perf, struct NN_workspace* ws, struct layer_gradient* gradient, Matrix* inputs, Matrix* labels, NN_bench_config config) {
+	uint32_t n = NN->num_hidden_layers + 1, outputs = NN->output_layer.biases.size;
+	// nominal work: every operand read or written once per use, a factored
+	// layer's weights being U and V
+	double weights = 0, biases = 0, s = sizeof(data_type);
+	for (uint32_t l = 1; l <= n; l++) {
+		Matrix parameters;
+		NN_layer_parameters(NeuralNetwork_layer(NN, l), &parameters);
+		weights += (double)parameters.rows * parameters.columns;
+		biases += NeuralNetwork_layer(NN, l)->biases.size;
+	}
+	struct NN_layer* first = NeuralNetwork_layer(NN, 1);
+	double r = first->weights.rows, c = first->weights.columns;
+	NN_perf_region regions[BENCH_REGIONS] = {
+		[BENCH_MV] = {.name = "multiply_mv", .flops = 2*r*c, .bytes = s*(r*c + c + r)},
+		[BENCH_LAYER_BACKWARD] = {.name = "NN_layer_backward", .flops = 4*r*c, .bytes = s*(3*r*c + 2*c + 3*r)},
+		[BENCH_FORWARD] = {.name = "forward", .flops = 2*weights + 2*biases, .bytes = s*(weights + 3*biases)},
+		[BENCH_BACKWARD] = {.name = "backward", .flops = 4*weights + 3*biases, .bytes = s*(3*weights + 5*biases)},
+		[BENCH_UPDATE] = {.name = "update", .flops = 2*(weights + biases), .bytes = 3*s*(weights + biases)},
+		[BENCH_STEP] = {.name = "train step", .flops = config.batch_size * (6*weights + 5*biases) + 2*(weights + biases),
+				.bytes = s*(config.batch_size * (4*weights + 8*biases) + 3*(weights + biases))},
+	};
+
+	struct layer_vectors* lv = ws->lv;
+	data_type* own_input = lv[0].a.V;
+	lv[0].a.V = inputs->M;
+	Vector layer_input = {.size = NN->input_size, .V = inputs->M};
+	Vector layer_output = {.size = first->weights.rows, .V = lv[1].z.V};
+	// the kernels are the dense ones, a factored first layer leaves them out
+	if (!first->rank) {
+		BENCH_LOOP(perf, &regions[BENCH_MV], config.seconds,
+				multiply_mv(&first->weights, &layer_input, &layer_output));
+		BENCH_LOOP(perf, &regions[BENCH_LAYER_BACKWARD], config.seconds,
+				NN_layer_backward(first, &lv[1].z, &lv[0].a, &lv[1].a, &ws->temp_dCda, &lv[1].weight_gradient, &lv[1].bias_gradient));
+	}
+	BENCH_LOOP(perf, &regions[BENCH_FORWARD], config.seconds,
+			NeuralNetwork_calculate(NN, lv));
+	memcpy(ws->desired.V, labels->M, outputs * sizeof(data_type));
+	BENCH_LOOP(perf, &regions[BENCH_BACKWARD], config.seconds, {
+			NeuralNetwork_output_delta(NN, &lv[n], &ws->desired, &ws->dCda, 1.0f);
+			memset(ws->temp_dCda.V, 0, get_biggest_layer(NN) * sizeof(data_type));
+			NeuralNetwork_backpropagation(NN, lv, &ws->dCda, &ws->temp_dCda);
+		});
+	lv[0].a.V = own_input;
+	BENCH_LOOP(perf, &regions[BENCH_UPDATE], config.seconds,
+			NeuralNetwork_apply_gradient(NN, gradient, 0.0f));
+	BENCH_LOOP(perf, &regions[BENCH_STEP], config.seconds, {
+			NeuralNetwork_gradient_zero(NN, gradient);
+			NeuralNetwork_train((NN_args) {
+					.NN = NN,
+					.inputs = inputs,
+					.labels = labels,
+					.batch_size = config.batch_size,
+					.gradient = gradient,
+					.accumulate = 1,
+				});
+			NeuralNetwork_apply_gradient(NN, gradient, 0.0f);
+		});
+
+	fprintf(config.out, "network %u", NN->input_size);
+	for (uint32_t l = 1; l <= n; l++)
+		fprintf(config.out, "-%u", NeuralNetwork_layer(NN, l)->biases.size);
+	fprintf(config.out, ", batch %zu, counters %s, kernels %s\n", config.batch_size, perf->available ? "on" : "off", NN_kernels_current()->name);
+	NN_perf_report(perf, regions, BENCH_REGIONS, config.out);
+}
+
+short NN_benchmark(NN_bench_config config) {
+	int err = 0;
+	char failed = 1;
+	struct NeuralNetwork own;
+	struct NeuralNetwork* NN = config.NN;
+	struct NN_perf perf;
+	struct NN_workspace ws;
+	struct layer_gradient* gradient = NULL;
+	Matrix inputs = {0}, labels = {0};
+	if (!config.batch_size) config.batch_size = 64;
+	if (config.seconds <= 0.0) config.seconds = 0.25;
+	if (!config.out) config.out = stdout;
+
+	if (!NN) {
+		NN = &own;
+		if (NeuralNetwork_new(NN, 784, 2, 128, 64, 10)) goto NN_err;
+		NeuralNetwork_randomize(NN, config.seed, 1);
+	}
+	uint32_t n = NN->num_hidden_layers + 1, outputs = NN->output_layer.biases.size;
+	NN_perf_init(&perf);
+	if (NN_workspace_init(NN, &ws, 1)) goto WS_err;
+	if (!(gradient = calloc(n, sizeof(struct layer_gradient))) || NeuralNetwork_gradient_init(NN, gradient)) goto GRADIENT_err;
+	if (matrix_init(&inputs, config.batch_size, NN->input_size) || matrix_init(&labels, config.batch_size, outputs)) goto DATA_err;
+	rng_fill_uniform(config.seed, NN_RNG_STREAM(NN_RNG_NOISE, 0), 0, inputs.M, config.batch_size * NN->input_size);
+	memset(labels.M, 0, config.batch_size * outputs * sizeof(data_type));
+	for (size_t e = 0; e < config.batch_size; e++)
+		labels.M[e * outputs + e % outputs] = 1.0f;
+
+	if (!config.backends) bench_run(NN, &perf, &ws, gradient, &inputs, &labels, config);
+	else for (uint32_t b = 0; b < NN_BACKENDS; b++) {
+		enum NN_backend selected = NN_kernels_selected();
+		if (!NN_kernels_get(b)) {
+			fprintf(config.out, "kernels %s: not available\n", NN_kernels_name(b));
+			continue;
+		}
+		NN_kernels_select(b);
+		bench_run(NN, &perf, &ws, gradient, &inputs, &labels, config);
+		NN_kernels_select(selected);
+	}
+
+	failed = 0;
+DATA_err: err++;
+	matrix_free(&inputs);
+	matrix_free(&labels);
+	NeuralNetwork_gradient_free(NN, gradient);
+GRADIENT_err: err++;
+	free(gradient);
+	NN_workspace_free(NN, &ws);
+WS_err: err++;
+	NN_perf_free(&perf);
+	if (NN == &own) NeuralNetwork_free(NN);
+NN_err: err++;
+
+	char* msg[] = {
+		NULL,
+		"Failed to create the benchmark network",
+		"Failed to allocate the workspace",
+		"Failed to allocate the gradient",
+		"Failed to allocate the benchmark data",
+	};
+	if (failed)
+		printf(FG_GRAY "[Neural Network Benchmark] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg[err]);
+	return failed ? err : 0;
+}
@@ -0,0 +1,106 @@
+#include <code-generator.h>
+#include <low-rank.h>
+
+static short codegen_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Codegen] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+// exact round trip for either precision, always a valid floating literal
+static void codegen_literal(FILE* file, data_type value) {
+	if (sizeof(data_type) == sizeof(float))
+		fprintf(file, "%.9ef", (double)value);
+	else
+		fprintf(file, "%.17e", (double)value);
+}
+
+static void codegen_array(FILE* file, char* name, char* kind, uint32_t l, data_type* values, size_t count, char* type) {
+	fprintf(file, "static const %s %s_%s%u[%zu] __attribute__((aligned(64))) = {", type, name, kind, l, count);
+	for (size_t i = 0; i < count; i++) {
+		fputs(i % 4 ? " " : "\n\t", file);
+		codegen_literal(file, values[i]);
+		fputc(',', file);
+	}
+	fputs("\n};\n", file);
+}
+
+short NeuralNetwork_codegen(struct NeuralNetwork* NN, char* outputfile, char* name) {
+	if (!NN || !outputfile || !name || !*name) return 11;
+#ifndef activation_source
+	return codegen_err("activation_source is not defined for the current activation", 1);
+#else
+	uint32_t n = NN->num_hidden_layers + 1;
+	char* type = sizeof(data_type) == sizeof(float) ? "float" : "double";
+	size_t weights = 0;
+	char softmax = NN->output == NN_OUTPUT_SOFTMAX;
+	FILE* file;
+
+	if (!isalpha((unsigned char)*name) && *name != '_')
+		return codegen_err("Name is not a valid C identifier", 2);
+	for (char* c = name; *c; c++)
+		if (!isalnum((unsigned char)*c) && *c != '_')
+			return codegen_err("Name is not a valid C identifier", 2);
+	if (NeuralNetwork_is_factored(NN))
+		return codegen_err("Factored layers can't be unrolled, freeze the network instead", 5);
+	for (uint32_t l = 1; l <= n; l++)
+		weights += (size_t)NeuralNetwork_layer(NN, l)->weights.rows * NeuralNetwork_layer(NN, l)->weights.columns;
+	if (weights > NN_CODEGEN_MAX_WEIGHTS)
+		return codegen_err("Network too big to unroll", 3);
+
+	if (!(file = fopen(outputfile, "w")))
+		return linear_err("NeuralNetwork_codegen: Failed to open the output file", 4, "fopen");
+
+	fprintf(file, "/* generated by NeuralNetwork_codegen, do not edit */\n");
+	fprintf(file, "#ifndef %s_GENERATED_NN\n#define %s_GENERATED_NN\n\n#include <math.h>\n\n", name, name);
+	fprintf(file, "#define %s_INPUT_SIZE %u\n", name, NN->input_size);
+	fprintf(file, "#define %s_OUTPUT_SIZE %u\n\n", name, NN->output_layer.biases.size);
+	fprintf(file, "static inline %s %s_activation(%s x) {\n\treturn %s;\n}\n\n", type, name, type, activation_source);
+	for (uint32_t l = 1; l <= n; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		codegen_array(file, name, "w", l, layer->weights.M, (size_t)layer->weights.rows * layer->weights.columns, type);
+		codegen_array(file, name, "b", l, layer->biases.V, layer->biases.size, type);
+	}
+
+	// one local per neuron, h<l>_<i>, read by the next layer, the last layer writes out[]
+	fprintf(file, "\nstatic inline void %s_forward(const %s* restrict in, %s* restrict out) {\n", name, type, type);
+	for (uint32_t l = 1; l <= n; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		for (uint32_t row = 0; row < layer->weights.rows; row++) {
+			if (l == n && softmax)
+				fprintf(file, "\tout[%u] = (", row);
+			else if (l == n)
+				fprintf(file, "\tout[%u] = %s_activation(", row, name);
+			else
+				fprintf(file, "\tconst %s h%u_%u = %s_activation(", type, l, row, name);
+			for (uint32_t i = 0; i < layer->weights.columns; i++) {
+				fprintf(file, "%s%s_w%u[%zu]*", i ? " + " : "", name, l, (size_t)row * layer->weights.columns + i);
+				if (l == 1) fprintf(file, "in[%u]", i);
+				else fprintf(file, "h%u_%u", l - 1, i);
+			}
+			fprintf(file, " + %s_b%u[%u]);\n", name, l, row);
+		}
+	}
+	if (softmax) {
+		// same steps as softmax_v, unrolled
+		uint32_t outputs = NN->output_layer.biases.size;
+		fprintf(file, "\t%s max = out[0];\n", type);
+		for (uint32_t i = 1; i < outputs; i++)
+			fprintf(file, "\tmax = out[%u] > max ? out[%u] : max;\n", i, i);
+		fprintf(file, "\t%s sum = 0.0f;\n", type);
+		for (uint32_t i = 0; i < outputs; i++)
+			fprintf(file, "\tsum += out[%u] = exp(out[%u] - max);\n", i, i);
+		fprintf(file, "\tconst %s inv = 1.0f / sum;\n", type);
+		for (uint32_t i = 0; i < outputs; i++)
+			fprintf(file, "\tout[%u] *= inv;\n", i);
+	}
+	fprintf(file, "}\n\n#endif\n");
+
+	if (ferror(file)) {
+		fclose(file);
+		return linear_err("NeuralNetwork_codegen: Failed to write the output file", 5, "fprintf");
+	}
+	if (fclose(file))
+		return linear_err("NeuralNetwork_codegen: Failed to close the output file", 6, "fclose");
+	return 0;
+#endif
+}
@@ -0,0 +1,463 @@
+#include <convolution.h>
+#include <random.h>
+
+static short conv_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Convolution] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+static size_t map_size(struct NN_feature_layer* layer) {
+	return (size_t)layer->out_channels * layer->out_height * layer->out_width;
+}
+
+short NN_convnet_init(struct NN_convnet* dst, uint32_t channels, uint32_t height, uint32_t width) {
+	if (!dst || !channels || !height || !width) return 11;
+	memset(dst, 0, sizeof(struct NN_convnet));
+	dst->channels = channels;
+	dst->height = height;
+	dst->width = width;
+	dst->seed = rng_time_seed();
+	return 0;
+}
+
+uint32_t NN_convnet_input_size(struct NN_convnet* net) {
+	return net->channels * net->height * net->width;
+}
+
+static struct NN_feature_layer* convnet_push(struct NN_convnet* net) {
+	struct NN_feature_layer* layers = realloc(net->feature_layers, (net->num_feature_layers + 1) * sizeof(struct NN_feature_layer));
+	if (!layers) return NULL;
+	net->feature_layers = layers;
+	struct NN_feature_layer* layer = &layers[net->num_feature_layers];
+	memset(layer, 0, sizeof(struct NN_feature_layer));
+	if (net->num_feature_layers) {
+		struct NN_feature_layer* prev = layer - 1;
+		layer->channels = prev->out_channels;
+		layer->height = prev->out_height;
+		layer->width = prev->out_width;
+	} else {
+		layer->channels = net->channels;
+		layer->height = net->height;
+		layer->width = net->width;
+	}
+	return layer;
+}
+
+short NN_convnet_add_conv(struct NN_convnet* net, uint32_t filters, uint32_t kernel, uint32_t stride, uint32_t padding) {
+	if (!net || !filters || !kernel || !stride) return 11;
+	struct NN_feature_layer* layer = convnet_push(net);
+	if (!layer) return conv_err("Failed to grow the feature layer array", 1);
+	if (layer->height + 2 * padding < kernel || layer->width + 2 * padding < kernel)
+		return conv_err("Kernel bigger than the padded input", 2);
+	layer->type = NN_FEATURE_CONV;
+	layer->kernel = kernel;
+	layer->stride = stride;
+	layer->padding = padding;
+	layer->out_channels = filters;
+	layer->out_height = (layer->height + 2 * padding - kernel) / stride + 1;
+	layer->out_width = (layer->width + 2 * padding - kernel) / stride + 1;
+	uint32_t fan_in = layer->channels * kernel * kernel;
+	enum NN_mem_category category = NN_mem_category(NN_MEM_WEIGHTS);
+	if (matrix_init(&layer->weights, filters, fan_in)) {
+		NN_mem_category(category);
+		return conv_err("Failed to allocate the filters", 3);
+	}
+	if (vector_init(&layer->biases, filters)) {
+		NN_mem_category(category);
+		matrix_free(&layer->weights);
+		return conv_err("Failed to allocate the biases", 3);
+	}
+	NN_mem_category(category);
+	float stddev = sqrt(2.0f / fan_in); // He initialization standard deviation
+	rng_fill_normal(net->seed, NN_RNG_STREAM(NN_RNG_CONV, net->num_feature_layers), 0, layer->weights.M, (size_t)filters * fan_in, 0.0f, stddev);
+	memset(layer->biases.V, 0, filters * sizeof(data_type));
+	net->num_feature_layers++;
+	return 0;
+}
+
+short NN_convnet_add_pool(struct NN_convnet* net, uint32_t size) {
+	if (!net || !size) return 11;
+	struct NN_feature_layer* layer = convnet_push(net);
+	if (!layer) return conv_err("Failed to grow the feature layer array", 1);
+	if (layer->height < size || layer->width < size)
+		return conv_err("Pooling window bigger than the input", 2);
+	layer->type = NN_FEATURE_POOL;
+	layer->kernel = layer->stride = size;
+	layer->out_channels = layer->channels;
+	layer->out_height = layer->height / size;
+	layer->out_width = layer->width / size;
+	net->num_feature_layers++;
+	return 0;
+}
+
+// dense layers on top of the flattened output of the last feature layer
+short NN_convnet_finish(struct NN_convnet* net, uint16_t hidden_layers, ...) {
+	if (!net) return 11;
+	uint32_t input = net->num_feature_layers ? map_size(&net->feature_layers[net->num_feature_layers-1]) : NN_convnet_input_size(net);
+	va_list args;
+	va_start(args, hidden_layers);
+	short err = NeuralNetwork_vnew(&net->dense, input, hidden_layers, args);
+	va_end(args);
+	if (!err) NeuralNetwork_randomize(&net->dense, net->seed, 1);
+	return err;
+}
+
+void NN_convnet_free(struct NN_convnet* net) {
+	for (uint16_t i = 0; i < net->num_feature_layers; i++) {
+		matrix_free(&net->feature_layers[i].weights);
+		vector_free(&net->feature_layers[i].biases);
+	}
+	sfree(net->feature_layers);
+	net->num_feature_layers = 0;
+	NeuralNetwork_free(&net->dense);
+}
+
+
+
+
+// col: (channels * kernel * kernel) x (out_height * out_width)
+void im2col(data_type* input, struct NN_feature_layer* layer, Matrix* col) {
+	uint32_t k = layer->kernel;
+	uint32_t positions = layer->out_height * layer->out_width;
+	col->rows = layer->channels * k * k;
+	col->columns = positions;
+	for (uint32_t c = 0; c < layer->channels; c++)
+		for (uint32_t ky = 0; ky < k; ky++)
+			for (uint32_t kx = 0; kx < k; kx++) {
+				data_type* dst = col->M + (size_t)((c * k + ky) * k + kx) * positions;
+				data_type* channel = input + (size_t)c * layer->height * layer->width;
+				for (uint32_t oy = 0; oy < layer->out_height; oy++) {
+					int64_t y = (int64_t)oy * layer->stride + ky - layer->padding;
+					if (y < 0 || y >= layer->height) {
+						memset(dst, 0, layer->out_width * sizeof(data_type));
+						dst += layer->out_width;
+						continue;
+					}
+					for (uint32_t ox = 0; ox < layer->out_width; ox++) {
+						int64_t x = (int64_t)ox * layer->stride + kx - layer->padding;
+						*dst++ = (x < 0 || x >= layer->width) ? 0.0f : channel[y * layer->width + x];
+					}
+				}
+			}
+}
+
+// the adjoint of im2col: input (zeroed here) gets every column entry added back
+void col2im(Matrix* col, struct NN_feature_layer* layer, data_type* input) {
+	uint32_t k = layer->kernel;
+	uint32_t positions = layer->out_height * layer->out_width;
+	memset(input, 0, (size_t)layer->channels * layer->height * layer->width * sizeof(data_type));
+	for (uint32_t c = 0; c < layer->channels; c++)
+		for (uint32_t ky = 0; ky < k; ky++)
+			for (uint32_t kx = 0; kx < k; kx++) {
+				data_type* src = col->M + (size_t)((c * k + ky) * k + kx) * positions;
+				data_type* channel = input + (size_t)c * layer->height * layer->width;
+				for (uint32_t oy = 0; oy < layer->out_height; oy++) {
+					int64_t y = (int64_t)oy * layer->stride + ky - layer->padding;
+					if (y < 0 || y >= layer->height) {
+						src += layer->out_width;
+						continue;
+					}
+					for (uint32_t ox = 0; ox < layer->out_width; ox++, src++) {
+						int64_t x = (int64_t)ox * layer->stride + kx - layer->padding;
+						if (x >= 0 && x < layer->width)
+							channel[y * layer->width + x] += *src;
+					}
+				}
+			}
+}
+
+
+
+
+void NN_convnet_workspace_free(struct NN_convnet* net, struct NN_convnet_workspace* ws) {
+	for (uint16_t i = 0; i < net->num_feature_layers; i++) {
+		if (ws->z) matrix_free(&ws->z[i]);
+		if (ws->a) matrix_free(&ws->a[i]);
+		if (ws->argmax) sfree(ws->argmax[i]);
+	}
+	sfree(ws->z);
+	sfree(ws->a);
+	sfree(ws->argmax);
+	vector_free(&ws->input);
+	matrix_free(&ws->col);
+	matrix_free(&ws->dcol);
+	vector_free(&ws->grad[0]);
+	vector_free(&ws->grad[1]);
+	NN_workspace_free(&net->dense, &ws->dense);
+}
+
+short NN_convnet_workspace_init(struct NN_convnet* net, struct NN_convnet_workspace* dst, char gradients) {
+	if (!net || !dst) return 11;
+	uint16_t n = net->num_feature_layers;
+	size_t col_size = 1, grad_size = NN_convnet_input_size(net);
+	memset(dst, 0, sizeof(struct NN_convnet_workspace));
+
+	// the dense gradients are the caller's, see NN_convnet_train
+	if (NN_workspace_init(&net->dense, &dst->dense, 0))
+		return conv_err("Failed to initialise the dense workspace", 1);
+	enum NN_mem_category category = NN_mem_category(NN_MEM_ACTIVATIONS);
+	if (vector_init(&dst->input, NN_convnet_input_size(net))) goto INIT_err;
+	if (n && (!(dst->z = calloc(n, sizeof(Matrix))) ||
+			  !(dst->a = calloc(n, sizeof(Matrix))) ||
+			  !(dst->argmax = calloc(n, sizeof(uint32_t*)))))
+		goto INIT_err;
+	for (uint16_t i = 0; i < n; i++) {
+		struct NN_feature_layer* layer = &net->feature_layers[i];
+		uint32_t positions = layer->out_height * layer->out_width;
+		if (matrix_init(&dst->a[i], layer->out_channels, positions)) goto INIT_err;
+		if (layer->type == NN_FEATURE_CONV) {
+			if (matrix_init(&dst->z[i], layer->out_channels, positions)) goto INIT_err;
+			size_t size = (size_t)layer->channels * layer->kernel * layer->kernel * positions;
+			if (size > col_size) col_size = size;
+		} else if (!(dst->argmax[i] = malloc(map_size(layer) * sizeof(uint32_t))))
+			goto INIT_err;
+		if (map_size(layer) > grad_size) grad_size = map_size(layer);
+	}
+	// the column buffers are shared by every convolution, shapes are set per use
+	NN_mem_category(NN_MEM_SCRATCH);
+	if (matrix_init(&dst->col, 1, col_size)) goto INIT_err;
+	if (gradients) {
+		if (matrix_init(&dst->dcol, 1, col_size)) goto INIT_err;
+		if (vector_init(&dst->grad[0], grad_size)) goto INIT_err;
+		if (vector_init(&dst->grad[1], grad_size)) goto INIT_err;
+	}
+	NN_mem_category(category);
+	return 0;
+
+INIT_err:
+	NN_mem_category(category);
+	NN_convnet_workspace_free(net, dst);
+	return conv_err("Failed to allocate the workspace", 2);
+}
+
+
+
+
+static void conv_forward(struct NN_feature_layer* layer, data_type* input, Matrix* col, Matrix* z, Matrix* a) {
+	uint32_t positions = layer->out_height * layer->out_width;
+	im2col(input, layer, col);
+	multiply_mm(&layer->weights, col, z);
+	for (uint32_t f = 0; f < layer->out_channels; f++) {
+		data_type bias = layer->biases.V[f];
+		data_type* zf = z->M + (size_t)f * positions;
+		data_type* af = a->M + (size_t)f * positions;
+		for (uint32_t p = 0; p < positions; p++)
+			af[p] = activation(zf[p] += bias);
+	}
+}
+
+static void pool_forward(struct NN_feature_layer* layer, data_type* input, Matrix* a, uint32_t* argmax) {
+	uint32_t size = layer->kernel;
+	data_type* out = a->M;
+	for (uint32_t c = 0; c < layer->channels; c++) {
+		data_type* channel = input + (size_t)c * layer->height * layer->width;
+		uint32_t base = c * layer->height * layer->width;
+		for (uint32_t oy = 0; oy < layer->out_height; oy++)
+			for (uint32_t ox = 0; ox < layer->out_width; ox++) {
+				uint32_t best = (oy * size) * layer->width + ox * size;
+				for (uint32_t ky = 0; ky < size; ky++)
+					for (uint32_t kx = 0; kx < size; kx++) {
+						uint32_t i = (oy * size + ky) * layer->width + ox * size + kx;
+						if (channel[i] > channel[best]) best = i;
+					}
+				*out++ = channel[best];
+				*argmax++ = base + best;
+			}
+	}
+}
+
+// feature layers then the dense network, ws->input has to hold the example
+static short convnet_forward(struct NN_convnet* net, struct NN_convnet_workspace* ws) {
+	data_type* input = ws->input.V;
+	for (uint16_t i = 0; i < net->num_feature_layers; i++) {
+		struct NN_feature_layer* layer = &net->feature_layers[i];
+		if (layer->type == NN_FEATURE_CONV)
+			conv_forward(layer, input, &ws->col, &ws->z[i], &ws->a[i]);
+		else
+			pool_forward(layer, input, &ws->a[i], ws->argmax[i]);
+		input = ws->a[i].M;
+	}
+	memcpy(ws->dense.lv[0].a.V, input, net->dense.input_size * sizeof(data_type));
+	ws->dense.lv[0].a.size = net->dense.input_size;
+	return NeuralNetwork_calculate(&net->dense, ws->dense.lv);
+}
+
+// grad holds the derivative with respect to the output of the last feature layer
+static void convnet_backward(struct NN_convnet* net, struct NN_convnet_workspace* ws, struct layer_gradient* feature_gradient, Vector* grad, Vector* next) {
+	for (uint16_t i = net->num_feature_layers; i-- > 0;) {
+		struct NN_feature_layer* layer = &net->feature_layers[i];
+		data_type* input = i ? ws->a[i-1].M : ws->input.V;
+		data_type* dinput = next->V;
+		size_t in_size = (size_t)layer->channels * layer->height * layer->width;
+		if (layer->type == NN_FEATURE_POOL) {
+			memset(dinput, 0, in_size * sizeof(data_type));
+			for (size_t j = 0; j < map_size(layer); j++)
+				dinput[ws->argmax[i][j]] += grad->V[j];
+		} else {
+			uint32_t positions = layer->out_height * layer->out_width;
+			struct layer_gradient* g = &feature_gradient[i];
+			Matrix dz = {.rows = layer->out_channels, .columns = positions, .M = grad->V};
+			for (uint32_t f = 0; f < layer->out_channels; f++) {
+				data_type* zf = ws->z[i].M + (size_t)f * positions;
+				data_type* df = dz.M + (size_t)f * positions;
+				data_type sum = 0.0f;
+				for (uint32_t p = 0; p < positions; p++)
+					sum += df[p] *= activation_derivative(zf[p]);
+				g->bias_gradient.V[f] += sum;
+			}
+			// the columns are rebuilt instead of kept per layer
+			im2col(input, layer, &ws->col);
+			multiply_mmt_add(&dz, &ws->col, &g->weight_gradient);
+			if (!i) return;
+			multiply_mtm(&layer->weights, &dz, &ws->dcol);
+			col2im(&ws->dcol, layer, dinput);
+		}
+		data_type* swap = grad->V;
+		grad->V = next->V;
+		next->V = swap;
+	}
+}
+
+
+
+
+short NN_convnet_feed(struct NN_convnet* net, struct NN_convnet_workspace* ws, Vector* input, Vector* dst) {
+	if (!net || !ws || !input || !dst) return 11;
+	if (input->size != NN_convnet_input_size(net)) return 1;
+	uint32_t n = net->dense.num_hidden_layers + 1;
+	memcpy(ws->input.V, input->V, input->size * sizeof(data_type));
+	if (convnet_forward(net, ws)) return 2;
+	Vector* out = net->dense.output == NN_OUTPUT_SOFTMAX ? &ws->dense.lv[n].z : &ws->dense.lv[n].a;
+	memcpy(dst->V, out->V, out->size * sizeof(data_type));
+	dst->size = out->size;
+	if (net->dense.output == NN_OUTPUT_SOFTMAX)
+		softmax_v(dst, dst);
+	return 0;
+}
+
+void NN_convnet_gradient_free(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient) {
+	for (uint16_t i = 0; i < net->num_feature_layers; i++) {
+		matrix_free(&feature_gradient[i].weight_gradient);
+		vector_free(&feature_gradient[i].bias_gradient);
+	}
+	NeuralNetwork_gradient_free(&net->dense, gradient);
+}
+
+short NN_convnet_gradient_init(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient) {
+	if (!net || !feature_gradient || !gradient) return 11;
+	uint16_t allocated = 0;
+	enum NN_mem_category category = NN_mem_category(NN_MEM_GRADIENTS);
+	for (; allocated < net->num_feature_layers; allocated++) {
+		struct NN_feature_layer* layer = &net->feature_layers[allocated];
+		struct layer_gradient* g = &feature_gradient[allocated];
+		g->weight_gradient = (Matrix) {0};
+		g->bias_gradient = (Vector) {0};
+		if (layer->type != NN_FEATURE_CONV) continue;
+		if (matrix_init(&g->weight_gradient, layer->weights.rows, layer->weights.columns) ||
+			vector_init(&g->bias_gradient, layer->biases.size)) {
+			allocated++;
+			goto GRADIENT_INIT_err;
+		}
+	}
+	if (NeuralNetwork_gradient_init(&net->dense, gradient)) goto GRADIENT_INIT_err;
+	NN_mem_category(category);
+	NN_convnet_gradient_zero(net, feature_gradient, NULL);
+	return 0;
+
+GRADIENT_INIT_err:
+	NN_mem_category(category);
+	while (allocated--) {
+		matrix_free(&feature_gradient[allocated].weight_gradient);
+		vector_free(&feature_gradient[allocated].bias_gradient);
+	}
+	return conv_err("Failed to allocate the gradient", 1);
+}
+
+// gradient = NULL only zeroes the feature gradient
+void NN_convnet_gradient_zero(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient) {
+	for (uint16_t i = 0; i < net->num_feature_layers; i++) {
+		struct layer_gradient* g = &feature_gradient[i];
+		if (!g->weight_gradient.M) continue;
+		memset(g->weight_gradient.M, 0, (size_t)g->weight_gradient.rows * g->weight_gradient.columns * sizeof(data_type));
+		memset(g->bias_gradient.V, 0, g->bias_gradient.size * sizeof(data_type));
+	}
+	if (gradient) NeuralNetwork_gradient_zero(&net->dense, gradient);
+}
+
+short NN_convnet_train(NN_convnet_args args) {
+	if (!args.net || !args.igen || !args.lgen || !args.batch_size || !args.feature_gradient || !args.gradient) return 11;
+
+	struct NN_convnet* net = args.net;
+	struct NeuralNetwork* NN = &net->dense;
+	struct NN_convnet_workspace ws;
+	uint32_t n = NN->num_hidden_layers + 1;
+	size_t endI = args.batch_start + args.batch_size;
+	data_type scale = (data_type)1 / (args.normalize ? args.normalize : args.batch_size);
+	float backup_loss = 0.0f;
+	int err = 0;
+
+	if (!args.accumulate && NN_convnet_gradient_init(net, args.feature_gradient, args.gradient))
+		return 2;
+	if (NN_convnet_workspace_init(net, &ws, 1)) {
+		if (!args.accumulate) NN_convnet_gradient_free(net, args.feature_gradient, args.gradient);
+		return 1;
+	}
+	// the dense backpropagation adds straight into the caller's gradient
+	for (uint32_t l = 1; l <= n; l++) {
+		ws.dense.lv[l].weight_gradient = args.gradient[l-1].weight_gradient;
+		ws.dense.lv[l].bias_gradient = args.gradient[l-1].bias_gradient;
+	}
+
+	if (!args.loss) args.loss = &backup_loss;
+	*args.loss = 0.0f;
+	for (size_t example = args.batch_start; example < endI; example++) {
+		if (args.igen(example, &ws.input)) goto INPUT_GEN_err;
+		if (convnet_forward(net, &ws)) goto PRE_CALC_err;
+		if (args.lgen(example, &ws.dense.desired)) goto LABEL_GEN_err;
+		*args.loss += NeuralNetwork_output_delta(NN, &ws.dense.lv[n], &ws.dense.desired, &ws.dense.dCda, scale);
+		memset(ws.dense.temp_dCda.V, 0, get_biggest_layer(NN) * sizeof(data_type));
+		// the feature layers need the derivative with respect to the dense input, frozen dense layers or not
+		if (NeuralNetwork_backpropagation_to(NN, ws.dense.lv, &ws.dense.dCda, &ws.dense.temp_dCda,
+				net->num_feature_layers ? 1 : NeuralNetwork_frozen_layers(NN) + 1)) goto BACKPROPAGATION_err;
+		if (net->num_feature_layers) {
+			memcpy(ws.grad[0].V, ws.dense.temp_dCda.V, NN->input_size * sizeof(data_type));
+			convnet_backward(net, &ws, args.feature_gradient, &ws.grad[0], &ws.grad[1]);
+		}
+
+		continue;
+		BACKPROPAGATION_err: err++;
+		LABEL_GEN_err: err++;
+		PRE_CALC_err: err++;
+		INPUT_GEN_err: err++;
+		char* msg[] = {
+			NULL,
+			"Failed to generate input",
+			"Failed to precalculate neural network state",
+			"Failed to generate a label",
+			"Backpropagation failed",
+		};
+		printf(FG_GRAY "[Neural Network Convolution] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", example, msg[err]);
+		err = 0;
+	}
+	*args.loss /= (float)args.batch_size;
+
+	for (uint32_t l = 1; l <= n; l++) {
+		ws.dense.lv[l].weight_gradient.M = NULL;
+		ws.dense.lv[l].bias_gradient.V = NULL;
+	}
+	NN_convnet_workspace_free(net, &ws);
+	return 0;
+}
+
+short NN_convnet_apply_gradient(struct NN_convnet* net, struct layer_gradient* feature_gradient, struct layer_gradient* gradient, data_type lrate) {
+	for (uint16_t i = 0; i < net->num_feature_layers; i++) {
+		struct NN_feature_layer* layer = &net->feature_layers[i];
+		struct layer_gradient* g = &feature_gradient[i];
+		if (layer->type != NN_FEATURE_CONV) continue;
+		for (size_t w = 0; w < (size_t)layer->weights.rows * layer->weights.columns; w++)
+			layer->weights.M[w] -= lrate * g->weight_gradient.M[w];
+		for (uint32_t f = 0; f < layer->biases.size; f++)
+			layer->biases.V[f] -= lrate * g->bias_gradient.V[f];
+	}
+	return NeuralNetwork_apply_gradient(&net->dense, gradient, lrate);
+}
@@ -0,0 +1,311 @@
+#include <ensemble.h>
+#include <low-rank.h>
+
+static short ensemble_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Ensemble] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+// zeroed and aligned for NN_lanes
+static data_type* lanes_alloc(size_t floats) {
+	size_t bytes = (floats * sizeof(data_type) + sizeof(NN_lanes) - 1) / sizeof(NN_lanes) * sizeof(NN_lanes);
+	data_type* p = aligned_alloc(sizeof(NN_lanes), bytes ? bytes : sizeof(NN_lanes));
+	if (p) memset(p, 0, bytes);
+	return p;
+}
+
+short NN_ensemble_new(struct NN_ensemble* dst, uint16_t models, uint32_t input_size, uint16_t hidden_layers, ...) {
+	if (!dst || !models || !input_size) return 11;
+	memset(dst, 0, sizeof(struct NN_ensemble));
+	dst->output = NN_OUTPUT_ACTIVATION;
+	dst->models = models;
+	dst->lanes = (models + NN_ENSEMBLE_LANES - 1) / NN_ENSEMBLE_LANES * NN_ENSEMBLE_LANES;
+	dst->num_layers = hidden_layers + 1;
+	uint32_t L = dst->num_layers, biggest = input_size;
+
+	dst->sizes = malloc((L + 1) * sizeof(uint32_t));
+	dst->weights = malloc((L + 1) * sizeof(size_t));
+	dst->activations = malloc((L + 1) * sizeof(size_t));
+	if (!dst->sizes || !dst->weights || !dst->activations) goto ALLOC_err;
+	va_list args;
+	va_start(args, hidden_layers);
+	dst->sizes[0] = input_size;
+	for (uint32_t l = 1; l <= L; l++)
+		if (!(dst->sizes[l] = va_arg(args, uint32_t))) {
+			va_end(args);
+			NN_ensemble_free(dst);
+			return 11;
+		}
+	va_end(args);
+
+	size_t params = 0, activations = 0;
+	dst->weights[0] = 0;
+	for (uint32_t l = 0; l <= L; l++) {
+		if (l) {
+			dst->weights[l] = params;
+			params += ((size_t)dst->sizes[l] * dst->sizes[l-1] + dst->sizes[l]) * dst->lanes;
+		}
+		dst->activations[l] = activations;
+		activations += (size_t)dst->sizes[l] * dst->lanes;
+		if (dst->sizes[l] > biggest) biggest = dst->sizes[l];
+	}
+	dst->parameters = params;
+
+	dst->params = lanes_alloc(params);
+	dst->gradient = lanes_alloc(params);
+	dst->lrate = lanes_alloc(dst->lanes);
+	dst->a = lanes_alloc(activations);
+	dst->z = lanes_alloc(activations);
+	dst->delta = lanes_alloc((size_t)biggest * dst->lanes);
+	dst->temp_delta = lanes_alloc((size_t)biggest * dst->lanes);
+	if (!dst->params || !dst->gradient || !dst->lrate || !dst->a || !dst->z || !dst->delta || !dst->temp_delta)
+		goto ALLOC_err;
+	if (vector_init(&dst->input, input_size) || vector_init(&dst->desired, dst->sizes[L]))
+		goto ALLOC_err;
+	return 0;
+
+ALLOC_err:
+	NN_ensemble_free(dst);
+	return ensemble_err("Failed to allocate the ensemble", 1);
+}
+
+void NN_ensemble_free(struct NN_ensemble* ensemble) {
+	if (!ensemble) return;
+	sfree(ensemble->sizes);
+	sfree(ensemble->weights);
+	sfree(ensemble->activations);
+	sfree(ensemble->params);
+	sfree(ensemble->gradient);
+	sfree(ensemble->lrate);
+	sfree(ensemble->a);
+	sfree(ensemble->z);
+	sfree(ensemble->delta);
+	sfree(ensemble->temp_delta);
+	vector_free(&ensemble->input);
+	vector_free(&ensemble->desired);
+}
+
+/*
+ * Model m gets exactly the weights NeuralNetwork_randomize(seeds[m]) would
+ * give a single network, the padding lanes stay zero.
+ */
+short NN_ensemble_randomize(struct NN_ensemble* ensemble, const uint64_t* seeds) {
+	if (!ensemble || !seeds) return 11;
+	size_t biggest = 0;
+	for (uint32_t l = 1; l <= ensemble->num_layers; l++)
+		if ((size_t)ensemble->sizes[l] * ensemble->sizes[l-1] > biggest) biggest = (size_t)ensemble->sizes[l] * ensemble->sizes[l-1];
+	data_type* buffer = malloc(biggest * sizeof(data_type));
+	if (!buffer) return ensemble_err("Failed to allocate the randomisation buffer", 1);
+
+	for (uint32_t l = 1; l <= ensemble->num_layers; l++) {
+		size_t count = (size_t)ensemble->sizes[l] * ensemble->sizes[l-1];
+		data_type* w = ensemble->params + ensemble->weights[l];
+		float stddev = sqrt(2.0f / ensemble->sizes[l-1]); // He initialization standard deviation
+		for (uint16_t m = 0; m < ensemble->models; m++) {
+			rng_fill_normal(seeds[m], NN_RNG_STREAM(NN_RNG_WEIGHTS, l), 0, buffer, count, 0.0f, stddev);
+			for (size_t i = 0; i < count; i++)
+				w[i * ensemble->lanes + m] = buffer[i];
+		}
+		memset(w + count * ensemble->lanes, 0, (size_t)ensemble->sizes[l] * ensemble->lanes * sizeof(data_type));
+	}
+	free(buffer);
+	return 0;
+}
+
+void NN_ensemble_set_lrate(struct NN_ensemble* ensemble, const data_type* lrates) {
+	memcpy(ensemble->lrate, lrates, ensemble->models * sizeof(data_type));
+}
+
+static void ensemble_forward(struct NN_ensemble* e, uint32_t l, uint32_t G) {
+	uint32_t rows = e->sizes[l], columns = e->sizes[l-1];
+	NN_lanes* W = (NN_lanes*)(e->params + e->weights[l]);
+	NN_lanes* B = W + (size_t)rows * columns * G;
+	NN_lanes* A = (NN_lanes*)(e->a + e->activations[l-1]);
+	NN_lanes* Z = (NN_lanes*)(e->z + e->activations[l]);
+	NN_lanes* out = (NN_lanes*)(e->a + e->activations[l]);
+	for (uint32_t r = 0; r < rows; r++) {
+		NN_lanes* z = Z + (size_t)r * G;
+		for (uint32_t g = 0; g < G; g++)
+			z[g] = (NN_lanes){};
+		for (uint32_t c = 0; c < columns; c++, W += G)
+			for (uint32_t g = 0; g < G; g++)
+				z[g] += W[g] * A[(size_t)c * G + g];
+		for (uint32_t g = 0; g < G; g++)
+			z[g] += B[(size_t)r * G + g];
+	}
+	if (l == e->num_layers && e->output == NN_OUTPUT_SOFTMAX)
+		return;
+	for (size_t i = 0; i < (size_t)rows * G; i++)
+		out[i] = activation_lanes(Z[i]);
+}
+
+// squared error, or cross-entropy per model through the fused scalar kernel
+static void ensemble_output_delta(struct NN_ensemble* e, uint32_t G, data_type scale, float* loss) {
+	uint32_t L = e->num_layers, outputs = e->sizes[L];
+	data_type* a = e->a + e->activations[L];
+	data_type* z = e->z + e->activations[L];
+	if (e->output == NN_OUTPUT_SOFTMAX) {
+		// three outputs wide, temp_delta is free until the backward pass
+		Vector logits = {.size = outputs, .V = e->temp_delta};
+		Vector probs = {.size = outputs, .V = e->temp_delta + outputs};
+		Vector grad = {.size = outputs, .V = e->temp_delta + 2 * outputs};
+		memset(e->delta, 0, (size_t)outputs * e->lanes * sizeof(data_type));
+		for (uint16_t m = 0; m < e->models; m++) {
+			for (uint32_t r = 0; r < outputs; r++)
+				logits.V[r] = z[(size_t)r * e->lanes + m];
+			loss[m] += softmax_cross_entropy_v(&logits, &e->desired, &probs, &grad, scale);
+			for (uint32_t r = 0; r < outputs; r++) {
+				a[(size_t)r * e->lanes + m] = probs.V[r];
+				e->delta[(size_t)r * e->lanes + m] = grad.V[r];
+			}
+		}
+		return;
+	}
+	NN_lanes* A = (NN_lanes*)a;
+	NN_lanes* D = (NN_lanes*)e->delta;
+	for (uint32_t g = 0; g < G; g++) {
+		NN_lanes sum = {};
+		for (uint32_t r = 0; r < outputs; r++) {
+			NN_lanes d = A[(size_t)r * G + g] - e->desired.V[r];
+			sum += d*d;
+			D[(size_t)r * G + g] = scale*d;
+		}
+		sum *= 2;
+		for (uint32_t k = 0; k < NN_ENSEMBLE_LANES && g * NN_ENSEMBLE_LANES + k < e->models; k++)
+			loss[g * NN_ENSEMBLE_LANES + k] += sum[k];
+	}
+}
+
+// adds layer l's gradient, leaves the derivative with respect to its input in temp_delta
+static void ensemble_backward(struct NN_ensemble* e, uint32_t l, uint32_t G) {
+	uint32_t rows = e->sizes[l], columns = e->sizes[l-1];
+	size_t weights = (size_t)rows * columns * G;
+	NN_lanes* W = (NN_lanes*)(e->params + e->weights[l]);
+	NN_lanes* WG = (NN_lanes*)(e->gradient + e->weights[l]);
+	NN_lanes* BG = WG + weights;
+	NN_lanes* Z = (NN_lanes*)(e->z + e->activations[l]);
+	NN_lanes* A = (NN_lanes*)(e->a + e->activations[l-1]);
+	NN_lanes* D = (NN_lanes*)e->delta;
+	NN_lanes* T = (NN_lanes*)e->temp_delta;
+	char logits = l == e->num_layers && e->output == NN_OUTPUT_SOFTMAX;
+
+	if (!logits)
+		for (size_t i = 0; i < (size_t)rows * G; i++)
+			D[i] = activation_derivative_lanes(Z[i]) * D[i];
+	for (size_t i = 0; i < (size_t)rows * G; i++)
+		BG[i] += D[i];
+	if (l > 1)
+		memset(T, 0, (size_t)columns * G * sizeof(NN_lanes));
+	for (uint32_t r = 0; r < rows; r++) {
+		NN_lanes* d = D + (size_t)r * G;
+		for (uint32_t c = 0; c < columns; c++, W += G, WG += G) {
+			NN_lanes* a = A + (size_t)c * G;
+			for (uint32_t g = 0; g < G; g++)
+				WG[g] += a[g] * d[g];
+			if (l > 1)
+				for (uint32_t g = 0; g < G; g++)
+					T[(size_t)c * G + g] += W[g] * d[g];
+		}
+	}
+}
+
+/*
+ * One batch for every model: forward and backward passes on each example,
+ * then every model's mean gradient applied at its own learning rate.
+ * A failing generator skips the example like NeuralNetwork_train does.
+ */
+short NN_ensemble_train(NN_ensemble_args args) {
+	struct NN_ensemble* e = args.ensemble;
+	if (!e || !args.igen || !args.lgen || !args.batch_size) return 11;
+	uint32_t G = e->lanes / NN_ENSEMBLE_LANES, L = e->num_layers;
+	data_type scale = (data_type)1 / args.batch_size;
+	float* loss = calloc(e->models, sizeof(float));
+	if (!loss) return ensemble_err("Failed to allocate the losses", 1);
+
+	for (size_t example = args.batch_start; example < args.batch_start + args.batch_size; example++) {
+		if (args.igen(example, &e->input)) {
+			printf(FG_GRAY "[Neural Network Ensemble] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate input" C_RESET "\n", example);
+			continue;
+		}
+		if (args.lgen(example, &e->desired)) {
+			printf(FG_GRAY "[Neural Network Ensemble] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate a label" C_RESET "\n", example);
+			continue;
+		}
+		NN_lanes* A = (NN_lanes*)e->a;
+		for (uint32_t c = 0; c < e->sizes[0]; c++)
+			for (uint32_t g = 0; g < G; g++)
+				A[(size_t)c * G + g] = (NN_lanes){} + e->input.V[c];
+		for (uint32_t l = 1; l <= L; l++)
+			ensemble_forward(e, l, G);
+		ensemble_output_delta(e, G, scale, loss);
+		for (uint32_t l = L; l >= 1; l--) {
+			ensemble_backward(e, l, G);
+			data_type* swap = e->delta;
+			e->delta = e->temp_delta;
+			e->temp_delta = swap;
+		}
+	}
+
+	NN_lanes* P = (NN_lanes*)e->params;
+	NN_lanes* GR = (NN_lanes*)e->gradient;
+	NN_lanes* LR = (NN_lanes*)e->lrate;
+	for (size_t i = 0; i < e->parameters / NN_ENSEMBLE_LANES; i += G)
+		for (uint32_t g = 0; g < G; g++)
+			P[i + g] -= LR[g] * GR[i + g];
+	memset(e->gradient, 0, e->parameters * sizeof(data_type));
+
+	if (args.loss)
+		for (uint16_t m = 0; m < e->models; m++)
+			args.loss[m] = loss[m] / (float)args.batch_size;
+	free(loss);
+	return 0;
+}
+
+// model into a newly allocated network, free it with NeuralNetwork_free
+short NN_ensemble_get(struct NN_ensemble* ensemble, uint16_t model, struct NeuralNetwork* dst) {
+	if (!ensemble || !dst || model >= ensemble->models) return 11;
+	uint32_t l;
+	if (NeuralNetwork_init(dst, ensemble->sizes[0], ensemble->num_layers - 1))
+		return ensemble_err("Failed to initialise the network", 1);
+	dst->output = ensemble->output;
+	for (l = 1; l <= ensemble->num_layers; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(dst, l);
+		if (NN_layer_init(layer, ensemble->sizes[l-1], ensemble->sizes[l]))
+			goto LAYER_INIT_err;
+		size_t count = (size_t)ensemble->sizes[l] * ensemble->sizes[l-1];
+		data_type* w = ensemble->params + ensemble->weights[l] + model;
+		for (size_t i = 0; i < count; i++)
+			layer->weights.M[i] = w[i * ensemble->lanes];
+		for (uint32_t i = 0; i < ensemble->sizes[l]; i++)
+			layer->biases.V[i] = w[(count + i) * ensemble->lanes];
+	}
+	return 0;
+
+LAYER_INIT_err:
+	while (--l)
+		NN_layer_free(*NeuralNetwork_layer(dst, l));
+	sfree(dst->hidden_layers);
+	return ensemble_err("Failed to initialise a layer", 2);
+}
+
+// network of the same topology into lane model
+short NN_ensemble_set(struct NN_ensemble* ensemble, uint16_t model, struct NeuralNetwork* src) {
+	if (!ensemble || !src || model >= ensemble->models) return 11;
+	if (NeuralNetwork_is_factored(src))
+		return ensemble_err("Factored layers can't go into an ensemble", 2);
+	if (src->input_size != ensemble->sizes[0] || src->num_hidden_layers + 1u != ensemble->num_layers)
+		return ensemble_err("The network doesn't match the ensemble's topology", 1);
+	for (uint32_t l = 1; l <= ensemble->num_layers; l++)
+		if (NeuralNetwork_layer(src, l)->biases.size != ensemble->sizes[l])
+			return ensemble_err("The network doesn't match the ensemble's topology", 1);
+	for (uint32_t l = 1; l <= ensemble->num_layers; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(src, l);
+		size_t count = (size_t)ensemble->sizes[l] * ensemble->sizes[l-1];
+		data_type* w = ensemble->params + ensemble->weights[l] + model;
+		for (size_t i = 0; i < count; i++)
+			w[i * ensemble->lanes] = layer->weights.M[i];
+		for (uint32_t i = 0; i < ensemble->sizes[l]; i++)
+			w[(count + i) * ensemble->lanes] = layer->biases.V[i];
+	}
+	return 0;
+}
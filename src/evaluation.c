@@ -0,0 +1,209 @@
+#include <evaluation.h>
+
+struct eval_worker {
+	NN_eval_args* args;
+	pthread_t thread;
+	size_t from, to;		// indices into the strided example sequence
+	size_t examples;
+	size_t correct;
+	size_t top_k_correct;
+	double loss;
+	size_t* confusion;
+	short err;
+};
+
+uint32_t NeuralNetwork_classes(struct NeuralNetwork* NN) {
+	return NN->output_layer.biases.size == 1 ? 2 : NN->output_layer.biases.size;
+}
+
+static uint32_t argmax(data_type* v, uint32_t size) {
+	uint32_t best = 0;
+	for (uint32_t i = 1; i < size; i++)
+		if (v[i] > v[best]) best = i;
+	return best;
+}
+
+// how many outputs beat the given one, a branch free count the compiler can vectorise
+static uint32_t rank_of(data_type* v, uint32_t size, uint32_t index) {
+	data_type value = v[index];
+	uint32_t rank = 0;
+	for (uint32_t i = 0; i < size; i++)
+		rank += v[i] > value;
+	return rank;
+}
+
+static void eval_block(struct eval_worker* w, Matrix* input, Matrix* labels, Matrix* buffers, char* valid) {
+	NN_eval_args* args = w->args;
+	struct NeuralNetwork* NN = args->NN;
+	uint32_t n = NN->num_hidden_layers + 1;
+	uint32_t outputs = NN->output_layer.biases.size;
+	uint32_t classes = NeuralNetwork_classes(NN);
+	Matrix* x = input;
+
+	char softmax = NN->output == NN_OUTPUT_SOFTMAX;
+
+	for (uint32_t l = 1; l <= n; l++) {
+		Matrix* y = &buffers[l & 1];
+		NN_layer_forward_batch(NeuralNetwork_layer(NN, l), x, y, softmax && l == n);
+		x = y;
+	}
+	// invalid rows have zeroed labels and add nothing to the cross-entropy
+	if (softmax)
+		w->loss += softmax_cross_entropy_m(x, labels, x, NULL, 0.0f);
+
+	for (uint32_t e = 0; e < x->rows; e++) {
+		if (!valid[e]) continue;
+		data_type* out = x->M + (size_t)e * outputs;
+		data_type* desired = labels->M + (size_t)e * outputs;
+		uint32_t predicted_class, desired_class;
+		if (!softmax) {
+			data_type loss = 0.0f;
+			for (uint32_t i = 0; i < outputs; i++) {
+				data_type diff = out[i] - desired[i];
+				loss += diff*diff;
+			}
+			w->loss += 2.0f*loss;
+		}
+		if (outputs == 1) {
+			predicted_class = out[0] > 0.5f;
+			desired_class = desired[0] > 0.5f;
+			w->top_k_correct += args->top_k >= 2 || (args->top_k == 1 && predicted_class == desired_class);
+		} else {
+			predicted_class = argmax(out, outputs);
+			desired_class = argmax(desired, outputs);
+			if (args->top_k)
+				w->top_k_correct += rank_of(out, outputs, desired_class) < args->top_k;
+		}
+		w->correct += predicted_class == desired_class;
+		w->examples++;
+		if (w->confusion)
+			w->confusion[(size_t)desired_class * classes + predicted_class]++;
+	}
+}
+
+static void* eval_worker_run(void* arg) {
+	struct eval_worker* w = arg;
+	NN_eval_args* args = w->args;
+	struct NeuralNetwork* NN = args->NN;
+	uint32_t outputs = NN->output_layer.biases.size;
+	uint32_t max_layer_size = get_biggest_layer(NN);
+	size_t stride = args->stride ? args->stride : 1;
+	Matrix input = {0}, labels = {0}, buffers[2] = {0};
+	char valid[NN_EVAL_BLOCK];
+	char local = NN_mem_local(1);
+
+	if (matrix_init(&input, NN_EVAL_BLOCK, NN->input_size) ||
+		matrix_init(&labels, NN_EVAL_BLOCK, outputs) ||
+		matrix_init(&buffers[0], NN_EVAL_BLOCK, max_layer_size) ||
+		matrix_init(&buffers[1], NN_EVAL_BLOCK, max_layer_size)) {
+		NN_mem_local(local);
+		w->err = 1;
+		goto CLEANUP;
+	}
+	NN_mem_local(local);
+
+	for (size_t i = w->from; i < w->to; i += NN_EVAL_BLOCK) {
+		uint32_t count = w->to - i < NN_EVAL_BLOCK ? w->to - i : NN_EVAL_BLOCK;
+		input.rows = labels.rows = count;
+		input.columns = NN->input_size;
+		labels.columns = outputs;
+		for (uint32_t e = 0; e < count; e++) {
+			size_t example = args->start + (i + e) * stride;
+			Vector x = {.size = NN->input_size, .V = input.M + (size_t)e * NN->input_size};
+			Vector y = {.size = outputs, .V = labels.M + (size_t)e * outputs};
+			valid[e] = 0;
+			if (args->igen(example, &x))
+				printf(FG_GRAY "[Neural Network Testing] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate input" C_RESET "\n", example);
+			else if (args->lgen(example, &y))
+				printf(FG_GRAY "[Neural Network Testing] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate a label" C_RESET "\n", example);
+			else valid[e] = 1;
+			if (!valid[e]) {
+				memset(x.V, 0, NN->input_size * sizeof(data_type));
+				memset(y.V, 0, outputs * sizeof(data_type));
+			}
+		}
+		eval_block(w, &input, &labels, buffers, valid);
+	}
+
+CLEANUP:
+	matrix_free(&input);
+	matrix_free(&labels);
+	matrix_free(&buffers[0]);
+	matrix_free(&buffers[1]);
+	return NULL;
+}
+
+short NeuralNetwork_evaluate(NN_eval_args args, NN_eval_result* result) {
+	if (!args.NN || !args.igen || !args.lgen || !args.size || !result) return 11;
+
+	size_t stride = args.stride ? args.stride : 1;
+	size_t total = (args.size + stride - 1) / stride;
+	uint32_t classes = NeuralNetwork_classes(args.NN);
+	size_t confusion_size = (size_t)classes * classes;
+	struct eval_worker* workers;
+	uint16_t started;
+	short ret = 0;
+
+	if (!args.threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		args.threads = cpus > 0 ? cpus : 1;
+	}
+	// no point in a worker for less than a block
+	if (args.threads > (total + NN_EVAL_BLOCK - 1) / NN_EVAL_BLOCK)
+		args.threads = (total + NN_EVAL_BLOCK - 1) / NN_EVAL_BLOCK;
+
+	if (!(workers = calloc(args.threads, sizeof(struct eval_worker)))) {
+		puts(FG_GRAY "[Neural Network Testing] " C_RESET FG_RED FG_BRIGHT "Failed to allocate worker array" C_RESET);
+		return 1;
+	}
+	if (args.confusion) {
+		memset(args.confusion, 0, confusion_size * sizeof(size_t));
+		for (uint16_t t = 1; t < args.threads; t++)
+			if (!(workers[t].confusion = calloc(confusion_size, sizeof(size_t)))) {
+				puts(FG_GRAY "[Neural Network Testing] " C_RESET FG_RED FG_BRIGHT "Failed to allocate a confusion matrix" C_RESET);
+				ret = 2;
+				goto CLEANUP;
+			}
+		workers[0].confusion = args.confusion;
+	}
+
+	for (uint16_t t = 0; t < args.threads; t++) {
+		workers[t].args = &args;
+		workers[t].from = total * t / args.threads;
+		workers[t].to = total * (t + 1) / args.threads;
+	}
+	// the calling thread takes the first share
+	for (started = 1; started < args.threads; started++)
+		if (pthread_create(&workers[started].thread, NULL, eval_worker_run, &workers[started]))
+			break;
+	for (uint16_t t = started; t < args.threads; t++)
+		eval_worker_run(&workers[t]);
+	eval_worker_run(&workers[0]);
+
+	*result = (NN_eval_result) {0};
+	double loss = 0.0;
+	for (uint16_t t = 0; t < args.threads; t++) {
+		if (t && t < started) pthread_join(workers[t].thread, NULL);
+		if (workers[t].err) ret = 3;
+		result->examples += workers[t].examples;
+		result->correct += workers[t].correct;
+		result->top_k_correct += workers[t].top_k_correct;
+		loss += workers[t].loss;
+		if (t && workers[t].confusion)
+			for (size_t i = 0; i < confusion_size; i++)
+				args.confusion[i] += workers[t].confusion[i];
+	}
+	if (result->examples) {
+		result->accuracy = (double)result->correct / result->examples;
+		result->top_k_accuracy = (double)result->top_k_correct / result->examples;
+		result->loss = loss / (double)result->examples;
+	}
+	if (ret)
+		puts(FG_GRAY "[Neural Network Testing] " C_RESET FG_RED FG_BRIGHT "Failed to initialise a worker" C_RESET);
+
+CLEANUP:
+	for (uint16_t t = 1; t < args.threads; t++)
+		free(workers[t].confusion);
+	free(workers);
+	return ret;
+}
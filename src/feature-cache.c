@@ -0,0 +1,162 @@
+#include <feature-cache.h>
+
+static short features_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Features] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+static short store_map(struct NN_feature_cache* cache) {
+	void* store = MAP_FAILED;
+	int fd = open(cache->config.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return 1;
+	if (!ftruncate(fd, cache->bytes))
+		store = mmap(NULL, cache->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (store == MAP_FAILED) return 1;
+	cache->features = store;
+	cache->mapped = 1;
+	return 0;
+}
+
+static void store_free(struct NN_feature_cache* cache) {
+	if (cache->mapped) munmap(cache->features, cache->bytes);
+	else NN_mem_free(cache->features);
+	cache->features = NULL;
+}
+
+short NN_feature_cache_init(struct NN_feature_cache* dst, NN_feature_cache_config config) {
+	if (!dst || !config.NN || !config.size) return 11;
+	struct NeuralNetwork* NN = config.NN;
+	uint32_t widest = 0;
+	int err = 0;
+	memset(dst, 0, sizeof(struct NN_feature_cache));
+	dst->config = config;
+	dst->layers = NeuralNetwork_frozen_layers(NN);
+	if (!dst->layers || dst->layers > NN->num_hidden_layers) goto LAYERS_err;
+	dst->width = NeuralNetwork_layer(NN, dst->layers)->biases.size;
+	for (uint32_t l = 1; l <= dst->layers; l++)
+		if (NeuralNetwork_layer(NN, l)->biases.size > widest)
+			widest = NeuralNetwork_layer(NN, l)->biases.size;
+
+	dst->bytes = config.size * dst->width * sizeof(data_type);
+	enum NN_mem_category category = NN_mem_category(NN_MEM_ACTIVATIONS);
+	if (config.path ? store_map(dst) : !(dst->features = NN_mem_alloc(dst->bytes, __FILE__, __LINE__))) {
+		NN_mem_category(category);
+		goto STORE_err;
+	}
+	short failed = matrix_init(&dst->block, NN_FEATURE_BLOCK, NN->input_size) ||
+		matrix_init(&dst->buffers[0], NN_FEATURE_BLOCK, widest) ||
+		matrix_init(&dst->buffers[1], NN_FEATURE_BLOCK, widest);
+	NN_mem_category(category);
+	if (failed) goto BLOCK_err;
+	if (!(dst->filled = calloc(config.size, 1))) goto FILLED_err;
+
+	dst->tail.output = NN->output;
+	dst->tail.num_hidden_layers = NN->num_hidden_layers - dst->layers;
+	dst->tail.input_size = dst->width;
+	atomic_init(&dst->tail.generation, 0);
+	return 0;
+
+FILLED_err: err++;
+BLOCK_err: err++;
+	matrix_free(&dst->block);
+	matrix_free(&dst->buffers[0]);
+	matrix_free(&dst->buffers[1]);
+	store_free(dst);
+STORE_err: err++;
+LAYERS_err: err++;
+	char* msg[] = {
+		NULL,
+		"The network has to start with frozen layers and end with trainable ones",
+		config.path ? "Failed to map the feature file" : "Failed to allocate the feature store",
+		"Failed to allocate the block buffers",
+		"Failed to allocate the filled flags",
+	};
+	return features_err(msg[err], err);
+}
+
+// the rows of block through the frozen layers, into their examples' places
+static short fill_block(struct NN_feature_cache* cache, uint32_t count) {
+	struct NeuralNetwork* NN = cache->config.NN;
+	Matrix* x = &cache->block;
+	x->rows = count;
+	x->columns = NN->input_size;
+	for (uint32_t l = 1; l <= cache->layers; l++) {
+		Matrix* y = &cache->buffers[l & 1];
+		if (NN_layer_forward_batch(NeuralNetwork_layer(NN, l), x, y, 0)) return 1;
+		x = y;
+	}
+	for (uint32_t r = 0; r < count; r++) {
+		memcpy(cache->features + cache->rows[r] * cache->width, x->M + (size_t)r * cache->width, cache->width * sizeof(data_type));
+		cache->filled[cache->rows[r]] = 1;
+	}
+	cache->filled_count += count;
+	cache->misses += count;
+	return 0;
+}
+
+short NN_feature_cache_train(struct NN_feature_cache* cache, NN_args args) {
+	if (!cache || !args.batch_size || !args.gradient || args.dropout > 0.0f) return 11;
+	struct NeuralNetwork* NN = cache->config.NN;
+	if (args.NN && args.NN != NN) return 11;
+	if (args.batch_start < cache->config.start || args.batch_start - cache->config.start + args.batch_size > cache->config.size) return 11;
+	if (!args.igen && (!args.inputs || args.inputs->columns != NN->input_size || args.inputs->rows < args.batch_size)) return 11;
+	if (NeuralNetwork_frozen_layers(NN) != cache->layers)
+		return features_err("The frozen layers changed since the cache was made", 1);
+	size_t first = args.batch_start - cache->config.start;
+	uint64_t misses = cache->misses;
+	uint32_t count = 0;
+
+	for (size_t e = 0; e < args.batch_size; e++) {
+		if (cache->filled[first + e]) continue;
+		Vector x = {.size = NN->input_size, .V = cache->block.M + (size_t)count * NN->input_size};
+		if (!args.igen)
+			memcpy(x.V, args.inputs->M + e * args.inputs->columns, NN->input_size * sizeof(data_type));
+		else if (args.igen(args.batch_start + e, &x)) {
+			printf(FG_GRAY "[Neural Network Features] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate input" C_RESET "\n", args.batch_start + e);
+			return 2;
+		}
+		cache->rows[count++] = first + e;
+		if (count == NN_FEATURE_BLOCK) {
+			if (fill_block(cache, count)) return features_err("Failed to run the frozen layers", 3);
+			count = 0;
+		}
+	}
+	if (count && fill_block(cache, count)) return features_err("Failed to run the frozen layers", 3);
+	cache->hits += args.batch_size - (cache->misses - misses);
+
+	// the layers are looked up every time, the network may have been factored or reloaded since
+	cache->tail.hidden_layers = NN->hidden_layers + cache->layers;
+	cache->tail.output_layer = NN->output_layer;
+	Matrix features = {.rows = args.batch_size, .columns = cache->width, .M = cache->features + first * cache->width};
+	if (!args.accumulate)
+		for (uint32_t l = 0; l < cache->layers; l++)
+			args.gradient[l] = (struct layer_gradient) {0};
+	args.gradient += cache->layers;
+	args.NN = &cache->tail;
+	args.igen = NULL;
+	args.inputs = &features;
+	return NeuralNetwork_train(args);
+}
+
+void NN_feature_cache_clear(struct NN_feature_cache* cache) {
+	memset(cache->filled, 0, cache->config.size);
+	cache->filled_count = 0;
+}
+
+void NN_feature_cache_get_stats(struct NN_feature_cache* cache, NN_feature_cache_stats* dst) {
+	*dst = (NN_feature_cache_stats) {
+		.hits = cache->hits,
+		.misses = cache->misses,
+		.filled = cache->filled_count,
+		.bytes = cache->bytes,
+	};
+}
+
+void NN_feature_cache_free(struct NN_feature_cache* cache) {
+	sfree(cache->filled);
+	matrix_free(&cache->block);
+	matrix_free(&cache->buffers[0]);
+	matrix_free(&cache->buffers[1]);
+	store_free(cache);
+}
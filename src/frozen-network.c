@@ -0,0 +1,277 @@
+#include <frozen-network.h>
+
+static uint64_t align_up(uint64_t offset) {
+	return (offset + NN_FROZEN_ALIGNMENT - 1) & ~(uint64_t)(NN_FROZEN_ALIGNMENT - 1);
+}
+
+static short frozen_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Frozen] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+short NeuralNetwork_freeze(struct NeuralNetwork* NN, NN_frozen* dst) {
+	if (!NN || !dst) return 11;
+	uint32_t n = NN->num_hidden_layers + 1;
+	uint64_t offset = align_up(sizeof(struct NN_frozen_header) + n * sizeof(struct NN_frozen_layer));
+	uint64_t size;
+	char* blob;
+	struct NN_frozen_header* header;
+	struct NN_frozen_layer* layers;
+
+	size = offset;
+	for (uint32_t l = 1; l <= n; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		size = align_up(size + (uint64_t)layer->weights.rows * layer->weights.columns * sizeof(data_type));
+		size = align_up(size + (uint64_t)layer->biases.size * sizeof(data_type));
+	}
+
+	// mmap'd rather than malloc'd so it can be sealed read-only and freed like a loaded model
+	if ((blob = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return frozen_err("Failed to map the blob", 1);
+
+	header = (struct NN_frozen_header*)blob;
+	layers = (struct NN_frozen_layer*)(blob + sizeof(struct NN_frozen_header));
+	*header = (struct NN_frozen_header) {
+		.magic = NN_FROZEN_MAGIC,
+		.version = NN_FROZEN_VERSION,
+		.data_size = sizeof(data_type),
+		.flags = NN->output == NN_OUTPUT_SOFTMAX ? NN_FROZEN_SOFTMAX : 0,
+		.input_size = NN->input_size,
+		.layers = n,
+		.max_width = get_biggest_layer(NN),
+		.size = size,
+	};
+	for (uint32_t l = 1; l <= n; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		struct NN_frozen_layer* d = &layers[l-1];
+		size_t weights = (size_t)layer->weights.rows * layer->weights.columns * sizeof(data_type);
+		d->rows = layer->weights.rows;
+		d->columns = layer->weights.columns;
+		d->weights = offset;
+		// a factored layer is stored multiplied out
+		if (layer->rank)
+			multiply_mm(&layer->U, &layer->V, &(Matrix) {.M = (data_type*)(blob + offset)});
+		else
+			memcpy(blob + offset, layer->weights.M, weights);
+		offset = align_up(offset + weights);
+		d->biases = offset;
+		memcpy(blob + offset, layer->biases.V, layer->biases.size * sizeof(data_type));
+		offset = align_up(offset + layer->biases.size * sizeof(data_type));
+	}
+
+	if (mprotect(blob, size, PROT_READ)) {
+		munmap(blob, size);
+		return frozen_err("Failed to seal the blob", 2);
+	}
+	dst->blob = blob;
+	dst->header = header;
+	dst->layers = layers;
+	dst->mapped = size;
+	return 0;
+}
+
+void NN_frozen_free(NN_frozen* model) {
+	if (model->blob)
+		munmap((void*)model->blob, model->mapped);
+	model->blob = NULL;
+	model->header = NULL;
+	model->layers = NULL;
+}
+
+short NN_frozen_thaw(NN_frozen* model, struct NeuralNetwork* dst) {
+	if (!model || !model->blob || !dst) return 11;
+	const struct NN_frozen_header* h = model->header;
+	uint32_t l;
+	if (NeuralNetwork_init(dst, h->input_size, h->layers - 1))
+		return frozen_err("Failed to initialise the network", 1);
+	dst->output = h->flags & NN_FROZEN_SOFTMAX ? NN_OUTPUT_SOFTMAX : NN_OUTPUT_ACTIVATION;
+	for (l = 1; l <= h->layers; l++) {
+		const struct NN_frozen_layer* d = &model->layers[l-1];
+		struct NN_layer* layer = NeuralNetwork_layer(dst, l);
+		if (NN_layer_init(layer, d->columns, d->rows))
+			goto LAYER_INIT_err;
+		memcpy(layer->weights.M, model->blob + d->weights, (size_t)d->rows * d->columns * sizeof(data_type));
+		memcpy(layer->biases.V, model->blob + d->biases, d->rows * sizeof(data_type));
+	}
+	return 0;
+
+LAYER_INIT_err:
+	while (--l)
+		NN_layer_free(*NeuralNetwork_layer(dst, l));
+	sfree(dst->hidden_layers);
+	return frozen_err("Failed to initialise a layer", 2);
+}
+
+short NN_frozen_save(NN_frozen* model, char* outputfile) {
+	if (!model || !model->blob || !outputfile) return 11;
+	FILE* file;
+	if (!(file = fopen(outputfile, "wb")))
+		return linear_err("NN_frozen_save: Failed to open the output file", 1, "fopen");
+	if (fwrite(model->blob, 1, model->header->size, file) != model->header->size) {
+		fclose(file);
+		return linear_err("NN_frozen_save: Failed to write the blob", 2, "fwrite");
+	}
+	if (fclose(file))
+		return linear_err("NN_frozen_save: Failed to close the output file", 3, "fclose");
+	return 0;
+}
+
+// everything the forward pass relies on, so a corrupt file can't make it read out of bounds
+static short frozen_validate(const char* blob, size_t size) {
+	const struct NN_frozen_header* h = (const struct NN_frozen_header*)blob;
+	const struct NN_frozen_layer* layers = (const struct NN_frozen_layer*)(blob + sizeof(struct NN_frozen_header));
+	uint32_t width;
+	if (size < sizeof(struct NN_frozen_header)) return 1;
+	if (h->magic != NN_FROZEN_MAGIC || h->version != NN_FROZEN_VERSION) return 2;
+	if (h->data_size != sizeof(data_type)) return 3;
+	if (h->flags & ~NN_FROZEN_FLAGS) return 2;
+	if (h->size != size || !h->layers || !h->input_size) return 4;
+	if (sizeof(struct NN_frozen_header) + (uint64_t)h->layers * sizeof(struct NN_frozen_layer) > size) return 4;
+	width = h->input_size;
+	if (width > h->max_width) return 5;
+	for (uint32_t l = 0; l < h->layers; l++) {
+		const struct NN_frozen_layer* d = &layers[l];
+		if (d->columns != width || !d->rows || d->rows > h->max_width) return 5;
+		if (d->weights % NN_FROZEN_ALIGNMENT || d->biases % NN_FROZEN_ALIGNMENT) return 6;
+		if (d->weights > size || (uint64_t)d->rows * d->columns * sizeof(data_type) > size - d->weights) return 6;
+		if (d->biases > size || (uint64_t)d->rows * sizeof(data_type) > size - d->biases) return 6;
+		width = d->rows;
+	}
+	return 0;
+}
+
+short NN_frozen_load(NN_frozen* dst, char* inputfile) {
+	if (!dst || !inputfile) return 11;
+	struct stat st;
+	int fd;
+	char* blob;
+	short err;
+	char* msg[] = {
+		NULL,
+		"File too small to be a frozen network",
+		"Not a frozen network or unsupported version",
+		"Frozen with a different data_type",
+		"Corrupt header",
+		"Layer sizes don't chain",
+		"Layer data out of bounds",
+	};
+
+	if ((fd = open(inputfile, O_RDONLY)) < 0)
+		return linear_err("NN_frozen_load: Failed to open the input file", 1, "open");
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return linear_err("NN_frozen_load: Failed to stat the input file", 2, "fstat");
+	}
+	blob = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (blob == MAP_FAILED)
+		return linear_err("NN_frozen_load: Failed to map the input file", 3, "mmap");
+	if ((err = frozen_validate(blob, st.st_size))) {
+		munmap(blob, st.st_size);
+		return frozen_err(msg[err], 4);
+	}
+	dst->blob = blob;
+	dst->header = (const struct NN_frozen_header*)blob;
+	dst->layers = (const struct NN_frozen_layer*)(blob + sizeof(struct NN_frozen_header));
+	dst->mapped = st.st_size;
+	return 0;
+}
+
+uint32_t NN_frozen_scratch_size(NN_frozen* model) {
+	return 2 * model->header->max_width;
+}
+
+short NN_frozen_feed(NN_frozen* model, Vector* input, Vector* dst, data_type* scratch) {
+#ifndef NO_LINEAR_CHECKS
+	if (!model || !model->blob || !input || !dst || !scratch) return 11;
+	if (input->size != model->header->input_size) return 1;
+#endif
+	const struct NN_frozen_header* h = model->header;
+	const data_type* restrict x = input->V;
+	uint32_t last = h->layers - 1;
+	char softmax = h->flags & NN_FROZEN_SOFTMAX;
+
+	for (uint32_t l = 0; l <= last; l++) {
+		const struct NN_frozen_layer* d = &model->layers[l];
+		const data_type* restrict W = (const data_type*)(model->blob + d->weights);
+		const data_type* restrict b = (const data_type*)(model->blob + d->biases);
+		// ping-pong between the two scratch halves, the last layer writes dst
+		data_type* restrict y = l == last ? dst->V : scratch + (l & 1) * h->max_width;
+		uint32_t columns = d->columns;
+		uint32_t row = 0;
+		// four rows at a time: four independent sums and every x[i] loaded once,
+		// each row still summed in the same order as multiply_mv
+		for (; row + 4 <= d->rows; row += 4) {
+			const data_type* restrict w0 = W + (size_t)row * columns;
+			const data_type* restrict w1 = w0 + columns;
+			const data_type* restrict w2 = w1 + columns;
+			const data_type* restrict w3 = w2 + columns;
+			data_type s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+			for (uint32_t i = 0; i < columns; i++) {
+				data_type xi = x[i];
+				s0 += w0[i] * xi;
+				s1 += w1[i] * xi;
+				s2 += w2[i] * xi;
+				s3 += w3[i] * xi;
+			}
+			y[row] = s0 + b[row];
+			y[row+1] = s1 + b[row+1];
+			y[row+2] = s2 + b[row+2];
+			y[row+3] = s3 + b[row+3];
+		}
+		for (; row < d->rows; row++) {
+			const data_type* restrict w = W + (size_t)row * columns;
+			data_type sum = 0.0f;
+			for (uint32_t i = 0; i < columns; i++)
+				sum += w[i] * x[i];
+			y[row] = sum + b[row];
+		}
+		if (l < last || !softmax)
+			for (row = 0; row < d->rows; row++)
+				y[row] = activation(y[row]);
+		x = y;
+	}
+	dst->size = model->layers[last].rows;
+	if (softmax)
+		softmax_v(dst, dst);
+	return 0;
+}
+
+// the frozen blob is the network's on-disk format
+short NeuralNetwork_export(struct NeuralNetwork* NeuralNetwork, char* outputfile) {
+	NN_frozen model;
+	short err;
+	if ((err = NeuralNetwork_freeze(NeuralNetwork, &model)))
+		return err;
+	err = NN_frozen_save(&model, outputfile);
+	NN_frozen_free(&model);
+	return err;
+}
+
+// thawed aside, then swapped in as one weight write, a concurrent NN_cache_feed sees the generation move
+short NeuralNetwork_import(struct NeuralNetwork* NeuralNetwork, char* inputfile) {
+	NN_frozen model;
+	struct NeuralNetwork fresh;
+	struct NN_layer* old_layers = NeuralNetwork->hidden_layers;
+	struct NN_layer old_output = NeuralNetwork->output_layer;
+	uint16_t old_hidden = NeuralNetwork->num_hidden_layers;
+	short err;
+	if ((err = NN_frozen_load(&model, inputfile)))
+		return err;
+	err = NN_frozen_thaw(&model, &fresh);
+	NN_frozen_free(&model);
+	if (err) return err;
+
+	NeuralNetwork_write_begin(NeuralNetwork);
+	NeuralNetwork->output = fresh.output;
+	NeuralNetwork->input_size = fresh.input_size;
+	NeuralNetwork->num_hidden_layers = fresh.num_hidden_layers;
+	NeuralNetwork->hidden_layers = fresh.hidden_layers;
+	NeuralNetwork->output_layer = fresh.output_layer;
+	for (uint16_t i = 0; i < old_hidden; i++)
+		NN_layer_free(old_layers[i]);
+	NN_layer_free(old_output);
+	sfree(old_layers);
+	NeuralNetwork_write_end(NeuralNetwork);
+	return 0;
+}
@@ -0,0 +1,364 @@
+#include <gradient-codec.h>
+#include <low-rank.h>
+
+#define CODEC_STAGING 4096
+#define CODEC_BUCKETS 2048	// |x| bucketed on its top bits: exponent + 3 mantissa bits,
+							// then 10 mantissa bits at a time within the bucket
+
+struct codec_writer {
+	FILE* file;
+	size_t used;
+	size_t total;
+	char failed;
+	uint8_t buffer[CODEC_STAGING];
+};
+
+// reads go through the FILE's own buffer, nothing past the message is consumed
+struct codec_reader {
+	FILE* file;
+	char failed;
+};
+
+static short codec_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Gradient Codec] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+static void writer_flush(struct codec_writer* w) {
+	if (w->used && fwrite(w->buffer, 1, w->used, w->file) != w->used) w->failed = 1;
+	w->total += w->used;
+	w->used = 0;
+}
+
+static inline void writer_put(struct codec_writer* w, const void* data, size_t size) {
+	if (w->used + size > CODEC_STAGING) writer_flush(w);
+	memcpy(w->buffer + w->used, data, size);
+	w->used += size;
+}
+
+static inline void writer_varint(struct codec_writer* w, uint64_t value) {
+	uint8_t bytes[10];
+	size_t size = 0;
+	do {
+		bytes[size++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+		value >>= 7;
+	} while (value);
+	writer_put(w, bytes, size);
+}
+
+static inline void reader_get(struct codec_reader* r, void* dst, size_t size) {
+	if (fread(dst, 1, size, r->file) != size) {
+		r->failed = 1;
+		memset(dst, 0, size);
+	}
+}
+
+static inline uint64_t reader_varint(struct codec_reader* r) {
+	uint64_t value = 0;
+	uint8_t byte;
+	for (int shift = 0; shift < 70; shift += 7) {
+		reader_get(r, &byte, 1);
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return value;
+	}
+	r->failed = 1;
+	return value;
+}
+
+
+
+
+static uint16_t to_fp16(float f) {
+	uint32_t x, sign, exponent, mantissa, half, rest;
+	memcpy(&x, &f, 4);
+	sign = (x >> 16) & 0x8000;
+	exponent = (x >> 23) & 0xff;
+	mantissa = x & 0x7fffff;
+	if (exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	int32_t e = (int32_t)exponent - 127 + 15;
+	if (e >= 31) return sign | 0x7c00;
+	if (e <= 0) {
+		// subnormal, or rounds to zero
+		if (e < -10) return sign;
+		uint32_t shift = 14 - e;
+		mantissa |= 0x800000;
+		half = mantissa >> shift;
+		rest = mantissa & ((1u << shift) - 1);
+		if (rest > (1u << (shift - 1)) || (rest == (1u << (shift - 1)) && (half & 1))) half++;
+		return sign | half;
+	}
+	half = ((uint32_t)e << 10) | (mantissa >> 13);
+	rest = mantissa & 0x1fff;
+	// a carry out of the mantissa correctly bumps the exponent, up to infinity
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+	return sign | half;
+}
+
+static float from_fp16(uint16_t h) {
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16, exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff, x;
+	float f;
+	if (exponent == 0x1f) x = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent) x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	else {
+		f = mantissa * 0x1p-24f;
+		memcpy(&x, &f, 4);
+		x |= sign;
+	}
+	memcpy(&f, &x, 4);
+	return f;
+}
+
+static uint16_t to_bf16(float f) {
+	uint32_t x;
+	memcpy(&x, &f, 4);
+	if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;	// keep NaNs NaN
+	return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static float from_bf16(uint16_t b) {
+	uint32_t x = (uint32_t)b << 16;
+	float f;
+	memcpy(&f, &x, 4);
+	return f;
+}
+
+// writes v and returns what the receiver will read back
+static inline float put_value(struct codec_writer* w, enum NN_gradient_precision precision, float v) {
+	uint16_t h;
+	switch (precision) {
+		case NN_GRADIENT_FP16:
+			h = to_fp16(v);
+			writer_put(w, &h, 2);
+			return from_fp16(h);
+		case NN_GRADIENT_BF16:
+			h = to_bf16(v);
+			writer_put(w, &h, 2);
+			return from_bf16(h);
+		default:
+			writer_put(w, &v, 4);
+			return v;
+	}
+}
+
+static inline float get_value(struct codec_reader* r, enum NN_gradient_precision precision) {
+	uint16_t h;
+	float v;
+	switch (precision) {
+		case NN_GRADIENT_FP16:
+			reader_get(r, &h, 2);
+			return from_fp16(h);
+		case NN_GRADIENT_BF16:
+			reader_get(r, &h, 2);
+			return from_bf16(h);
+		default:
+			reader_get(r, &v, 4);
+			return v;
+	}
+}
+
+
+
+
+short NN_gradient_codec_init(struct NN_gradient_codec* dst, struct NeuralNetwork* NN, NN_gradient_codec_config config) {
+	if (!dst || !NN || config.precision > NN_GRADIENT_BF16 || config.density < 0.0f) return 11;
+	memset(dst, 0, sizeof(struct NN_gradient_codec));
+	dst->config = config;
+	if (!config.error_feedback) return 0;
+	if (!(dst->residual = calloc(NN->num_hidden_layers + 1, sizeof(struct layer_gradient))))
+		return codec_err("Failed to allocate the residual array", 1);
+	if (NeuralNetwork_gradient_init(NN, dst->residual)) {
+		sfree(dst->residual);
+		return codec_err("Failed to allocate the residuals", 2);
+	}
+	return 0;
+}
+
+void NN_gradient_codec_free(struct NN_gradient_codec* codec, struct NeuralNetwork* NN) {
+	if (codec->residual) NeuralNetwork_gradient_free(NN, codec->residual);
+	sfree(codec->residual);
+}
+
+// the bits of |v|, ordered like the magnitudes
+static inline uint32_t magnitude_bits(float v) {
+	uint32_t x;
+	memcpy(&x, &v, 4);
+	return x & 0x7fffffff;
+}
+
+/*
+ * The magnitude of the stored-th largest entry, by radix select: a histogram
+ * of the top 11 bits, then of the next 10 and the last 10 among the entries
+ * sharing the bits picked so far. take gets how many entries of exactly that
+ * magnitude belong to the top stored.
+ */
+static uint32_t select_threshold(data_type* values, data_type* residual, uint64_t count, uint64_t stored, uint64_t* take) {
+	const uint32_t shift[] = {20, 10, 0}, width[] = {11, 10, 10};
+	uint64_t histogram[CODEC_BUCKETS];
+	uint64_t above = 0;
+	uint32_t prefix = 0;
+	for (uint32_t level = 0; level < 3; level++) {
+		uint32_t buckets = 1u << width[level], bucket;
+		memset(histogram, 0, buckets * sizeof(uint64_t));
+		for (uint64_t i = 0; i < count; i++) {
+			uint32_t m = magnitude_bits(values[i] + (residual ? residual[i] : 0.0f));
+			if (m >> (shift[level] + width[level]) == prefix)
+				histogram[(m >> shift[level]) & (buckets - 1)]++;
+		}
+		for (bucket = buckets; bucket-- > 0;) {
+			if (above + histogram[bucket] >= stored) break;
+			above += histogram[bucket];
+		}
+		prefix = prefix << width[level] | bucket;
+	}
+	*take = stored - above;
+	return prefix;
+}
+
+static void encode_tensor(struct codec_writer* w, NN_gradient_codec_config* config, data_type* values, data_type* residual, uint64_t count) {
+	uint64_t stored = count;
+	char sparse = config->density > 0.0f && config->density < 1.0f;
+	char wide = count > UINT32_MAX;
+	uint64_t take = 0, taken = 0, previous = 0;
+	uint32_t threshold = 0;
+
+	if (sparse) {
+		stored = (uint64_t)ceil((double)config->density * count);
+		if (!stored && count) stored = 1;
+		if (stored) threshold = select_threshold(values, residual, count, stored, &take);
+	}
+	writer_put(w, &count, 8);
+	writer_put(w, &stored, 8);
+	for (uint64_t i = 0; i < count; i++) {
+		float v = values[i] + (residual ? residual[i] : 0.0f);
+		if (sparse) {
+			// ties at the threshold go in index order
+			uint32_t m = magnitude_bits(v);
+			if (m < threshold || (m == threshold && taken++ >= take)) {
+				if (residual) residual[i] = v;
+				continue;
+			}
+			if (config->delta) writer_varint(w, i - previous);
+			else if (wide) writer_put(w, &i, 8);
+			else writer_put(w, &(uint32_t) {i}, 4);
+			previous = i + 1;
+		}
+		float sent = put_value(w, config->precision, v);
+		if (residual) residual[i] = v - sent;
+	}
+}
+
+short NN_gradient_encode(struct NN_gradient_codec* codec, struct NeuralNetwork* NN, struct layer_gradient* gradient, FILE* file, size_t* bytes) {
+	if (!codec || !NN || !gradient || !file) return 11;
+	if (sizeof(data_type) != 4) return codec_err("Only float gradients can be encoded", 1);
+	struct codec_writer* w = malloc(sizeof(struct codec_writer));
+	if (!w) return codec_err("Failed to allocate the staging buffer", 2);
+	NN_gradient_codec_config* config = &codec->config;
+	char sparse = config->density > 0.0f && config->density < 1.0f;
+	uint32_t layers = NN->num_hidden_layers + 1;
+	struct NN_gradient_header header = {
+		.magic = NN_GRADIENT_MAGIC,
+		.version = NN_GRADIENT_VERSION,
+		.precision = config->precision,
+		.flags = (sparse ? NN_GRADIENT_SPARSE : 0) | (sparse && config->delta ? NN_GRADIENT_DELTA : 0),
+		.tensors = 2 * layers,
+	};
+	w->file = file;
+	w->used = w->total = 0;
+	w->failed = 0;
+
+	writer_put(w, &header, sizeof(header));
+	for (uint32_t l = 0; l < layers; l++) {
+		struct layer_gradient* g = &gradient[l];
+		struct layer_gradient* r = codec->residual ? &codec->residual[l] : NULL;
+		encode_tensor(w, config, g->weight_gradient.M, r ? r->weight_gradient.M : NULL, (uint64_t)g->weight_gradient.rows * g->weight_gradient.columns);
+		encode_tensor(w, config, g->bias_gradient.V, r ? r->bias_gradient.V : NULL, g->bias_gradient.size);
+	}
+	writer_flush(w);
+	if (bytes) *bytes = w->total;
+	short failed = w->failed;
+	free(w);
+	return failed ? codec_err("Failed to write the gradient", 3) : 0;
+}
+
+static short decode_tensor(struct codec_reader* r, struct NN_gradient_header* header, data_type* values, uint64_t expected, char accumulate) {
+	uint64_t count, stored, index = 0;
+	reader_get(r, &count, 8);
+	reader_get(r, &stored, 8);
+	if (r->failed || count != expected || stored > count) return 1;
+	if (!(header->flags & NN_GRADIENT_SPARSE)) {
+		if (stored != count) return 1;
+		for (uint64_t i = 0; i < count; i++)
+			values[i] = (accumulate ? values[i] : 0.0f) + get_value(r, header->precision);
+		return r->failed;
+	}
+	if (!accumulate && count) memset(values, 0, count * sizeof(data_type));
+	for (uint64_t s = 0; s < stored; s++) {
+		uint32_t narrow;
+		if (header->flags & NN_GRADIENT_DELTA) index += reader_varint(r);
+		else if (count > UINT32_MAX) reader_get(r, &index, 8);
+		else {
+			reader_get(r, &narrow, 4);
+			index = narrow;
+		}
+		if (r->failed || index >= count) return 1;
+		values[index] += get_value(r, header->precision);
+		index++;
+	}
+	return r->failed;
+}
+
+short NN_gradient_decode(struct NeuralNetwork* NN, struct layer_gradient* gradient, FILE* file, char accumulate) {
+	if (!NN || !gradient || !file) return 11;
+	struct NN_gradient_header header;
+	uint32_t layers = NN->num_hidden_layers + 1;
+	short err = 0;
+	struct codec_reader reader = {.file = file}, *r = &reader;
+
+	reader_get(r, &header, sizeof(header));
+	if (r->failed || header.magic != NN_GRADIENT_MAGIC || header.version != NN_GRADIENT_VERSION ||
+		header.precision > NN_GRADIENT_BF16 || (header.flags & ~NN_GRADIENT_FLAGS) || header.tensors != 2 * layers)
+		err = 2;
+	for (uint32_t l = 0; l < layers && !err; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l + 1);
+		Matrix parameters;
+		NN_layer_parameters(layer, &parameters);
+		// a frozen layer's gradient is empty on both ends
+		char empty = !gradient[l].weight_gradient.M;
+		if (decode_tensor(r, &header, gradient[l].weight_gradient.M, empty ? 0 : (uint64_t)parameters.rows * parameters.columns, accumulate) ||
+			decode_tensor(r, &header, gradient[l].bias_gradient.V, empty ? 0 : layer->biases.size, accumulate))
+			err = 3;
+	}
+	char* msg[] = {
+		NULL,
+		NULL,
+		"Not a gradient message for this network",
+		"Corrupt or truncated gradient message",
+	};
+	return err ? codec_err(msg[err], err) : 0;
+}
+
+
+
+
+// lossless dense fp32, the gradient is allocated by file_to_gradient
+short gradient_to_file(struct NeuralNetwork* NeuralNetwork, struct layer_gradient* gradient, char* file) {
+	if (!NeuralNetwork || !gradient || !file) return 11;
+	struct NN_gradient_codec codec = {.config = {.precision = NN_GRADIENT_FP32}};
+	FILE* out = fopen(file, "wb");
+	if (!out) return linear_err("gradient_to_file: Failed to open the output file", 1, "fopen");
+	short err = NN_gradient_encode(&codec, NeuralNetwork, gradient, out, NULL);
+	if (fclose(out) && !err)
+		return linear_err("gradient_to_file: Failed to close the output file", 2, "fclose");
+	return err;
+}
+
+short file_to_gradient(struct NeuralNetwork* NeuralNetwork, struct layer_gradient* gradient, char* file) {
+	if (!NeuralNetwork || !gradient || !file) return 11;
+	FILE* in = fopen(file, "rb");
+	if (!in) return linear_err("file_to_gradient: Failed to open the input file", 1, "fopen");
+	short err = NeuralNetwork_gradient_init(NeuralNetwork, gradient);
+	if (!err && (err = NN_gradient_decode(NeuralNetwork, gradient, in, 0)))
+		NeuralNetwork_gradient_free(NeuralNetwork, gradient);
+	fclose(in);
+	return err;
+}
@@ -0,0 +1,226 @@
+#include <inference-cache.h>
+
+static short cache_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Cache] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return x << r | x >> (64 - r);
+}
+
+// 8 bytes per multiply, finished with the murmur3 avalanche
+static uint64_t cache_hash(const data_type* v, uint32_t size) {
+	const unsigned char* p = (const unsigned char*)v;
+	size_t bytes = (size_t)size * sizeof(data_type), i;
+	uint64_t h = 0x9e3779b97f4a7c15ull ^ bytes, w;
+	for (i = 0; i + 8 <= bytes; i += 8) {
+		memcpy(&w, p + i, 8);
+		h = rotl64(h ^ w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+	}
+	if (i < bytes) {
+		w = 0;
+		memcpy(&w, p + i, bytes - i);
+		h = rotl64(h ^ w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	return h ^ h >> 33;
+}
+
+static inline data_type* entry_input(struct NN_cache* cache, struct NN_cache_shard* shard, uint32_t e) {
+	return shard->slab + (size_t)e * (cache->input_size + cache->output_size);
+}
+
+static void shard_reset(struct NN_cache_shard* shard, uint64_t generation) {
+	memset(shard->buckets, 0xff, ((size_t)shard->mask + 1) * sizeof(uint32_t));
+	if (shard->used) shard->invalidations++;
+	shard->used = 0;
+	shard->newest = shard->oldest = NN_CACHE_NONE;
+	shard->generation = generation;
+}
+
+static uint32_t shard_find(struct NN_cache* cache, struct NN_cache_shard* shard, uint64_t hash, const data_type* input) {
+	for (uint32_t e = shard->buckets[hash & shard->mask]; e != NN_CACHE_NONE; e = shard->entries[e].chain)
+		if (shard->entries[e].hash == hash && !memcmp(entry_input(cache, shard, e), input, cache->input_size * sizeof(data_type)))
+			return e;
+	return NN_CACHE_NONE;
+}
+
+static void lru_unlink(struct NN_cache_shard* shard, uint32_t e) {
+	struct NN_cache_entry* entry = &shard->entries[e];
+	if (entry->newer != NN_CACHE_NONE) shard->entries[entry->newer].older = entry->older;
+	else shard->newest = entry->older;
+	if (entry->older != NN_CACHE_NONE) shard->entries[entry->older].newer = entry->newer;
+	else shard->oldest = entry->newer;
+}
+
+static void lru_push(struct NN_cache_shard* shard, uint32_t e) {
+	struct NN_cache_entry* entry = &shard->entries[e];
+	entry->newer = NN_CACHE_NONE;
+	entry->older = shard->newest;
+	if (shard->newest != NN_CACHE_NONE) shard->entries[shard->newest].newer = e;
+	else shard->oldest = e;
+	shard->newest = e;
+}
+
+static void chain_unlink(struct NN_cache_shard* shard, uint32_t e) {
+	uint32_t* link = &shard->buckets[shard->entries[e].hash & shard->mask];
+	while (*link != e)
+		link = &shard->entries[*link].chain;
+	*link = shard->entries[e].chain;
+}
+
+static void shard_insert(struct NN_cache* cache, struct NN_cache_shard* shard, uint64_t hash, const data_type* input, const data_type* output) {
+	uint32_t e;
+	if (shard->used < shard->capacity)
+		e = shard->used++;
+	else {
+		e = shard->oldest;
+		lru_unlink(shard, e);
+		chain_unlink(shard, e);
+		shard->evictions++;
+	}
+	struct NN_cache_entry* entry = &shard->entries[e];
+	entry->hash = hash;
+	entry->chain = shard->buckets[hash & shard->mask];
+	shard->buckets[hash & shard->mask] = e;
+	lru_push(shard, e);
+	data_type* slot = entry_input(cache, shard, e);
+	memcpy(slot, input, cache->input_size * sizeof(data_type));
+	memcpy(slot + cache->input_size, output, cache->output_size * sizeof(data_type));
+}
+
+short NN_cache_init(struct NN_cache* dst, struct NeuralNetwork* NN, size_t capacity, uint16_t shards) {
+	if (!dst || !NN || !capacity) return 11;
+	if (!shards) shards = NN_CACHE_SHARDS;
+	if (shards > capacity) shards = capacity;
+	size_t per_shard = (capacity + shards - 1) / shards;
+	if (per_shard >= NN_CACHE_NONE / 2) return cache_err("Cache capacity too large", 11);
+	uint32_t buckets = 1;
+	while (buckets < 2 * per_shard) buckets <<= 1;
+
+	memset(dst, 0, sizeof(struct NN_cache));
+	dst->NN = NN;
+	dst->input_size = NN->input_size;
+	dst->output_size = NN->output_layer.biases.size;
+	dst->shards = shards;
+	size_t entry_floats = (size_t)dst->input_size + dst->output_size;
+
+	if (!(dst->shard = calloc(shards, sizeof(struct NN_cache_shard))))
+		return cache_err("Failed to allocate the shards", 1);
+	dst->bytes = shards * sizeof(struct NN_cache_shard);
+	uint16_t s;
+	for (s = 0; s < shards; s++) {
+		struct NN_cache_shard* shard = &dst->shard[s];
+		shard->capacity = per_shard;
+		shard->mask = buckets - 1;
+		shard->buckets = malloc((size_t)buckets * sizeof(uint32_t));
+		shard->entries = malloc(per_shard * sizeof(struct NN_cache_entry));
+		shard->slab = malloc(per_shard * entry_floats * sizeof(data_type));
+		if (!shard->buckets || !shard->entries || !shard->slab || pthread_mutex_init(&shard->lock, NULL)) {
+			free(shard->buckets);
+			free(shard->entries);
+			free(shard->slab);
+			goto SHARD_err;
+		}
+		dst->bytes += (size_t)buckets * sizeof(uint32_t) + per_shard * (sizeof(struct NN_cache_entry) + entry_floats * sizeof(data_type));
+		shard_reset(shard, NeuralNetwork_generation(NN));
+	}
+	return 0;
+
+SHARD_err:
+	while (s--) {
+		pthread_mutex_destroy(&dst->shard[s].lock);
+		free(dst->shard[s].buckets);
+		free(dst->shard[s].entries);
+		free(dst->shard[s].slab);
+	}
+	sfree(dst->shard);
+	return cache_err("Failed to allocate the cache slab", 1);
+}
+
+void NN_cache_free(struct NN_cache* cache) {
+	if (!cache || !cache->shard) return;
+	for (uint16_t s = 0; s < cache->shards; s++) {
+		pthread_mutex_destroy(&cache->shard[s].lock);
+		free(cache->shard[s].buckets);
+		free(cache->shard[s].entries);
+		free(cache->shard[s].slab);
+	}
+	sfree(cache->shard);
+}
+
+/*
+ * Same contract as NeuralNetwork_feed: dst is allocated and the caller frees
+ * it. Safe to call from several threads at once.
+ */
+short NN_cache_feed(struct NN_cache* cache, Vector* input, Vector* dst) {
+	if (!cache || !input || !dst || input->size != cache->input_size) return 11;
+	uint64_t hash = cache_hash(input->V, input->size);
+	struct NN_cache_shard* shard = &cache->shard[(hash >> 32) % cache->shards];
+	uint64_t generation = NeuralNetwork_generation(cache->NN);
+	uint32_t e;
+	short err;
+
+	pthread_mutex_lock(&shard->lock);
+	if (shard->generation != generation)
+		shard_reset(shard, generation);
+	if ((e = shard_find(cache, shard, hash, input->V)) != NN_CACHE_NONE) {
+		if (vector_init(dst, cache->output_size)) {
+			pthread_mutex_unlock(&shard->lock);
+			return cache_err("Failed to allocate memory for destination vector", 1);
+		}
+		memcpy(dst->V, entry_input(cache, shard, e) + cache->input_size, cache->output_size * sizeof(data_type));
+		if (shard->newest != e) {
+			lru_unlink(shard, e);
+			lru_push(shard, e);
+		}
+		shard->hits++;
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+	shard->misses++;
+	pthread_mutex_unlock(&shard->lock);
+
+	if ((err = NeuralNetwork_feed(cache->NN, input, dst)))
+		return err;
+
+	// the weights read by the feed have to be older than the generation check
+	atomic_thread_fence(memory_order_acquire);
+	if (generation & 1 || NeuralNetwork_generation(cache->NN) != generation)
+		return 0;
+	pthread_mutex_lock(&shard->lock);
+	if (shard->generation == generation && shard_find(cache, shard, hash, input->V) == NN_CACHE_NONE)
+		shard_insert(cache, shard, hash, input->V, dst->V);
+	pthread_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+void NN_cache_clear(struct NN_cache* cache) {
+	for (uint16_t s = 0; s < cache->shards; s++) {
+		pthread_mutex_lock(&cache->shard[s].lock);
+		shard_reset(&cache->shard[s], cache->shard[s].generation);
+		pthread_mutex_unlock(&cache->shard[s].lock);
+	}
+}
+
+void NN_cache_get_stats(struct NN_cache* cache, NN_cache_stats* dst) {
+	memset(dst, 0, sizeof(NN_cache_stats));
+	for (uint16_t s = 0; s < cache->shards; s++) {
+		struct NN_cache_shard* shard = &cache->shard[s];
+		pthread_mutex_lock(&shard->lock);
+		dst->hits += shard->hits;
+		dst->misses += shard->misses;
+		dst->evictions += shard->evictions;
+		dst->invalidations += shard->invalidations;
+		if (shard->generation == NeuralNetwork_generation(cache->NN))
+			dst->entries += shard->used;
+		dst->capacity += shard->capacity;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	dst->bytes = cache->bytes;
+	dst->hit_rate = dst->hits + dst->misses ? (double)dst->hits / (dst->hits + dst->misses) : 0.0;
+}
@@ -0,0 +1,377 @@
+#include <kernels.h>
+#include <autotune.h>
+#include <lanes.h>
+
+static short kernels_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Kernels] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+// beta.C ahead of accumulating into it, beta = 0 overwrites whatever C held
+static void scale_rows(uint32_t m, uint32_t n, data_type beta, data_type* C) {
+	if (beta == 0.0f)
+		memset(C, 0, (size_t)m * n * sizeof(data_type));
+	else if (beta != 1.0f)
+		for (size_t i = 0; i < (size_t)m * n; i++)
+			C[i] *= beta;
+}
+
+static void reference_gemv(uint32_t rows, uint32_t columns, const data_type* A, const data_type* x, data_type* y) {
+	for (uint32_t row = 0; row < rows; row++) {
+		const data_type* a = A + (size_t)row * columns;
+		data_type sum = 0.0f;
+		for (uint32_t i = 0; i < columns; i++)
+			sum += a[i] * x[i];
+		y[row] = sum;
+	}
+}
+
+static void reference_gemm(char trans_a, char trans_b, uint32_t m, uint32_t n, uint32_t k, const data_type* A, const data_type* B, data_type beta, data_type* C) {
+	if (trans_b) {
+		// a dot product per element, A.B^T reads both along rows
+		for (uint32_t row = 0; row < m; row++)
+			for (uint32_t column = 0; column < n; column++) {
+				data_type sum = 0.0f;
+				for (uint32_t i = 0; i < k; i++)
+					sum += (trans_a ? A[(size_t)i * m + row] : A[(size_t)row * k + i]) * B[(size_t)column * k + i];
+				data_type* c = C + (size_t)row * n + column;
+				*c = beta == 0.0f ? sum : beta * *c + sum;
+			}
+		return;
+	}
+	scale_rows(m, n, beta, C);
+	// a row of B at a time into a row of C, both contiguous
+	for (uint32_t i = 0; i < k; i++) {
+		const data_type* b = B + (size_t)i * n;
+		for (uint32_t row = 0; row < m; row++) {
+			data_type a = trans_a ? A[(size_t)i * m + row] : A[(size_t)row * k + i];
+			data_type* c = C + (size_t)row * n;
+			for (uint32_t column = 0; column < n; column++)
+				c[column] += a * b[column];
+		}
+	}
+}
+
+static void reference_axpy(size_t n, data_type alpha, const data_type* x, data_type* y) {
+	for (size_t i = 0; i < n; i++)
+		y[i] += alpha * x[i];
+}
+
+static void reference_activation(size_t n, const data_type* x, data_type* y) {
+	for (size_t i = 0; i < n; i++)
+		y[i] = activation(x[i]);
+}
+
+static data_type reference_dot(size_t n, const data_type* x, const data_type* y) {
+	data_type sum = 0.0f;
+	for (size_t i = 0; i < n; i++)
+		sum += x[i] * y[i];
+	return sum;
+}
+
+/*
+ * The optimized kernels sum every element of gemv and gemm in the same order
+ * as the reference ones, so the bit for bit guarantees elsewhere (frozen and
+ * generated code, ensembles) hold on either. Only dot reassociates.
+ */
+
+static inline NN_lanes lanes_load(const data_type* p) {
+	NN_lanes v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+static inline void lanes_store(data_type* p, NN_lanes v) {
+	memcpy(p, &v, sizeof(v));
+}
+
+static struct {
+	pthread_mutex_t lock;
+	struct {
+		uint8_t kind;
+		uint32_t n;
+		uint32_t k;
+		_Atomic uint32_t tuning;	// packed, so it can be changed under running kernels
+	} shapes[NN_TUNE_SHAPES];
+	_Atomic uint32_t count;
+} tuned = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static char* tune_names[NN_TUNE_KINDS] = {"gemv", "gemm_abt"};
+
+static uint32_t tuning_pack(NN_kernel_tuning t) {
+	return t.rows | (uint32_t)t.tile << 16;
+}
+static NN_kernel_tuning tuning_unpack(uint32_t packed) {
+	return (NN_kernel_tuning) {.rows = packed & 0xff, .tile = packed >> 16};
+}
+
+// a plain scan, a network has a handful of shapes
+NN_kernel_tuning NN_kernels_tuning(enum NN_tune_kind kind, uint32_t n, uint32_t k) {
+	uint32_t count = atomic_load_explicit(&tuned.count, memory_order_acquire);
+	for (uint32_t i = 0; i < count; i++)
+		if (tuned.shapes[i].kind == kind && tuned.shapes[i].n == n && tuned.shapes[i].k == k)
+			return tuning_unpack(atomic_load_explicit(&tuned.shapes[i].tuning, memory_order_relaxed));
+	return NN_TUNING_DEFAULT;
+}
+
+short NN_kernels_tune(enum NN_tune_kind kind, uint32_t n, uint32_t k, NN_kernel_tuning tuning) {
+	if (kind >= NN_TUNE_KINDS || !tuning.rows || tuning.rows > NN_TUNE_MAX_ROWS) return 11;
+	pthread_mutex_lock(&tuned.lock);
+	uint32_t count = atomic_load_explicit(&tuned.count, memory_order_relaxed), i = 0;
+	while (i < count && !(tuned.shapes[i].kind == kind && tuned.shapes[i].n == n && tuned.shapes[i].k == k)) i++;
+	if (i == NN_TUNE_SHAPES) {
+		pthread_mutex_unlock(&tuned.lock);
+		return 1;
+	}
+	atomic_store_explicit(&tuned.shapes[i].tuning, tuning_pack(tuning), memory_order_relaxed);
+	if (i == count) {
+		tuned.shapes[i].kind = kind;
+		tuned.shapes[i].n = n;
+		tuned.shapes[i].k = k;
+		atomic_store_explicit(&tuned.count, count + 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&tuned.lock);
+	return 0;
+}
+
+char NN_kernels_tuned(uint32_t i, enum NN_tune_kind* kind, uint32_t* n, uint32_t* k, NN_kernel_tuning* tuning) {
+	if (i >= atomic_load_explicit(&tuned.count, memory_order_acquire)) return 0;
+	*kind = tuned.shapes[i].kind;
+	*n = tuned.shapes[i].n;
+	*k = tuned.shapes[i].k;
+	*tuning = tuning_unpack(atomic_load_explicit(&tuned.shapes[i].tuning, memory_order_relaxed));
+	return 1;
+}
+
+char* NN_tune_kind_name(enum NN_tune_kind kind) {
+	return kind < NN_TUNE_KINDS ? tune_names[kind] : "unknown";
+}
+
+/*
+ * rows rows of A against x at once: independent sums and every x[i] loaded
+ * once, each sum still in order. y[r * stride] = beta.y + sum, beta = 0
+ * overwrites.
+ */
+static inline void dot_rows(uint32_t rows, uint32_t k, const data_type* A, const data_type* x, data_type beta, data_type* y, size_t stride) {
+	data_type s[NN_TUNE_MAX_ROWS] = {0};
+	for (uint32_t i = 0; i < k; i++) {
+		data_type xi = x[i];
+		for (uint32_t r = 0; r < rows; r++)
+			s[r] += A[(size_t)r * k + i] * xi;
+	}
+	for (uint32_t r = 0; r < rows; r++)
+		y[r * stride] = beta == 0.0f ? s[r] : beta * y[r * stride] + s[r];
+}
+
+// the row blocks are unrolled for the sizes the tuner tries
+#define DOT_ROWS(rows, ...) switch (rows) { \
+	case 8: dot_rows(8, __VA_ARGS__); break; \
+	case 4: dot_rows(4, __VA_ARGS__); break; \
+	case 2: dot_rows(2, __VA_ARGS__); break; \
+	default: dot_rows(rows, __VA_ARGS__); \
+}
+
+static void optimized_gemv(uint32_t rows, uint32_t columns, const data_type* A, const data_type* x, data_type* y) {
+	uint32_t block = NN_kernels_tuning(NN_TUNE_GEMV, rows, columns).rows, row = 0;
+	for (; row + block <= rows; row += block)
+		DOT_ROWS(block, columns, A + (size_t)row * columns, x, 0.0f, y + row, 1);
+	reference_gemv(rows - row, columns, A + (size_t)row * columns, x, y + row);
+}
+
+static void optimized_axpy(size_t n, data_type alpha, const data_type* x, data_type* y) {
+	size_t i = 0;
+	for (; i + NN_LANES <= n; i += NN_LANES)
+		lanes_store(y + i, lanes_load(y + i) + alpha * lanes_load(x + i));
+	reference_axpy(n - i, alpha, x + i, y + i);
+}
+
+/*
+ * A.B^T: a tile of rows of B stays in cache while it is applied to every
+ * row of A, a block of rows at a time. A^T or plain B: a row of B is added
+ * along a row of C, NN_LANES columns at a time.
+ */
+static void optimized_gemm(char trans_a, char trans_b, uint32_t m, uint32_t n, uint32_t k, const data_type* A, const data_type* B, data_type beta, data_type* C) {
+	if (trans_b && trans_a) {
+		reference_gemm(trans_a, trans_b, m, n, k, A, B, beta, C);
+		return;
+	}
+	if (trans_b) {
+		NN_kernel_tuning t = NN_kernels_tuning(NN_TUNE_GEMM_ABT, n, k);
+		uint32_t tile = t.tile ? t.tile : n;
+		for (uint32_t first = 0; first < n; first += tile) {
+			uint32_t last = n - first < tile ? n : first + tile, row = 0;
+			for (; row + t.rows <= m; row += t.rows)
+				for (uint32_t column = first; column < last; column++)
+					DOT_ROWS(t.rows, k, A + (size_t)row * k, B + (size_t)column * k, beta, C + (size_t)row * n + column, n);
+			for (; row < m; row++)
+				for (uint32_t column = first; column < last; column++)
+					dot_rows(1, k, A + (size_t)row * k, B + (size_t)column * k, beta, C + (size_t)row * n + column, n);
+		}
+		return;
+	}
+	scale_rows(m, n, beta, C);
+	for (uint32_t i = 0; i < k; i++) {
+		const data_type* b = B + (size_t)i * n;
+		for (uint32_t row = 0; row < m; row++)
+			optimized_axpy(n, trans_a ? A[(size_t)i * m + row] : A[(size_t)row * k + i], b, C + (size_t)row * n);
+	}
+}
+
+static void optimized_activation(size_t n, const data_type* x, data_type* y) {
+	size_t i = 0;
+	for (; i + NN_LANES <= n; i += NN_LANES)
+		lanes_store(y + i, activation_lanes(lanes_load(x + i)));
+	reference_activation(n - i, x + i, y + i);
+}
+
+static data_type optimized_dot(size_t n, const data_type* x, const data_type* y) {
+	NN_lanes s0 = {}, s1 = {};
+	size_t i = 0;
+	for (; i + 2 * NN_LANES <= n; i += 2 * NN_LANES) {
+		s0 += lanes_load(x + i) * lanes_load(y + i);
+		s1 += lanes_load(x + i + NN_LANES) * lanes_load(y + i + NN_LANES);
+	}
+	return NN_lanes_sum(s0 + s1) + reference_dot(n - i, x + i, y + i);
+}
+
+/*
+ * CBLAS through dlopen, so nothing links against a BLAS. The enums are passed
+ * as their values: row major 101, no transpose 111, transpose 112. Lengths
+ * are ints, axpy and dot go in pieces that fit.
+ */
+typedef void (*cblas_sgemv_fn)(int, int, int, int, float, const float*, int, const float*, int, float, float*, int);
+typedef void (*cblas_sgemm_fn)(int, int, int, int, int, int, float, const float*, int, const float*, int, float, float*, int);
+typedef void (*cblas_saxpy_fn)(int, float, const float*, int, float*, int);
+typedef float (*cblas_sdot_fn)(int, const float*, int, const float*, int);
+
+#define CBLAS_ROW_MAJOR 101
+#define CBLAS_NO_TRANS 111
+#define CBLAS_TRANS 112
+#define CBLAS_CHUNK ((size_t)1 << 30)
+
+static struct {
+	pthread_once_t once;
+	void* handle;
+	cblas_sgemv_fn sgemv;
+	cblas_sgemm_fn sgemm;
+	cblas_saxpy_fn saxpy;
+	cblas_sdot_fn sdot;
+} cblas = {.once = PTHREAD_ONCE_INIT};
+
+static void cblas_gemv(uint32_t rows, uint32_t columns, const data_type* A, const data_type* x, data_type* y) {
+	cblas.sgemv(CBLAS_ROW_MAJOR, CBLAS_NO_TRANS, rows, columns, 1.0f, A, columns, x, 1, 0.0f, y, 1);
+}
+
+static void cblas_gemm(char trans_a, char trans_b, uint32_t m, uint32_t n, uint32_t k, const data_type* A, const data_type* B, data_type beta, data_type* C) {
+	cblas.sgemm(CBLAS_ROW_MAJOR, trans_a ? CBLAS_TRANS : CBLAS_NO_TRANS, trans_b ? CBLAS_TRANS : CBLAS_NO_TRANS,
+			m, n, k, 1.0f, A, trans_a ? m : k, B, trans_b ? k : n, beta, C, n);
+}
+
+static void cblas_axpy(size_t n, data_type alpha, const data_type* x, data_type* y) {
+	for (size_t i = 0; i < n; i += CBLAS_CHUNK)
+		cblas.saxpy(n - i < CBLAS_CHUNK ? n - i : CBLAS_CHUNK, alpha, x + i, 1, y + i, 1);
+}
+
+static data_type cblas_dot(size_t n, const data_type* x, const data_type* y) {
+	data_type sum = 0.0f;
+	for (size_t i = 0; i < n; i += CBLAS_CHUNK)
+		sum += cblas.sdot(n - i < CBLAS_CHUNK ? n - i : CBLAS_CHUNK, x + i, 1, y + i, 1);
+	return sum;
+}
+
+static void cblas_load(void) {
+	char* names[] = {getenv("NN_CBLAS"), "libcblas.so.3", "libcblas.so", "libopenblas.so.0", "libopenblas.so", "libblas.so.3", "libblas.so"};
+	if (sizeof(data_type) != sizeof(float))
+		return;
+	for (uint32_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+		if (!names[i] || !*names[i] || !(cblas.handle = dlopen(names[i], RTLD_NOW | RTLD_LOCAL)))
+			continue;
+		cblas.sgemv = (cblas_sgemv_fn)dlsym(cblas.handle, "cblas_sgemv");
+		cblas.sgemm = (cblas_sgemm_fn)dlsym(cblas.handle, "cblas_sgemm");
+		cblas.saxpy = (cblas_saxpy_fn)dlsym(cblas.handle, "cblas_saxpy");
+		cblas.sdot = (cblas_sdot_fn)dlsym(cblas.handle, "cblas_sdot");
+		if (cblas.sgemv && cblas.sgemm && cblas.saxpy && cblas.sdot)
+			return;
+		// a Fortran only BLAS, keep looking
+		dlclose(cblas.handle);
+		cblas.handle = NULL;
+	}
+}
+
+static const NN_kernels backends[NN_BACKENDS] = {
+	[NN_BACKEND_REFERENCE] = {
+		.name = "reference",
+		.gemv = reference_gemv,
+		.gemm = reference_gemm,
+		.axpy = reference_axpy,
+		.activate = reference_activation,
+		.dot = reference_dot,
+	},
+	[NN_BACKEND_OPTIMIZED] = {
+		.name = "optimized",
+		.gemv = optimized_gemv,
+		.gemm = optimized_gemm,
+		.axpy = optimized_axpy,
+		.activate = optimized_activation,
+		.dot = optimized_dot,
+	},
+	[NN_BACKEND_CBLAS] = {
+		.name = "cblas",
+		.gemv = cblas_gemv,
+		.gemm = cblas_gemm,
+		.axpy = cblas_axpy,
+		.activate = optimized_activation,
+		.dot = cblas_dot,
+	},
+};
+
+static _Atomic(const NN_kernels*) current = NULL;
+static pthread_once_t tuning_once = PTHREAD_ONCE_INIT;
+
+// the winners an earlier NN_autotune cached, so a run that doesn't tune uses them too
+static void tuning_load(void) {
+	NN_autotune_load(NULL, NULL);
+}
+
+const NN_kernels* NN_kernels_get(enum NN_backend backend) {
+	if (backend >= NN_BACKENDS) return NULL;
+	if (backend == NN_BACKEND_CBLAS) {
+		pthread_once(&cblas.once, cblas_load);
+		if (!cblas.handle) return NULL;
+	}
+	return &backends[backend];
+}
+
+char* NN_kernels_name(enum NN_backend backend) {
+	return backend < NN_BACKENDS ? backends[backend].name : "unknown";
+}
+
+short NN_kernels_select(enum NN_backend backend) {
+	const NN_kernels* kernels = NN_kernels_get(backend);
+	if (!kernels)
+		return kernels_err(backend == NN_BACKEND_CBLAS ? "No CBLAS library found, set NN_CBLAS to its path" : "Unknown kernel backend", 1);
+	pthread_once(&tuning_once, tuning_load);
+	atomic_store_explicit(&current, kernels, memory_order_release);
+	return 0;
+}
+
+short NN_kernels_select_name(char* name) {
+	if (!name) return 11;
+	for (uint32_t b = 0; b < NN_BACKENDS; b++)
+		if (!strcmp(name, backends[b].name))
+			return NN_kernels_select(b);
+	return kernels_err("Unknown kernel backend, use reference, optimized or cblas", 2);
+}
+
+// the first call reads NN_BACKEND, anything it can't use falls back to optimized
+const NN_kernels* NN_kernels_current(void) {
+	const NN_kernels* kernels = atomic_load_explicit(&current, memory_order_acquire);
+	if (kernels) return kernels;
+	char* env = getenv("NN_BACKEND");
+	if (!env || !*env || NN_kernels_select_name(env))
+		NN_kernels_select(NN_BACKEND_OPTIMIZED);
+	return atomic_load_explicit(&current, memory_order_acquire);
+}
+
+enum NN_backend NN_kernels_selected(void) {
+	return (enum NN_backend)(NN_kernels_current() - backends);
+}
@@ -1,4 +1,5 @@
 #include <linear-algebra.h>
+#include <kernels.h>
 
 short linear_err(char* msg, short code, char* func) {
 	perror(func);
@@ -12,22 +13,22 @@ short linear_death(char* msg, short code) {
 }
 
 void vector_free(Vector* vector) {
-	free(vector->V);
+	NN_mem_free(vector->V);
 	vector->V = NULL;
 }
 void matrix_free(Matrix* matrix) {
-	free(matrix->M);
+	NN_mem_free(matrix->M);
 	matrix->M = NULL;
 }
 
 data_type matrix_get(Matrix* m, uint32_t row, uint32_t column) {
-	return *(m->M + row * m->columns + column);
+	return *(m->M + (size_t)row * m->columns + column);
 }
 void matrix_set(Matrix* m, uint32_t row, uint32_t column, data_type value) {
-	*(m->M + row * m->columns + column) = value;
+	*(m->M + (size_t)row * m->columns + column) = value;
 }
 void matrix_add(Matrix* m, uint32_t row, uint32_t column, data_type value) {
-	*(m->M + row * m->columns + column) += value;
+	*(m->M + (size_t)row * m->columns + column) += value;
 }
 
 data_type vector_get(Vector* m, uint32_t index) {
@@ -54,10 +55,7 @@ short scale_v(Vector* v, data_type scalar) {
 
 
 data_type vector_sqrd_mod(Vector* vector) {
-	data_type mod = 0.0;
-	for (uint32_t i = 0; i<vector->size; i++)
-		mod += vector->V[i]*vector->V[i];
-	return mod;
+	return NN_kernels_current()->dot(vector->size, vector->V, vector->V);
 }
 
 data_type vector_mod(Vector* vector) {
@@ -98,16 +96,16 @@ short to_matrix(Vector* vector, Matrix* dst) {
 
 
 
-short vector_new(Vector* dst, uint32_t size) {
-	free(dst->V);
-	return vector_init(dst, size);
+short vector_new_at(Vector* dst, uint32_t size, const char* file, int line) {
+	NN_mem_free(dst->V);
+	return vector_init_at(dst, size, file, line);
 }
-short matrix_new(Matrix* dst, uint32_t rows, uint32_t columns) {
-	free(dst->M);
-	return matrix_init(dst, rows, columns);
+short matrix_new_at(Matrix* dst, uint32_t rows, uint32_t columns, const char* file, int line) {
+	NN_mem_free(dst->M);
+	return matrix_init_at(dst, rows, columns, file, line);
 }
 
-short matrix_init(Matrix* dst, uint32_t rows, uint32_t columns) {
+short matrix_init_at(Matrix* dst, uint32_t rows, uint32_t columns, const char* file, int line) {
 #ifndef NO_LINEAR_CHECKS
 	if (!dst)
 		return linear_death("matrix_init: vector argument = NULL", 2);
@@ -116,23 +114,26 @@ short matrix_init(Matrix* dst, uint32_t rows, uint32_t columns) {
 	if (!columns)
 		return linear_death("matrix_init: columns = 0", 3);
 #endif
-	uint32_t al = sizeof(data_type) * rows * columns;
-	if (!(dst->M = malloc(al)))
+	// element counts past 32 bits are fine, the byte count just has to fit
+	if ((size_t)rows * columns > SIZE_MAX / sizeof(data_type))
+		return linear_death("matrix_init: rows x columns too big", 4);
+	size_t al = sizeof(data_type) * (size_t)rows * columns;
+	if (!(dst->M = NN_mem_alloc(al, file, line)))
 		return linear_err("matrix_init: Failed to allocate memory", 1, "malloc");
 	dst->columns = columns;
 	dst->rows = rows;
 	return 0;
 }
 
-short vector_init(Vector* dst, uint32_t size) {
+short vector_init_at(Vector* dst, uint32_t size, const char* file, int line) {
 #ifndef NO_LINEAR_CHECKS
 	if (!dst)
 		return linear_death("vector_init: Invalid vector argument (zero)", 2);
 	if (!size)
 		return linear_death("vector_init: Invalid size argument (zero)", 3);
 #endif
-	uint32_t al = sizeof(data_type) * size;
-	if ( !(dst->V = malloc(al)))
+	size_t al = sizeof(data_type) * (size_t)size;
+	if ( !(dst->V = NN_mem_alloc(al, file, line)))
 		return linear_death("vector_init: Failed to allocate memory", 1);
 	dst->size = size;
 	return 0;
@@ -224,13 +225,32 @@ short multiply_mm(Matrix* M1, Matrix* M2, Matrix* dst) {
 	uint32_t columns = M2->columns;
 	dst->rows = rows;
 	dst->columns = columns;
-	for (uint32_t row = 0; row < rows; row++)
-		for (uint32_t column = 0; column < columns; column++) {
-			uint32_t n = row*columns + column;
-			dst->M[n] = 0.0;
-			for (uint32_t i = 0; i < m; i++)
-				dst->M[n] += matrix_get(M1,row,column+i) * matrix_get(M2,row+i,column);
-		}
+	NN_kernels_current()->gemm(0, 0, rows, columns, m, M1->M, M2->M, 0.0f, dst->M);
+	return 0;
+}
+
+// dst += M1 * M2^T
+short multiply_mmt_add(Matrix* M1, Matrix* M2, Matrix* dst) {
+#ifndef NO_LINEAR_CHECKS
+	if (!M1 || !M2 || !dst) return 11;
+	if (M1->columns != M2->columns) return 1;
+	if (dst->rows != M1->rows || dst->columns != M2->rows) return 2;
+#endif
+	NN_kernels_current()->gemm(0, 1, M1->rows, M2->rows, M1->columns, M1->M, M2->M, 1.0f, dst->M);
+	return 0;
+}
+
+// dst = M1^T * M2
+short multiply_mtm(Matrix* M1, Matrix* M2, Matrix* dst) {
+#ifndef NO_LINEAR_CHECKS
+	if (!M1 || !M2 || !dst) return 11;
+	if (M1->rows != M2->rows) return 1;
+#endif
+	uint32_t rows = M1->columns;
+	uint32_t columns = M2->columns;
+	dst->rows = rows;
+	dst->columns = columns;
+	NN_kernels_current()->gemm(1, 0, rows, columns, M1->rows, M1->M, M2->M, 0.0f, dst->M);
 	return 0;
 }
 
@@ -248,14 +268,8 @@ short multiply_mv(Matrix* M, Vector* v, Vector* dst) {
 	if (!M || !v || !dst) return 11;
 	if (M->columns != v->size) return 1;
 #endif
-	uint32_t rows = M->rows;
-	uint32_t size = M->columns;
-	dst->size = rows;
-	for (uint32_t row = 0; row < rows; row++) {
-		dst->V[row] = 0.0;
-		for (uint32_t i = 0; i < size; i++)
-			dst->V[row] += matrix_get(M,row,i) * v->V[i];
-	}
+	dst->size = M->rows;
+	NN_kernels_current()->gemv(M->rows, M->columns, M->M, v->V, dst->V);
 	return 0;
 }
 
@@ -0,0 +1,248 @@
+#include <low-rank.h>
+
+static short lowrank_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Low Rank] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+// U and V in one block, the allocation category is the caller's
+static short factors_init(struct NN_layer* dst, uint32_t rows, uint32_t columns, uint32_t rank) {
+	Matrix factors;
+	if (matrix_init(&factors, rank, rows + columns)) return 1;
+	dst->rank = rank;
+	dst->U = (Matrix) {.rows = rows, .columns = rank, .M = factors.M};
+	dst->V = (Matrix) {.rows = rank, .columns = columns, .M = factors.M + (size_t)rows * rank};
+	return 0;
+}
+
+short NN_layer_init_lowrank(struct NN_layer* dst, uint32_t input_nodes, uint32_t nodes, uint32_t rank) {
+	if (!dst) return 11;
+	if (!rank || rank > nodes || rank > input_nodes)
+		return lowrank_err("The rank has to be between 1 and the smaller side of the layer", 2);
+	dst->weights = (Matrix) {.rows = nodes, .columns = input_nodes, .M = NULL};
+	dst->U = dst->V = (Matrix) {0};
+	dst->frozen = 0;
+	dst->biases.V = NULL;
+	enum NN_mem_category category = NN_mem_category(NN_MEM_WEIGHTS);
+	short err = factors_init(dst, nodes, input_nodes, rank) || vector_init(&dst->biases, nodes);
+	NN_mem_category(category);
+	if (err) matrix_free(&dst->U);
+	return err;
+}
+
+// the weights as updates and gradients see them: U then V for a factored layer
+void NN_layer_parameters(struct NN_layer* layer, Matrix* dst) {
+	if (layer->rank)
+		*dst = (Matrix) {.rows = layer->rank, .columns = layer->U.rows + layer->V.columns, .M = layer->U.M};
+	else
+		*dst = layer->weights;
+}
+
+char NeuralNetwork_is_factored(struct NeuralNetwork* NN) {
+	for (uint32_t l = 1; l <= NN->num_hidden_layers + 1u; l++)
+		if (NeuralNetwork_layer(NN, l)->rank)
+			return 1;
+	return 0;
+}
+
+// dst = W.input, through inner = V.input for a factored layer
+short NN_layer_multiply(struct NN_layer* layer, Vector* input, Vector* inner, Vector* dst) {
+	if (!layer->rank)
+		return multiply_mv(&layer->weights, input, dst);
+	if (!inner || multiply_mv(&layer->V, input, inner))
+		return 1;
+	return multiply_mv(&layer->U, inner, dst);
+}
+
+/*
+ * z = NULL: dCda already is the derivative with respect to z. With dz the
+ * derivative with respect to z: dU += dz.inner^T, then inner is reused for
+ * U^T.dz, dV += (U^T.dz).prev_a^T and temp_dCda += V^T.U^T.dz. Without a
+ * factor_gradient (a frozen layer) only temp_dCda is.
+ */
+void NN_layer_backward_lowrank(struct NN_layer* layer, Vector* z, Vector* prev_a, Vector* inner, Vector* dCda, Vector* temp_dCda, Matrix* factor_gradient, Vector* bias_gradient) {
+	uint32_t rows = layer->U.rows, rank = layer->rank, columns = layer->V.columns;
+	data_type* dU = factor_gradient->M;
+	data_type* dV = dU ? dU + (size_t)rows * rank : NULL;
+
+	for (uint32_t row = 0; row < rows; row++) {
+		data_type dz = (z ? activation_derivative(z->V[row]) : 1.0f) * dCda->V[row];
+		dCda->V[row] = dz;
+		if (!dU) continue;
+		data_type* g = dU + (size_t)row * rank;
+		bias_gradient->V[row] += dz;
+		for (uint32_t k = 0; k < rank; k++)
+			g[k] += dz * inner->V[k];
+	}
+	memset(inner->V, 0, rank * sizeof(data_type));
+	for (uint32_t row = 0; row < rows; row++) {
+		const data_type* u = layer->U.M + (size_t)row * rank;
+		for (uint32_t k = 0; k < rank; k++)
+			inner->V[k] += u[k] * dCda->V[row];
+	}
+	for (uint32_t k = 0; k < rank; k++) {
+		data_type d = inner->V[k];
+		const data_type* v = layer->V.M + (size_t)k * columns;
+		if (!dV) {
+			for (uint32_t column = 0; column < columns; column++)
+				temp_dCda->V[column] += v[column] * d;
+			continue;
+		}
+		data_type* g = dV + (size_t)k * columns;
+		for (uint32_t column = 0; column < columns; column++) {
+			g[column] += prev_a->V[column] * d;
+			temp_dCda->V[column] += v[column] * d;
+		}
+	}
+	temp_dCda->size = columns;
+}
+
+short NeuralNetwork_lowrank(struct NeuralNetwork* NN, uint32_t l, uint32_t rank) {
+	if (!NN || !l || l > NN->num_hidden_layers + 1u) return 11;
+	struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+	struct NN_layer factored;
+	if (NN_layer_init_lowrank(&factored, layer->weights.columns, layer->weights.rows, rank))
+		return 1;
+	NeuralNetwork_write_begin(NN);
+	NN_layer_free(*layer);
+	*layer = factored;
+	NeuralNetwork_write_end(NN);
+	return 0;
+}
+
+/*
+ * Modified Gram-Schmidt, a row in the span of the ones above it ends up zero.
+ * The rows come out of W^T.W nearly parallel, so every row is projected out
+ * twice, once isn't orthogonal to float precision.
+ */
+static void orthonormalize_rows(Matrix* m) {
+	for (uint32_t i = 0; i < m->rows; i++) {
+		data_type* r = m->M + (size_t)i * m->columns;
+		double norm = 0.0;
+		for (uint32_t j = 0; j < 2 * i; j++) {
+			const data_type* q = m->M + (size_t)(j % i) * m->columns;
+			double dot = 0.0;
+			for (uint32_t c = 0; c < m->columns; c++)
+				dot += (double)r[c] * q[c];
+			for (uint32_t c = 0; c < m->columns; c++)
+				r[c] -= dot * q[c];
+		}
+		for (uint32_t c = 0; c < m->columns; c++)
+			norm += (double)r[c] * r[c];
+		data_type scale = norm > 1e-24 ? 1.0 / sqrt(norm) : 0.0;
+		for (uint32_t c = 0; c < m->columns; c++)
+			r[c] *= scale;
+	}
+}
+
+/*
+ * Truncated SVD by subspace iteration: the rows of V converge to the top rank
+ * right singular vectors of W (V <- orth(W^T.W.V^T)^T), U = W.V^T is then the
+ * projection of W onto them, the best rank approximation in the Frobenius
+ * norm once converged.
+ */
+short NN_layer_factorize(struct NN_layer* layer, uint32_t rank, uint64_t seed, uint64_t stream, float* retained) {
+	if (!layer) return 11;
+	if (layer->rank) return lowrank_err("The layer already is factored", 1);
+	uint32_t rows = layer->weights.rows, columns = layer->weights.columns;
+	if (!rank || rank > rows || rank > columns)
+		return lowrank_err("The rank has to be between 1 and the smaller side of the layer", 2);
+	struct NN_layer factored = {.U = {0}};
+	enum NN_mem_category category = NN_mem_category(NN_MEM_WEIGHTS);
+	short err = factors_init(&factored, rows, columns, rank);
+	NN_mem_category(category);
+	if (err) return lowrank_err("Failed to allocate the factors", 3);
+
+	Matrix* W = &layer->weights;
+	Matrix* U = &factored.U;
+	Matrix* V = &factored.V;
+	rng_fill_normal(seed, stream, 0, V->M, (size_t)rank * columns, 0.0f, 1.0f);
+	orthonormalize_rows(V);
+	for (uint32_t i = 0; i <= NN_LOWRANK_ITERATIONS; i++) {
+		memset(U->M, 0, (size_t)rows * rank * sizeof(data_type));
+		multiply_mmt_add(W, V, U);
+		if (i == NN_LOWRANK_ITERATIONS) break;
+		multiply_mtm(U, W, V);
+		orthonormalize_rows(V);
+	}
+
+	if (retained) {
+		double kept = 0.0, total = 0.0;
+		for (size_t i = 0; i < (size_t)rows * rank; i++)
+			kept += (double)U->M[i] * U->M[i];
+		for (size_t i = 0; i < (size_t)rows * columns; i++)
+			total += (double)W->M[i] * W->M[i];
+		*retained = total > 0.0 ? kept / total : 1.0f;
+	}
+	matrix_free(&layer->weights);
+	layer->rank = rank;
+	layer->U = *U;
+	layer->V = *V;
+	return 0;
+}
+
+static size_t layer_parameters(struct NN_layer* layer) {
+	Matrix p;
+	NN_layer_parameters(layer, &p);
+	return (size_t)p.rows * p.columns + layer->biases.size;
+}
+
+short NeuralNetwork_factorize(struct NeuralNetwork* NN, uint32_t* ranks, uint64_t seed, NN_eval_args* eval, NN_factorize_result* result) {
+	if (!NN || !ranks) return 11;
+	int err = 0;
+	uint32_t n = NN->num_hidden_layers + 1;
+	NN_factorize_result r = {0};
+	NN_eval_result before = {0}, after = {0};
+
+	for (uint32_t l = 1; l <= n; l++)
+		r.parameters_before += layer_parameters(NeuralNetwork_layer(NN, l));
+	if (eval) {
+		eval->NN = NN;
+		if (NeuralNetwork_evaluate(*eval, &before)) goto EVAL_err;
+	}
+
+	NeuralNetwork_write_begin(NN);
+	for (uint32_t l = 1; l <= n; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		float retained;
+		if (!ranks[l-1]) continue;
+		if (NN_layer_factorize(layer, ranks[l-1], seed, NN_RNG_STREAM(NN_RNG_FACTORS, l), &retained)) {
+			NeuralNetwork_write_end(NN);
+			goto FACTORIZE_err;
+		}
+		printf(FG_GRAY "[Neural Network Low Rank] " C_RESET "layer %u: %ux%u to rank %u, %zu -> %zu weights, %.2f%% of |W|^2 kept\n",
+				l, layer->weights.rows, layer->weights.columns, layer->rank,
+				(size_t)layer->weights.rows * layer->weights.columns,
+				(size_t)layer->rank * (layer->weights.rows + layer->weights.columns), 100.0 * retained);
+	}
+	NeuralNetwork_write_end(NN);
+
+	for (uint32_t l = 1; l <= n; l++)
+		r.parameters_after += layer_parameters(NeuralNetwork_layer(NN, l));
+	if (eval) {
+		if (NeuralNetwork_evaluate(*eval, &after)) goto AFTER_err;
+		r.accuracy_before = before.accuracy;
+		r.accuracy_after = after.accuracy;
+		r.loss_before = before.loss;
+		r.loss_after = after.loss;
+	}
+	printf(FG_GRAY "[Neural Network Low Rank] " C_RESET "parameters %zu -> %zu", r.parameters_before, r.parameters_after);
+	if (eval)
+		printf(", accuracy %.4f -> %.4f (%+.4f), loss %g -> %g",
+				r.accuracy_before, r.accuracy_after, r.accuracy_after - r.accuracy_before, r.loss_before, r.loss_after);
+	putchar('\n');
+	if (result) *result = r;
+	return 0;
+
+AFTER_err: err++;
+EVAL_err: err++;
+FACTORIZE_err: err++;
+	char* msg[] = {
+		NULL,
+		"Failed to factorize a layer",
+		"Failed to evaluate the network",
+		"Failed to evaluate the factorized network",
+	};
+	printf(FG_GRAY "[Neural Network Low Rank] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg[err]);
+	return err;
+}
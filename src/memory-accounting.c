@@ -0,0 +1,419 @@
+#include <memory-accounting.h>
+#include <term_colors.h>
+
+#define MEM_TOMBSTONE ((void*)1)
+#define MEM_MIN_CAPACITY 1024
+#define MEM_MPOL_LOCAL 4
+
+enum mem_mapping {
+	MEM_HEAP,
+	MEM_MAPPED,
+	MEM_TRANSPARENT,		// aligned to a huge page and advised
+	MEM_HUGETLB,
+};
+
+struct mem_block {
+	void* block;			// NULL = empty slot
+	size_t bytes;
+	const char* file;
+	int32_t line;
+	uint8_t category;
+	uint8_t mapping;
+	uint8_t local;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct mem_block* table;
+	size_t capacity;		// power of two
+	size_t used;			// live blocks and tombstones
+	NN_mem_stats stats;
+	uint64_t step_start;
+	char debug;				// -1 = not read from the environment yet
+	char pages;				// enum NN_mem_pages, -1 = not read from the environment yet
+} mem = {.lock = PTHREAD_MUTEX_INITIALIZER, .debug = -1, .pages = -1};
+
+static _Thread_local uint8_t mem_current = NN_MEM_SCRATCH;
+static _Thread_local char mem_local = 0;
+
+static char* mem_names[NN_MEM_CATEGORIES] = {"scratch", "weights", "gradients", "activations"};
+
+static size_t mem_slot(void* block, size_t capacity) {
+	return ((uintptr_t)block >> 4) * 0x9e3779b97f4a7c15ull >> 7 & (capacity - 1);
+}
+
+static struct mem_block* mem_find(void* block) {
+	if (!mem.table) return NULL;
+	for (size_t i = mem_slot(block, mem.capacity); mem.table[i].block; i = (i + 1) & (mem.capacity - 1))
+		if (mem.table[i].block == block)
+			return &mem.table[i];
+	return NULL;
+}
+
+static void mem_account_free(struct mem_block* entry) {
+	NN_mem_usage* c = &mem.stats.category[entry->category];
+	c->live -= entry->bytes;
+	c->frees++;
+	mem.stats.total.live -= entry->bytes;
+	mem.stats.total.frees++;
+	mem.stats.blocks--;
+	if (entry->mapping != MEM_HEAP) mem.stats.mapped -= entry->bytes;
+	if (entry->mapping == MEM_TRANSPARENT) mem.stats.transparent -= entry->bytes;
+	if (entry->mapping == MEM_HUGETLB) mem.stats.hugetlb -= entry->bytes;
+	if (entry->local) mem.stats.local -= entry->bytes;
+	entry->block = MEM_TOMBSTONE;
+}
+
+// rehashes into twice the live blocks, dropping the tombstones
+static char mem_grow(void) {
+	size_t capacity = MEM_MIN_CAPACITY;
+	while (capacity < 4 * (mem.stats.blocks + 1)) capacity <<= 1;
+	struct mem_block* table = calloc(capacity, sizeof(struct mem_block));
+	if (!table) return 1;
+	for (size_t i = 0; i < mem.capacity; i++) {
+		if (!mem.table[i].block || mem.table[i].block == MEM_TOMBSTONE) continue;
+		size_t s = mem_slot(mem.table[i].block, capacity);
+		while (table[s].block) s = (s + 1) & (capacity - 1);
+		table[s] = mem.table[i];
+	}
+	free(mem.table);
+	mem.table = table;
+	mem.capacity = capacity;
+	mem.used = mem.stats.blocks;
+	return 0;
+}
+
+static char mem_insert(void* block, size_t bytes, uint8_t mapping, char local, const char* file, int line) {
+	struct mem_block* stale = mem_find(block);
+	// the previous owner of the address went through a plain free
+	if (stale) mem_account_free(stale);
+	if ((mem.used + 1) * 4 > mem.capacity * 3 && mem_grow())
+		return 1;
+	size_t s = mem_slot(block, mem.capacity);
+	while (mem.table[s].block && mem.table[s].block != MEM_TOMBSTONE) s = (s + 1) & (mem.capacity - 1);
+	if (!mem.table[s].block) mem.used++;
+	mem.table[s] = (struct mem_block) {.block = block, .bytes = bytes, .file = file, .line = line, .category = mem_current, .mapping = mapping, .local = local};
+	NN_mem_usage* c = &mem.stats.category[mem_current];
+	c->live += bytes;
+	c->allocations++;
+	if (c->live > c->peak) c->peak = c->live;
+	mem.stats.total.live += bytes;
+	mem.stats.total.allocations++;
+	if (mem.stats.total.live > mem.stats.total.peak) mem.stats.total.peak = mem.stats.total.live;
+	mem.stats.blocks++;
+	if (mapping != MEM_HEAP) mem.stats.mapped += bytes;
+	if (mapping == MEM_TRANSPARENT) mem.stats.transparent += bytes;
+	if (mapping == MEM_HUGETLB) mem.stats.hugetlb += bytes;
+	if (local) mem.stats.local += bytes;
+	return 0;
+}
+
+static enum NN_mem_pages mem_pages(void) {
+	if (mem.pages < 0) {
+		char* env = getenv("NN_MEM_HUGE_PAGES");
+		mem.pages = !env ? NN_MEM_PAGES_SMALL :
+			!strcmp(env, "hugetlb") ? NN_MEM_PAGES_HUGETLB :
+			!strcmp(env, "thp") ? NN_MEM_PAGES_TRANSPARENT : NN_MEM_PAGES_SMALL;
+	}
+	return mem.pages;
+}
+
+static size_t mem_page_size(void) {
+	static size_t page;
+	if (!page) {
+		long p = sysconf(_SC_PAGESIZE);
+		page = p > 0 ? p : 4096;
+	}
+	return page;
+}
+
+// what munmap takes back: huge page mappings are whole huge pages
+static size_t mem_map_length(size_t bytes, uint8_t mapping) {
+	if (mapping == MEM_TRANSPARENT || mapping == MEM_HUGETLB)
+		return (bytes + NN_MEM_HUGE_PAGE - 1) / NN_MEM_HUGE_PAGE * NN_MEM_HUGE_PAGE;
+	return bytes;
+}
+
+// over allocated by a huge page and trimmed to start on one
+static void* mem_map_aligned(size_t length, int flags) {
+	char* p = mmap(NULL, length + NN_MEM_HUGE_PAGE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+	size_t head = (NN_MEM_HUGE_PAGE - (uintptr_t)p % NN_MEM_HUGE_PAGE) % NN_MEM_HUGE_PAGE;
+	if (head) munmap(p, head);
+	munmap(p + head + length, NN_MEM_HUGE_PAGE - head);
+	return p + head;
+}
+
+/*
+ * NULL with *mapping = MEM_HEAP: malloc it. Reserved huge pages fall back to
+ * transparent ones, the local policy is a hint the kernel may not know.
+ */
+static void* mem_map(size_t bytes, uint8_t* mapping, char* local) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | (bytes >= NN_MEM_MAP_THRESHOLD ? MAP_NORESERVE : 0);
+	enum NN_mem_pages pages = mem_current == NN_MEM_SCRATCH || bytes < NN_MEM_HUGE_THRESHOLD ? NN_MEM_PAGES_SMALL : mem_pages();
+	void* block = NULL;
+	*local = mem_local && bytes >= mem_page_size();
+	*mapping = MEM_HEAP;
+	if (pages == NN_MEM_PAGES_HUGETLB) {
+		block = mmap(NULL, mem_map_length(bytes, MEM_HUGETLB), PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED) *mapping = MEM_HUGETLB;
+		else block = NULL;
+	}
+	if (!block && pages != NN_MEM_PAGES_SMALL && (block = mem_map_aligned(mem_map_length(bytes, MEM_TRANSPARENT), flags))) {
+		*mapping = MEM_TRANSPARENT;
+		madvise(block, mem_map_length(bytes, MEM_TRANSPARENT), MADV_HUGEPAGE);
+	}
+	if (!block && (*local || bytes >= NN_MEM_MAP_THRESHOLD)) {
+		block = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (block != MAP_FAILED) *mapping = MEM_MAPPED;
+		else block = NULL;
+	}
+	if (block && *local)
+		syscall(SYS_mbind, block, mem_map_length(bytes, *mapping), MEM_MPOL_LOCAL, NULL, 0, 0);
+	if (!block) *local = 0;
+	return block;
+}
+
+/*
+ * A malloc'd block that can't be put in the table is still handed out, just
+ * not counted. A mapped one can't: only the table knows to munmap it.
+ */
+void* NN_mem_alloc(size_t bytes, const char* file, int line) {
+	uint8_t mapping;
+	char local, failed;
+	void* block = mem_map(bytes, &mapping, &local);
+	if (mapping == MEM_HEAP && (bytes >= NN_MEM_MAP_THRESHOLD || !(block = malloc(bytes))))
+		return NULL;
+	pthread_mutex_lock(&mem.lock);
+	failed = mem_insert(block, bytes, mapping, local, file, line);
+	pthread_mutex_unlock(&mem.lock);
+	if (failed && mapping != MEM_HEAP) {
+		munmap(block, mem_map_length(bytes, mapping));
+		return NULL;
+	}
+	return block;
+}
+
+void NN_mem_free(void* block) {
+	if (!block) return;
+	size_t mapped = 0;
+	pthread_mutex_lock(&mem.lock);
+	struct mem_block* entry = mem_find(block);
+	if (entry) {
+		if (entry->mapping != MEM_HEAP) mapped = mem_map_length(entry->bytes, entry->mapping);
+		mem_account_free(entry);
+	}
+	pthread_mutex_unlock(&mem.lock);
+	if (mapped) munmap(block, mapped);
+	else free(block);
+}
+
+// sets the calling thread's category for the following allocations, returns the previous one
+enum NN_mem_category NN_mem_category(enum NN_mem_category category) {
+	enum NN_mem_category previous = mem_current;
+	if (category < NN_MEM_CATEGORIES) mem_current = category;
+	return previous;
+}
+
+char* NN_mem_category_name(enum NN_mem_category category) {
+	return category < NN_MEM_CATEGORIES ? mem_names[category] : "unknown";
+}
+
+// for the blocks allocated from now on, overrides NN_MEM_HUGE_PAGES
+void NN_mem_huge_pages(enum NN_mem_pages pages) {
+	if (pages <= NN_MEM_PAGES_HUGETLB) mem.pages = pages;
+}
+
+// first touch placement for the calling thread's following allocations, returns the previous setting
+char NN_mem_local(char on) {
+	char previous = mem_local;
+	mem_local = on ? 1 : 0;
+	return previous;
+}
+
+void NN_mem_step(void) {
+	pthread_mutex_lock(&mem.lock);
+	mem.stats.step_allocations = mem.stats.total.allocations - mem.step_start;
+	if (mem.stats.step_allocations > mem.stats.max_step_allocations)
+		mem.stats.max_step_allocations = mem.stats.step_allocations;
+	mem.stats.steps++;
+	mem.step_start = mem.stats.total.allocations;
+	pthread_mutex_unlock(&mem.lock);
+}
+
+void NN_mem_get_stats(NN_mem_stats* dst) {
+	pthread_mutex_lock(&mem.lock);
+	*dst = mem.stats;
+	pthread_mutex_unlock(&mem.lock);
+}
+
+void NN_mem_debug(char on) {
+	mem.debug = on ? 1 : 0;
+}
+
+char NN_mem_debugging(void) {
+	if (mem.debug < 0) {
+		char* env = getenv("NN_MEM_DEBUG");
+		mem.debug = env && *env && strcmp(env, "0");
+	}
+	return mem.debug;
+}
+
+struct mem_site {
+	const char* file;
+	int32_t line;
+	uint8_t category;
+	size_t blocks;
+	size_t bytes;
+};
+
+static int site_compare(const void* a, const void* b) {
+	const struct mem_site* x = a;
+	const struct mem_site* y = b;
+	int c = strcmp(x->file ? x->file : "", y->file ? y->file : "");
+	if (c) return c;
+	if (x->line != y->line) return x->line < y->line ? -1 : 1;
+	return (int)x->category - (int)y->category;
+}
+
+// live blocks grouped by site and category, NULL when there are none or no memory
+static struct mem_site* mem_sites(size_t* count) {
+	struct mem_site* sites = NULL;
+	size_t n = 0, merged = 0;
+	pthread_mutex_lock(&mem.lock);
+	if (mem.stats.blocks && (sites = malloc(mem.stats.blocks * sizeof(struct mem_site))))
+		for (size_t i = 0; i < mem.capacity; i++) {
+			struct mem_block* b = &mem.table[i];
+			if (!b->block || b->block == MEM_TOMBSTONE) continue;
+			sites[n++] = (struct mem_site) {.file = b->file, .line = b->line, .category = b->category, .blocks = 1, .bytes = b->bytes};
+		}
+	pthread_mutex_unlock(&mem.lock);
+	if (!sites) {
+		*count = 0;
+		return NULL;
+	}
+	qsort(sites, n, sizeof(struct mem_site), site_compare);
+	for (size_t i = 0; i < n; i++) {
+		if (merged && !site_compare(&sites[merged-1], &sites[i])) {
+			sites[merged-1].blocks++;
+			sites[merged-1].bytes += sites[i].bytes;
+		} else sites[merged++] = sites[i];
+	}
+	*count = merged;
+	return sites;
+}
+
+struct mem_span {
+	void* block;
+	size_t bytes;
+	uint8_t category;
+};
+
+/*
+ * move_pages without target nodes only reports where pages are. The blocks
+ * are copied out first, one freed meanwhile just reads as untouched.
+ */
+short NN_mem_get_placement(NN_mem_placement* dst) {
+	size_t n = 0, page = mem_page_size();
+	struct mem_span* spans = NULL;
+	void* pages[NN_MEM_PLACEMENT_SAMPLES];
+	int status[NN_MEM_PLACEMENT_SAMPLES];
+	short err = 0;
+	if (!dst) return 11;
+	*dst = (NN_mem_placement) {0};
+	pthread_mutex_lock(&mem.lock);
+	size_t blocks = mem.stats.blocks;
+	if (blocks && (spans = malloc(mem.stats.blocks * sizeof(struct mem_span))))
+		for (size_t i = 0; i < mem.capacity; i++) {
+			struct mem_block* b = &mem.table[i];
+			if (!b->block || b->block == MEM_TOMBSTONE) continue;
+			spans[n++] = (struct mem_span) {.block = b->block, .bytes = b->bytes, .category = b->category};
+		}
+	pthread_mutex_unlock(&mem.lock);
+	if (!spans) return blocks ? 2 : 0;
+
+	for (size_t i = 0; i < n && !err; i++) {
+		uintptr_t first = (uintptr_t)spans[i].block / page * page;
+		size_t count = ((uintptr_t)spans[i].block + spans[i].bytes - first + page - 1) / page;
+		uint32_t samples = count < NN_MEM_PLACEMENT_SAMPLES ? count : NN_MEM_PLACEMENT_SAMPLES;
+		for (uint32_t s = 0; s < samples; s++)
+			pages[s] = (void*)(first + count * s / samples * page);
+		if (syscall(SYS_move_pages, 0, (unsigned long)samples, pages, NULL, status, 0)) {
+			err = 1;
+			break;
+		}
+		for (uint32_t s = 0; s < samples; s++) {
+			size_t bytes = spans[i].bytes * (s + 1) / samples - spans[i].bytes * s / samples;
+			if (status[s] < 0) {
+				dst->untouched[spans[i].category] += bytes;
+				continue;
+			}
+			uint32_t node = status[s] < NN_MEM_NODES ? status[s] : NN_MEM_NODES - 1;
+			dst->node[spans[i].category][node] += bytes;
+			if (node >= dst->nodes) dst->nodes = node + 1;
+		}
+	}
+	free(spans);
+	return err;
+}
+
+// returns the number of live blocks
+size_t NN_mem_report_blocks(FILE* out) {
+	size_t count, blocks = 0;
+	struct mem_site* sites = mem_sites(&count);
+	if (!out) out = stdout;
+	for (size_t i = 0; i < count; i++) {
+		fprintf(out, FG_GRAY "[Neural Network Memory] " C_RESET FG_YELLOW "%zu unfreed %s block%s, %zu bytes" C_RESET " from %s:%d\n",
+				sites[i].blocks, mem_names[sites[i].category], sites[i].blocks == 1 ? "" : "s",
+				sites[i].bytes, sites[i].file ? sites[i].file : "?", sites[i].line);
+		blocks += sites[i].blocks;
+	}
+	free(sites);
+	return blocks;
+}
+
+static void json_usage(FILE* out, NN_mem_usage* usage) {
+	fprintf(out, "{\"live\": %zu, \"peak\": %zu, \"allocations\": %lu, \"frees\": %lu}",
+			usage->live, usage->peak, (unsigned long)usage->allocations, (unsigned long)usage->frees);
+}
+
+// the stats, plus the live blocks by site in debug mode
+short NN_mem_dump_json(FILE* out) {
+	if (!out) return 11;
+	NN_mem_stats stats;
+	NN_mem_get_stats(&stats);
+	fprintf(out, "{\n\t\"total\": ");
+	json_usage(out, &stats.total);
+	fprintf(out, ",\n\t\"categories\": {");
+	for (uint32_t c = 0; c < NN_MEM_CATEGORIES; c++) {
+		fprintf(out, "%s\n\t\t\"%s\": ", c ? "," : "", mem_names[c]);
+		json_usage(out, &stats.category[c]);
+	}
+	fprintf(out, "\n\t},\n\t\"blocks\": %zu,\n\t\"mapped\": %zu,\n\t\"transparent\": %zu,\n\t\"hugetlb\": %zu,\n\t\"local\": %zu,"
+			"\n\t\"steps\": {\"count\": %lu, \"last_allocations\": %lu, \"max_allocations\": %lu}",
+			stats.blocks, stats.mapped, stats.transparent, stats.hugetlb, stats.local,
+			(unsigned long)stats.steps, (unsigned long)stats.step_allocations, (unsigned long)stats.max_step_allocations);
+	NN_mem_placement placement;
+	if (!NN_mem_get_placement(&placement)) {
+		fprintf(out, ",\n\t\"placement\": {");
+		for (uint32_t c = 0; c < NN_MEM_CATEGORIES; c++) {
+			fprintf(out, "%s\n\t\t\"%s\": {\"nodes\": [", c ? "," : "", mem_names[c]);
+			for (uint32_t node = 0; node < placement.nodes; node++)
+				fprintf(out, "%s%zu", node ? ", " : "", placement.node[c][node]);
+			fprintf(out, "], \"untouched\": %zu}", placement.untouched[c]);
+		}
+		fprintf(out, "\n\t}");
+	}
+	if (NN_mem_debugging()) {
+		size_t count;
+		struct mem_site* sites = mem_sites(&count);
+		fprintf(out, ",\n\t\"unfreed\": [");
+		for (size_t i = 0; i < count; i++)
+			fprintf(out, "%s\n\t\t{\"file\": \"%s\", \"line\": %d, \"category\": \"%s\", \"blocks\": %zu, \"bytes\": %zu}",
+					i ? "," : "", sites[i].file ? sites[i].file : "?", sites[i].line, mem_names[sites[i].category], sites[i].blocks, sites[i].bytes);
+		fprintf(out, "%s]", count ? "\n\t" : "");
+		free(sites);
+	}
+	fprintf(out, "\n}\n");
+	return ferror(out) ? 1 : 0;
+}
@@ -1,16 +1,9 @@
 #include <neural-network.h>
-
-static data_type noNANs(data_type x) {
-	return isnan(x) ? 0.0f : x;
-}
-
-// Function to generate a normally distributed random number using Box-Muller transform
-data_type He_Init(float stddev) {
-	float u1 = (float)rand() / RAND_MAX; // Uniform random number in (0,1)
-	float u2 = (float)rand() / RAND_MAX; // Uniform random number in (0,1)
-	float z0 = noNANs(sqrt(-2.0f * log(u1))) * cos(2.0f * M_PI * u2); // Standard normal random variable
-	return z0 * stddev; // Scale and shift to desired mean and stddev
-}
+#include <evaluation.h>
+#include <random.h>
+#include <soa-training.h>
+#include <low-rank.h>
+#include <kernels.h>
 
 static short apply_activation(Vector* vector, Vector* dst) {
 	if (!vector) return 1;
@@ -18,18 +11,19 @@ static short apply_activation(Vector* vector, Vector* dst) {
 	if (!dst) dst = vector;
 	else dst->size = vector->size;
 
-	for (uint32_t i = 0; i < vector->size; i++)
-		dst->V[i] = activation(vector->V[i]);
+	NN_kernels_current()->activate(vector->size, vector->V, dst->V);
 	return 0;
 }
 
 short NN_layer_init(struct NN_layer* dst, uint32_t input_nodes, uint32_t nodes) {
 	if (!dst) return 11;
-	if (matrix_init(&dst->weights, nodes, input_nodes))
-		return 1;
-	if (vector_init(&dst->biases, nodes))
-		return 1;
-	return 0;
+	dst->rank = 0;
+	dst->frozen = 0;
+	dst->U = dst->V = (Matrix) {0};
+	enum NN_mem_category category = NN_mem_category(NN_MEM_WEIGHTS);
+	short err = matrix_init(&dst->weights, nodes, input_nodes) || vector_init(&dst->biases, nodes);
+	NN_mem_category(category);
+	return err;
 }
 
 uint32_t get_biggest_layer(struct NeuralNetwork* NN) {
@@ -39,7 +33,30 @@ uint32_t get_biggest_layer(struct NeuralNetwork* NN) {
 	return NN->output_layer.biases.size > max ? NN->output_layer.biases.size : max;
 }
 
+short NeuralNetwork_freeze_layer(struct NeuralNetwork* NN, uint32_t l, char frozen) {
+	if (!NN || !l || l > NN->num_hidden_layers + 1u) return 11;
+	NeuralNetwork_layer(NN, l)->frozen = frozen ? 1 : 0;
+	return 0;
+}
+
+uint32_t NeuralNetwork_frozen_layers(struct NeuralNetwork* NN) {
+	uint32_t l = 0;
+	while (l <= NN->num_hidden_layers && NeuralNetwork_layer(NN, l + 1)->frozen) l++;
+	return l;
+}
+
+static char has_frozen(struct NeuralNetwork* NN) {
+	for (uint32_t l = 1; l <= NN->num_hidden_layers + 1u; l++)
+		if (NeuralNetwork_layer(NN, l)->frozen)
+			return 1;
+	return 0;
+}
+
+static _Atomic uint64_t NN_epochs = 1;
+
 short NeuralNetwork_init(struct NeuralNetwork* dst, uint32_t input_size, uint16_t hidden_layers) {
+	atomic_store(&dst->generation, atomic_fetch_add(&NN_epochs, 1) << 32);
+	dst->output = NN_OUTPUT_ACTIVATION;
 	dst->input_size = input_size;
 	dst->num_hidden_layers = hidden_layers;
 	if ( !(dst->hidden_layers = malloc(sizeof(struct NN_layer) * hidden_layers)) )
@@ -48,31 +65,68 @@ short NeuralNetwork_init(struct NeuralNetwork* dst, uint32_t input_size, uint16_
 }
 
 short NeuralNetwork_new(struct NeuralNetwork* dst, uint32_t input_size, uint16_t hidden_layers, ...) {
-	NeuralNetwork_init(dst, input_size, hidden_layers);
 	va_list args;
 	va_start(args, hidden_layers);
-	srand( (unsigned int) time(NULL));
+	short err = NeuralNetwork_vnew(dst, input_size, hidden_layers, args);
+	va_end(args);
+	if (!err) NeuralNetwork_randomize(dst, rng_time_seed(), 1);
+	return err;
+}
+
+void NeuralNetwork_write_begin(struct NeuralNetwork* NN) {
+	atomic_fetch_add(&NN->generation, 1);
+}
+
+void NeuralNetwork_write_end(struct NeuralNetwork* NN) {
+	atomic_fetch_add_explicit(&NN->generation, 1, memory_order_release);
+}
+
+uint64_t NeuralNetwork_generation(struct NeuralNetwork* NN) {
+	return atomic_load_explicit(&NN->generation, memory_order_acquire);
+}
+
+// allocates the layers, the weights are left for NeuralNetwork_randomize
+short NeuralNetwork_vnew(struct NeuralNetwork* dst, uint32_t input_size, uint16_t hidden_layers, va_list args) {
+	if (NeuralNetwork_init(dst, input_size, hidden_layers)) return 1;
 	uint32_t prev_neurons = input_size;
 	for (uint32_t i = 0; i <= hidden_layers; i++) {
 		uint32_t neurons = va_arg(args, uint32_t);
 		struct NN_layer* layer = i == hidden_layers ? &dst->output_layer : &dst->hidden_layers[i];
 		if ( NN_layer_init(layer, prev_neurons, neurons))
 			return 1;
-		uint32_t values = prev_neurons * neurons;
-		float stddev = sqrt(2.0f / prev_neurons); // He initialization standard deviation
-		// Initialize weights using He initialization
-		for (uint32_t j = 0; j < values; j++)
-			layer->weights.M[j] = He_Init(stddev);
-		// Initialize biases to zero (or you can use a small constant)
-		for (uint32_t j = 0; j < neurons; j++)
-			layer->biases.V[j] = 0.0f; // or nrand(0.0f, stddev) if you prefer
-
 		prev_neurons = neurons;
 	}
-	va_end(args);
 	return 0;
 }
 
+/*
+ * He initialisation from the counter based generator, layer l is stream
+ * NN_RNG_STREAM(NN_RNG_WEIGHTS, l). The result only depends on the seed, not
+ * on the number of threads.
+ */
+short NeuralNetwork_randomize(struct NeuralNetwork* NN, uint64_t seed, uint16_t threads) {
+	if (!NN) return 11;
+	short err = 0;
+	NeuralNetwork_write_begin(NN);
+	for (uint32_t l = 1; l <= NN->num_hidden_layers + 1u && !err; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		float stddev = sqrt(2.0f / layer->weights.columns); // He initialization standard deviation
+		// U.V gets the same variance: U entries 2/rank, V entries 1/columns
+		if (layer->rank) {
+			if (rng_fill_normal_parallel(seed, NN_RNG_STREAM(NN_RNG_WEIGHTS, l), layer->U.M,
+						(size_t)layer->U.rows * layer->rank, 0.0f, sqrt(2.0f / layer->rank), threads) ||
+				rng_fill_normal_parallel(seed, NN_RNG_STREAM(NN_RNG_FACTORS, l), layer->V.M,
+						(size_t)layer->rank * layer->V.columns, 0.0f, sqrt(1.0f / layer->V.columns), threads))
+				err = 1;
+		} else if (rng_fill_normal_parallel(seed, NN_RNG_STREAM(NN_RNG_WEIGHTS, l), layer->weights.M,
+					(size_t)layer->weights.rows * layer->weights.columns, 0.0f, stddev, threads))
+			err = 1;
+		memset(layer->biases.V, 0, layer->biases.size * sizeof(data_type));
+	}
+	NeuralNetwork_write_end(NN);
+	return err;
+}
+
 short NeuralNetwork_feed(struct NeuralNetwork* NN, Vector* input, Vector* dst) {
 	int err = 0;
 	char failed = 1;
@@ -82,11 +136,14 @@ short NeuralNetwork_feed(struct NeuralNetwork* NN, Vector* input, Vector* dst) {
 	if (!layer_input.V) goto INPUT_ALLOC_err;
 	Vector layer_output = {.size = 0, .V = malloc(max_size * sizeof(data_type))};
 	if (!layer_output.V) goto OUTPUT_ALLOC_err;
+	// the rank of a factored layer is below its width
+	Vector inner = {.size = 0, .V = NULL};
+	if (NeuralNetwork_is_factored(NN) && !(inner.V = malloc(max_size * sizeof(data_type)))) goto INNER_ALLOC_err;
 	memcpy(layer_input.V, input->V, input->size * sizeof(data_type));
 	struct NN_layer* layer;
 	for (uint32_t i = 0; i < NN->num_hidden_layers; i++) {
 		layer = &NN->hidden_layers[i];
-		if (multiply_mv(&layer->weights, &layer_input, &layer_output))
+		if (NN_layer_multiply(layer, &layer_input, &inner, &layer_output))
 			printf(FG_GRAY "[Neural Network] " C_RESET FG_RED FG_BRIGHT "Error applying multiplying weight matrix:" C_RESET " layer=%u\n", i);
 		if (add_vv(&layer_output, &layer->biases, &layer_input))
 			printf(FG_GRAY "[Neural Network] " C_RESET FG_RED FG_BRIGHT "Error adding bias:" C_RESET " layer=%u\n", i);
@@ -95,18 +152,22 @@ short NeuralNetwork_feed(struct NeuralNetwork* NN, Vector* input, Vector* dst) {
 	}
 	layer = &NN->output_layer;
 	if (vector_init(dst, layer->biases.size)) goto DST_ALLOC_err;
-	if (multiply_mv(&layer->weights, &layer_input, &layer_output))
+	if (NN_layer_multiply(layer, &layer_input, &inner, &layer_output))
 		puts(FG_GRAY "[Neural Network] " C_RESET FG_RED FG_BRIGHT "Error multiplying weight matrix:" C_RESET " layer=output");
 	if (add_vv(&layer_output, &layer->biases, dst))
 		puts(FG_GRAY "[Neural Network] " C_RESET FG_RED FG_BRIGHT "Error adding bias:" C_RESET " layer=output");
-	if (apply_activation(dst, NULL))
+	if (NN->output == NN_OUTPUT_SOFTMAX)
+		softmax_v(dst, dst);
+	else if (apply_activation(dst, NULL))
 		puts(FG_GRAY "[Neural Network] " C_RESET FG_RED FG_BRIGHT "Error applying activation function:" C_RESET " layer=output");
 	
 	failed = 0;
 DST_ALLOC_err: err++;
-	vector_free(&layer_input);
-OUTPUT_ALLOC_err: err++;
+	free(inner.V);
+INNER_ALLOC_err: err++;
 	vector_free(&layer_output);
+OUTPUT_ALLOC_err: err++;
+	vector_free(&layer_input);
 INPUT_ALLOC_err: err++;
 INVALID_ARG_err: err++;
 
@@ -115,6 +176,7 @@ INVALID_ARG_err: err++;
 		"Invalid arguments",
 		"Failed to allocate memory for input vector",
 		"Failed to allocate memory for output vector",
+		"Failed to allocate memory for the factored layer vector",
 		"Failed to allocate memory for destination vector",
 	};
 	if (failed)
@@ -125,6 +187,7 @@ INVALID_ARG_err: err++;
 
 void NN_layer_free(struct NN_layer layer) {
 	matrix_free(&layer.weights);
+	matrix_free(&layer.U);
 	vector_free(&layer.biases);
 }
 
@@ -134,159 +197,360 @@ void NeuralNetwork_free(struct NeuralNetwork* NN) {
 		NN_layer_free(NN->hidden_layers[i]);
 	NN_layer_free(NN->output_layer);
 	sfree(NN->hidden_layers);
+	if (NN_mem_debugging())
+		NN_mem_report_blocks(stdout);
 }
 
+// whether lv[l].a has its own buffer or aliases the checkpoint scratch
+static char owns_activation(uint32_t l, uint32_t n, uint16_t interval) {
+	return !interval || l == 0 || (l % interval == 0 && l < n);
+}
 
-short NeuralNetwork_calculate(struct NeuralNetwork* NN,	struct layer_vectors* lv) {
+void NN_workspace_free(struct NeuralNetwork* NN, struct NN_workspace* ws) {
+	uint32_t n = NN->num_hidden_layers + 1;
+	if (ws->lv)
+		for (uint32_t i = 0; i <= n; i++) {
+			if (owns_activation(i, n, ws->checkpoint))
+				vector_free(&ws->lv[i].a);
+			if (!ws->checkpoint)
+				vector_free(&ws->lv[i].z);
+			matrix_free(&ws->lv[i].weight_gradient);
+			vector_free(&ws->lv[i].bias_gradient);
+			vector_free(&ws->lv[i].mask);
+			vector_free(&ws->lv[i].inner);
+		}
+	sfree(ws->lv);
+	vector_free(&ws->scratch);
+	vector_free(&ws->dCda);
+	vector_free(&ws->temp_dCda);
+	vector_free(&ws->desired);
+}
 
-	if (!NN || !lv) return 11;
+short NN_workspace_init(struct NeuralNetwork* NN, struct NN_workspace* dst, char gradients) {
+	return NN_workspace_init_checkpointed(NN, dst, gradients, 0);
+}
 
-	struct NN_layer* layer;
-	uint32_t pl = 0;	// previous layer
-	register uint32_t i;
+short NN_workspace_init_checkpointed(struct NeuralNetwork* NN, struct NN_workspace* dst, char gradients, uint16_t interval) {
+	if (!NN || !dst) return 11;
+	int err = 0;
 	uint32_t n = NN->num_hidden_layers + 1;
+	uint32_t max_layer_size = get_biggest_layer(NN);
+	memset(dst, 0, sizeof(struct NN_workspace));
+	if (interval > n) interval = n;
+	dst->checkpoint = interval;
+
+	// calloc'd so that a partially initialised workspace can always be freed
+	if (!(dst->lv = calloc(n + 1, sizeof(struct layer_vectors)))) goto LV_ALLOC_err;
+	enum NN_mem_category category = NN_mem_category(NN_MEM_SCRATCH);
+	dst->bytes = (n + 1) * sizeof(struct layer_vectors) + (3 * max_layer_size + NN->output_layer.biases.size) * sizeof(data_type);
+	err++;
+	if (vector_init(&dst->desired, NN->output_layer.biases.size)) goto INIT_err;
+	if (vector_init(&dst->dCda, max_layer_size)) goto INIT_err;
+	if (vector_init(&dst->temp_dCda, max_layer_size)) goto INIT_err;
+	memset(dst->temp_dCda.V, 0, max_layer_size * sizeof(data_type));
+	NN_mem_category(NN_MEM_ACTIVATIONS);
+	if (vector_init(&dst->lv[0].a, NN->input_size)) goto INIT_err;
+	// slot p holds z then a of the p-th layer of the current segment
+	if (interval) {
+		if (vector_init(&dst->scratch, 2 * interval * max_layer_size)) goto INIT_err;
+		dst->bytes += (size_t)2 * interval * max_layer_size * sizeof(data_type);
+	}
+	for (uint32_t l = 1; l <= n; l++) {
+		struct NN_layer* layer = (l == n) ? &NN->output_layer : &NN->hidden_layers[l-1];
+		struct layer_vectors* lv = &dst->lv[l];
+		lv->checkpoint = interval;
+		if (interval) {
+			data_type* slot = dst->scratch.V + (size_t)2 * ((l-1) % interval) * max_layer_size;
+			lv->z = (Vector) {.size = layer->biases.size, .V = slot};
+			lv->a = (Vector) {.size = layer->biases.size, .V = slot + max_layer_size};
+		} else if (vector_init(&lv->z, layer->biases.size))
+			goto INIT_err;
+		if (owns_activation(l, n, interval)) {
+			if (vector_init(&lv->a, layer->biases.size)) goto INIT_err;
+			dst->bytes += (size_t)(interval ? 1 : 2) * layer->biases.size * sizeof(data_type);
+		}
+		if (layer->rank) {
+			if (vector_init(&lv->inner, layer->rank)) goto INIT_err;
+			dst->bytes += layer->rank * sizeof(data_type);
+		}
+		if (!gradients) continue;
+		Matrix parameters;
+		NN_layer_parameters(layer, &parameters);
+		NN_mem_category(NN_MEM_GRADIENTS);
+		if (matrix_init(&lv->weight_gradient, parameters.rows, parameters.columns) ||
+			vector_init(&lv->bias_gradient, layer->biases.size))
+			goto INIT_err;
+		NN_mem_category(NN_MEM_ACTIVATIONS);
+		memset(lv->weight_gradient.M, 0, (size_t)parameters.rows * parameters.columns * sizeof(data_type));
+		memset(lv->bias_gradient.V, 0, layer->biases.size * sizeof(data_type));
+		dst->bytes += ((size_t)parameters.rows * parameters.columns + layer->biases.size) * sizeof(data_type);
+	}
+	NN_mem_category(category);
+	return 0;
 
-	for (i = 1; i < n; i++) {
-		layer = &NN->hidden_layers[pl];
+INIT_err:
+	NN_mem_category(category);
+	NN_workspace_free(NN, dst);
+LV_ALLOC_err:;
+	char* msg[] = {
+		"Failed to allocate the layer vector array",
+		"Failed to allocate the workspace vectors",
+	};
+	printf(FG_GRAY "[Neural Network] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg[err]);
+	return err + 1;
+}
 
-		if (multiply_mv(&layer->weights, &lv[pl].a, &lv[i].z))
-			printf(FG_GRAY "[Neural Network Learning] " C_RESET FG_RED FG_BRIGHT "Error applying multiplying weight matrix:" C_RESET " layer=%u\n", i);
-		if (add_vv(&lv[i].z, &layer->biases, &lv[i].z))
-			printf(FG_GRAY "[Neural Network Learning] " C_RESET FG_RED FG_BRIGHT "Error adding bias:" C_RESET " layer=%u\n", i);
-		if (apply_activation(&lv[i].z, &lv[i].a))
-			printf(FG_GRAY "[Neural Network Learning] " C_RESET FG_RED FG_BRIGHT "Error applying activation function:" C_RESET " layer=%u\n", i);
 
-		pl = i;
-	}
+struct NN_layer* NeuralNetwork_layer(struct NeuralNetwork* NN, uint32_t l) {
+	return l == NN->num_hidden_layers + 1u ? &NN->output_layer : &NN->hidden_layers[l-1];
+}
 
-	layer = &NN->output_layer;
+// a = NULL only computes z, which is what the softmax output layer needs
+// inner gets V.input of a factored layer and can be NULL for a dense one
+short NN_layer_forward(struct NN_layer* layer, Vector* input, Vector* inner, Vector* z, Vector* a) {
+	if (NN_layer_multiply(layer, input, inner, z))
+		return 1;
+	if (add_vv(z, &layer->biases, z))
+		return 2;
+	if (a && apply_activation(z, a))
+		return 3;
+	return 0;
+}
 
-	if (multiply_mv(&layer->weights, &lv[pl].a, &lv[i].z))
-		puts(FG_GRAY "[Neural Network Learning] " C_RESET FG_RED FG_BRIGHT "Error multiplying weight matrix:" C_RESET " layer=output");
-	if (add_vv(&lv[i].z, &layer->biases, &lv[i].z))
-		puts(FG_GRAY "[Neural Network Learning] " C_RESET FG_RED FG_BRIGHT "Error adding bias:" C_RESET " layer=output");
-	if (apply_activation(&lv[i].z, &lv[i].a))
-		puts(FG_GRAY "[Neural Network Learning] " C_RESET FG_RED FG_BRIGHT "Error applying activation function:" C_RESET " layer=output");
+// output = input.W^T + biases, biases = NULL adds nothing
+static void forward_rows(const data_type* W, uint32_t rows, uint32_t columns, const data_type* biases, Matrix* input, Matrix* output) {
+	uint32_t examples = input->rows;
+	output->rows = examples;
+	output->columns = rows;
+	NN_kernels_current()->gemm(0, 1, examples, rows, columns, input->M, W, 0.0f, output->M);
+	if (biases)
+		for (uint32_t e = 0; e < examples; e++)
+			NN_kernels_current()->axpy(rows, 1.0f, biases, output->M + (size_t)e * rows);
+}
 
+// one example per row of input, output gets one row of activations (or logits) per example
+short NN_layer_forward_batch(struct NN_layer* layer, Matrix* input, Matrix* output, char logits) {
+#ifndef NO_LINEAR_CHECKS
+	if (!layer || !input || !output) return 11;
+	if (input->columns != layer->weights.columns) return 1;
+#endif
+	uint32_t columns = layer->weights.columns;
+	uint32_t rows = layer->weights.rows;
+	if (layer->rank) {
+		Matrix inner;
+		if (matrix_init(&inner, input->rows, layer->rank)) return 2;
+		forward_rows(layer->V.M, layer->rank, columns, NULL, input, &inner);
+		forward_rows(layer->U.M, rows, layer->rank, layer->biases.V, &inner, output);
+		matrix_free(&inner);
+	} else
+		forward_rows(layer->weights.M, rows, columns, layer->biases.V, input, output);
+	if (!logits)
+		NN_kernels_current()->activate((size_t)output->rows * rows, output->M, output->M);
 	return 0;
 }
 
+static short layer_calculate(struct NeuralNetwork* NN, struct layer_vectors* lv, uint32_t i) {
+	uint32_t n = NN->num_hidden_layers + 1;
+	short err = NN_layer_forward(NeuralNetwork_layer(NN, i), &lv[i-1].a, &lv[i].inner, &lv[i].z,
+			i == n && NN->output == NN_OUTPUT_SOFTMAX ? NULL : &lv[i].a);
+	if (lv[i].mask.V)
+		for (uint32_t j = 0; j < lv[i].a.size; j++)
+			lv[i].a.V[j] *= lv[i].mask.V[j];
+	return err;
+}
 
+short NeuralNetwork_calculate(struct NeuralNetwork* NN,	struct layer_vectors* lv) {
+
+	if (!NN || !lv) return 11;
 
+	uint32_t n = NN->num_hidden_layers + 1;
+	short err;
+	char* msg[] = {
+		NULL,
+		"Error multiplying weight matrix:",
+		"Error adding bias:",
+		"Error applying activation function:",
+	};
 
+	// a softmax output is left as logits, NeuralNetwork_output_delta fills in lv[n].a
+	for (uint32_t i = 1; i <= n; i++)
+		if ((err = layer_calculate(NN, lv, i)))
+			printf(FG_GRAY "[Neural Network Learning] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET " layer=%u\n", msg[err], i);
 
-short NeuralNetwork_backpropagation(struct NeuralNetwork* NN, struct layer_vectors* lv, Vector* dCda, Vector* temp_dCda) {
+	return 0;
+}
+
+/*
+ * Loss of one example and its derivative, times scale, into delta.
+ * For an activation output that's the squared error (reported as 2*sum, the
+ * scale NeuralNetwork_train has always used) and the derivative with respect
+ * to the activations. For a softmax output it's the cross-entropy from the
+ * fused kernel and the derivative with respect to the logits, output->a gets
+ * the probabilities.
+ */
+data_type NeuralNetwork_output_delta(struct NeuralNetwork* NN, struct layer_vectors* output, Vector* desired, Vector* delta, data_type scale) {
+	if (NN->output == NN_OUTPUT_SOFTMAX)
+		return softmax_cross_entropy_v(&output->z, desired, &output->a, delta, scale);
+	data_type loss = 0.0f;
+	delta->size = desired->size;
+	for (uint32_t i = 0; i < desired->size; i++) {
+		data_type d = output->a.V[i] - desired->V[i];
+		loss += d*d;
+		delta->V[i] = scale*d;
+	}
+	return 2.0f*loss;
+}
+
+// z = NULL: dCda already is the derivative with respect to z (softmax output)
+// weight_gradient->M = NULL: a frozen layer, only temp_dCda is computed
+void NN_layer_backward(struct NN_layer* current_layer, Vector* z, Vector* prev_activations, Vector* dCda, Vector* temp_dCda, Matrix* weight_gradient, Vector* bias_gradient) {
 
 	data_type dadz, dadz_dCda;
-	uint32_t layer, neuron, weight;
-	struct NN_layer* current_layer = &NN->output_layer;
-	Vector* prev_activations;
-	data_type* dp_temp;
+	uint32_t neuron, weight;
 	// loop variables
-	uint32_t mi;	// matrix index (calculation optimised)
+	size_t mi = 0;	// matrix index (calculation optimised)
+
+	for (neuron = 0; neuron < current_layer->biases.size; neuron++) {
+		dadz = z ? activation_derivative(z->V[neuron]) : 1.0f; // current layer
+		dadz_dCda = dadz*dCda->V[neuron];
+		// no gradient (frozen layer), only pass the derivative on
+		if (!weight_gradient->M) {
+			for (weight = 0; weight < current_layer->weights.columns; weight++)
+				temp_dCda->V[weight] += current_layer->weights.M[mi++]*dadz_dCda;
+			continue;
+		}
+		bias_gradient->V[neuron] += /* the derivative is 1 */dadz_dCda;
+		for (weight = 0; weight < current_layer->weights.columns; weight++) {
+										/* the derivative of z evaluated on the weight
+										 * 			= activation of prev neuron		*/
+			weight_gradient->M[mi] += (prev_activations->V[weight])*dadz_dCda;
+										/* the derivative of z evaluated on the activation
+										 * 			= weight 			*/
+			temp_dCda->V[weight] += current_layer->weights.M[mi]*dadz_dCda;
+			mi++;
+		}
+	}
+	temp_dCda->size = current_layer->weights.columns;
+}
 
+// down to layer lowest, temp_dCda is left holding the derivative with respect to its input
+short NeuralNetwork_backpropagation_to(struct NeuralNetwork* NN, struct layer_vectors* lv, Vector* dCda, Vector* temp_dCda, uint32_t lowest) {
+
+	uint32_t layer = NN->num_hidden_layers+1;
+	data_type* dp_temp;
+	char softmax = NN->output == NN_OUTPUT_SOFTMAX;
+	Matrix no_weights = {0};
+	Vector no_biases = {0};
 
-	layer = NN->num_hidden_layers+1;
+	if (lowest > layer) return 0;
 	while (1) {
-		prev_activations = &lv[layer-1].a; // prev layer
-		mi = 0;
-		for (neuron = 0; neuron < current_layer->biases.size; neuron++) {
-			dadz = activation_derivative(lv[layer].z.V[neuron]); // current layer
-			dadz_dCda = dadz*dCda->V[neuron];
-			lv[layer].bias_gradient.V[neuron] += /* the derivative is 1 */dadz_dCda;
-			for (weight = 0; weight < current_layer->weights.columns; weight++) {
-											/* the derivative of z evaluated on the weight
-											 * 			= activation of prev neuron		*/
-				lv[layer].weight_gradient.M[mi] += (prev_activations->V[weight])*dadz_dCda;
-											/* the derivative of z evaluated on the activation
-											 * 			= weight 			*/
-				temp_dCda->V[weight] += current_layer->weights.M[mi]*dadz_dCda;
-				mi++;
-			}
-		}
-		if (layer > 1) layer--;
+		struct NN_layer* current = NeuralNetwork_layer(NN, layer);
+		Vector* z = softmax && layer == NN->num_hidden_layers+1u ? NULL : &lv[layer].z;
+		Matrix* weight_gradient = current->frozen ? &no_weights : &lv[layer].weight_gradient;
+		Vector* bias_gradient = current->frozen ? &no_biases : &lv[layer].bias_gradient;
+		if (current->rank)
+			NN_layer_backward_lowrank(current, z, &lv[layer-1].a, &lv[layer].inner, dCda, temp_dCda,
+					weight_gradient, bias_gradient);
+		else
+			NN_layer_backward(current, z, &lv[layer-1].a, dCda, temp_dCda,
+					weight_gradient, bias_gradient);
+		if (layer > lowest) layer--;
 		else break;
-		current_layer = &NN->hidden_layers[layer-1];
 		dp_temp = dCda->V;
 		dCda->V = temp_dCda->V;
 		temp_dCda->V = dp_temp;
-		memset(dp_temp, 0, dCda->size * sizeof(data_type));
 		dCda->size = temp_dCda->size;
-		temp_dCda->size = current_layer->biases.size;
+		memset(dp_temp, 0, NeuralNetwork_layer(NN, layer)->weights.columns * sizeof(data_type));
+		// entering a new segment, rebuild its z and a from the checkpoint below
+		if (lv[layer].checkpoint && layer % lv[layer].checkpoint == 0)
+			for (uint32_t l = layer - lv[layer].checkpoint + 1; l <= layer; l++)
+				if (layer_calculate(NN, lv, l)) return 1;
+		// dropped neurons pass nothing back, kept ones their scale
+		if (lv[layer].mask.V)
+			for (uint32_t i = 0; i < dCda->size; i++)
+				dCda->V[i] *= lv[layer].mask.V[i];
 	}
 
 	return 0;
 }
 
+short NeuralNetwork_backpropagation(struct NeuralNetwork* NN, struct layer_vectors* lv, Vector* dCda, Vector* temp_dCda) {
+	// nothing below the lowest trainable layer needs a derivative
+	return NeuralNetwork_backpropagation_to(NN, lv, dCda, temp_dCda, NeuralNetwork_frozen_layers(NN) + 1);
+}
+
 short NeuralNetwork_train(NN_args args) {
 
 	// arg check
-	if (!args.NN || !args.igen || !args.lgen || !args.batch_size) return 11;
+	if (!args.NN || !args.batch_size || !args.gradient) return 11;
+	if (!args.igen && (!args.inputs || args.inputs->columns != args.NN->input_size || args.inputs->rows < args.batch_size)) return 11;
+	if (!args.lgen && (!args.labels || args.labels->columns != args.NN->output_layer.biases.size || args.labels->rows < args.batch_size)) return 11;
+	if (args.soa && args.dropout <= 0.0f && NeuralNetwork_is_narrow(args.NN) && !has_frozen(args.NN))
+		return NeuralNetwork_train_soa(args);
 	// variables
-	uint32_t allocated_layers = 0;
 	uint32_t max_layer_size = get_biggest_layer(args.NN);
 	uint32_t d_memset_size = max_layer_size * sizeof(data_type);
 	uint32_t n = args.NN->num_hidden_layers + 1;
 	int gerr = 0;
 	char gfailed = 1;
 	// vectors
-	struct layer_vectors layer_vectors[args.NN->num_hidden_layers + 2];
-	Vector dCda_T;
-	Vector temp_dCda_T;
-	Vector desired;
+	struct NN_workspace ws;
+	struct layer_vectors* layer_vectors;
+	data_type* own_input;
+	data_type* own_desired;
 	// loop variables
 	int err = 0;
-	char failed = 1;
+	size_t failed_examples = 0;
 	size_t endI = args.batch_start + args.batch_size;
 
 	float backup_loss = 0.0f; // loss variable to store the loss into if not given
 							  // instead of checking for NULL every loop cycle
+	// every example's share of the gradient, applied once through the output delta
+	data_type scale = (data_type)1 / (args.normalize ? args.normalize : args.batch_size);
 
 	// initialisation
-	if (vector_init(&desired, args.NN->output_layer.biases.size))
-		goto DES_VEC_INIT_err;
-	if (vector_init(&dCda_T, max_layer_size))
-		goto dCda_VEC_INIT_err;
-	if (vector_init(&temp_dCda_T, max_layer_size))
-		goto temp_dCda_VEC_INIT_err;
-	memset(temp_dCda_T.V, 0, temp_dCda_T.size * sizeof(data_type));
-	if (vector_init(&layer_vectors[0].a, args.NN->input_size))
-		goto INPUT_VEC_INIT_err;
-	for (allocated_layers = 1; allocated_layers <= n; allocated_layers++) {
-		struct NN_layer* layer = (allocated_layers == n) ? &args.NN->output_layer : &args.NN->hidden_layers[allocated_layers-1];
-		uint32_t size = layer->biases.size;
-		if (vector_init(&layer_vectors[allocated_layers].a, size) ||
-			vector_init(&layer_vectors[allocated_layers].z, size) ||
-			matrix_init(&layer_vectors[allocated_layers].weight_gradient, layer->weights.rows, layer->weights.columns) ||
-			vector_init(&layer_vectors[allocated_layers].bias_gradient, size)) {
-				printf("allocated layers: %u\n", allocated_layers);
-				goto VEC_INIT_err;
-		}
-		memset(layer_vectors[allocated_layers].weight_gradient.M, 0, layer->weights.rows*layer->weights.columns);
-		memset(layer_vectors[allocated_layers].bias_gradient.V, 0, layer->biases.size);
+	if (!args.accumulate && NeuralNetwork_gradient_init(args.NN, args.gradient))
+		goto GRADIENT_INIT_err;
+	if (NN_workspace_init_checkpointed(args.NN, &ws, 0, args.checkpoint_interval))
+		goto WS_INIT_err;
+	layer_vectors = ws.lv;
+	// rows of inputs/labels are used in place, the buffers are put back at the end
+	own_input = layer_vectors[0].a.V;
+	own_desired = ws.desired.V;
+	// backpropagation adds straight into the caller's gradient
+	for (uint32_t l = 1; l <= n; l++) {
+		layer_vectors[l].weight_gradient = args.gradient[l-1].weight_gradient;
+		layer_vectors[l].bias_gradient = args.gradient[l-1].bias_gradient;
 	}
-	allocated_layers--;
+	if (args.dropout > 0.0f)
+		for (uint32_t l = 1; l < n; l++) {
+			if (vector_init(&layer_vectors[l].mask, layer_vectors[l].a.size))
+				goto MASK_INIT_err;
+			ws.bytes += layer_vectors[l].a.size * sizeof(data_type);
+		}
+	if (args.workspace_bytes) *args.workspace_bytes = ws.bytes;
 
 	if (!args.loss) args.loss = &backup_loss;
 	*args.loss = 0.0f;
 	// loop
 	for (size_t example = args.batch_start; example < endI; example++) {
-		if (args.igen(example, &layer_vectors[0].a)) goto INPUT_GEN_err;
+		if (!args.igen)
+			layer_vectors[0].a.V = args.inputs->M + (example - args.batch_start) * args.inputs->columns;
+		else if (args.igen(example, &layer_vectors[0].a)) goto INPUT_GEN_err;
+		// masks depend on the example, not on the batch or the thread it runs on
+		if (args.dropout > 0.0f)
+			for (uint32_t l = 1; l < n; l++)
+				rng_dropout_mask(args.seed, NN_RNG_STREAM(NN_RNG_DROPOUT, l), example, args.dropout, &layer_vectors[l].mask);
 		if (NeuralNetwork_calculate(args.NN, layer_vectors)) goto PRE_CALC_err;
-		if (args.lgen(example, &desired)) goto LABEL_GEN_err;
-		dCda_T.size = desired.size;
-		if (sub_vv(&layer_vectors[n].a, &desired, &dCda_T)) goto COST_VEC_err;
-		for (uint32_t i = 0; i<dCda_T.size; i++)
-			*args.loss += dCda_T.V[i]*dCda_T.V[i]; // added directly; no need for sqrt() the sum; squered length
-		if (scale_v(&dCda_T, (float)1/args.batch_size)) goto SCALE_err;
-		memset(temp_dCda_T.V, 0, d_memset_size);
-		if (NeuralNetwork_backpropagation(args.NN, layer_vectors, &dCda_T, &temp_dCda_T)) goto BACKPROPAGATION_err;
+		if (!args.lgen)
+			ws.desired.V = args.labels->M + (example - args.batch_start) * args.labels->columns;
+		else if (args.lgen(example, &ws.desired)) goto LABEL_GEN_err;
+		*args.loss += NeuralNetwork_output_delta(args.NN, &layer_vectors[n], &ws.desired, &ws.dCda, scale);
+		memset(ws.temp_dCda.V, 0, d_memset_size);
+		if (NeuralNetwork_backpropagation(args.NN, layer_vectors, &ws.dCda, &ws.temp_dCda)) goto BACKPROPAGATION_err;
 
 		continue;
 		BACKPROPAGATION_err: err++;
-		SCALE_err: err++;
-		MOD_err: err++;
-		COST_VEC_err: err++;
 		LABEL_GEN_err: err++;
 		PRE_CALC_err: err++;
 		INPUT_GEN_err: err++;
@@ -295,64 +559,86 @@ short NeuralNetwork_train(NN_args args) {
 			"Failed to generate input",
 			"Failed to precalculate neural network state",
 			"Failed to generate a label",
-			"Failed to calculate the cost vector",
-			"Failed to get vector modulo",
-			"Failed to scale the cost vector",
 			"Backpropagation failed",
 		};
 		printf(FG_GRAY "[Neural Network Learning] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", example, msg[err]);
-		// do something TODO
+		// the example is skipped, a batch where all of them were trained nothing
+		failed_examples++;
 		err = 0;
 	}
+	if (failed_examples == args.batch_size) goto EXAMPLES_err;
 
-	*args.loss /= 1.0f/2.0f * (float)args.batch_size;
-
-	for (uint16_t l = 1; l <= n; l++) {
-		struct layer_vectors* lv = &layer_vectors[l];
-		uint32_t weights = lv->weight_gradient.columns * lv->weight_gradient.rows;
-		for (uint32_t weight = 0; weight < weights; weight++)
-			lv->weight_gradient.M[weight] /= args.batch_size;
-		for (uint32_t neuron = 0; neuron < lv->bias_gradient.size; neuron++)
-			lv->bias_gradient.V[neuron] /= args.batch_size;
-		args.gradient[l-1].weight_gradient = lv->weight_gradient;
-		args.gradient[l-1].bias_gradient = lv->bias_gradient;
-	}
+	*args.loss /= (float)args.batch_size;
 
 	gfailed = 0;
 
-	VEC_INIT_err: gerr++;
-	for (allocated_layers--; 0 < allocated_layers; allocated_layers--) {
-		struct NN_layer* layer = (allocated_layers == n) ? &args.NN->output_layer : &args.NN->hidden_layers[allocated_layers];
-		vector_free(&layer_vectors[allocated_layers].a);
-		vector_free(&layer_vectors[allocated_layers].z);
-//		matrix_free(&layer_vectors[allocated_layers].weight_gradient);
-//		vector_free(&layer_vectors[allocated_layers].bias_gradient);
+	EXAMPLES_err: gerr += gfailed;
+	MASK_INIT_err: gerr += gfailed;
+	layer_vectors[0].a.V = own_input;
+	ws.desired.V = own_desired;
+	for (uint32_t l = 1; l <= n; l++) {
+		layer_vectors[l].weight_gradient.M = NULL;
+		layer_vectors[l].bias_gradient.V = NULL;
 	}
-	vector_free(&layer_vectors[0].a);
-	INPUT_VEC_INIT_err: gerr++;
-	vector_free(&temp_dCda_T);
-	temp_dCda_VEC_INIT_err: gerr++;
-	vector_free(&dCda_T);
-	dCda_VEC_INIT_err: gerr++;
-	vector_free(&desired);
-	DES_VEC_INIT_err: gerr++;
+	NN_workspace_free(args.NN, &ws);
+	WS_INIT_err: gerr++;
+	if (gfailed && !args.accumulate)
+		NeuralNetwork_gradient_free(args.NN, args.gradient);
+	GRADIENT_INIT_err: gerr++;
 	ARG_err: gerr++;
 	
 	char* gmsg[] = {
 		NULL,
 		"Invalid arguments",
-//		"Failed to allocate memory for output array",
-		"Failed to pre-initialise the desired output vector",
-		"Failed to pre-initialise the derivative vector",
-		"Failed to pre-initialise the temporal derivative vector",
-		"Failed to pre-initialise the input vector",
-		"Failed to pre-initialise the pre-calculation vectors",
+		"Failed to allocate the gradient",
+		"Failed to pre-initialise the training workspace",
+		"Failed to allocate the dropout masks",
+		"Every example of the batch failed",
 	};
 	
 	if (gfailed) printf(FG_GRAY "[Neural Network Training] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", gmsg[gerr]);
 	return gfailed ? gerr : 0;
 }
 
+// allocates a zeroed gradient for every layer, freed with NeuralNetwork_gradient_free
+short NeuralNetwork_gradient_init(struct NeuralNetwork* NN, struct layer_gradient* gradient) {
+	if (!NN || !gradient) return 11;
+	enum NN_mem_category category = NN_mem_category(NN_MEM_GRADIENTS);
+	for (uint32_t l = 1; l <= NN->num_hidden_layers + 1u; l++) {
+		struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+		struct layer_gradient* g = &gradient[l-1];
+		Matrix parameters;
+		NN_layer_parameters(layer, &parameters);
+		g->bias_gradient.V = NULL;
+		if (layer->frozen) {
+			g->weight_gradient = (Matrix) {0};
+			g->bias_gradient = (Vector) {0};
+			continue;
+		}
+		if (matrix_init(&g->weight_gradient, parameters.rows, parameters.columns) ||
+			vector_init(&g->bias_gradient, layer->biases.size)) {
+			matrix_free(&g->weight_gradient);
+			while (--l) {
+				matrix_free(&gradient[l-1].weight_gradient);
+				vector_free(&gradient[l-1].bias_gradient);
+			}
+			NN_mem_category(category);
+			return 1;
+		}
+	}
+	NN_mem_category(category);
+	NeuralNetwork_gradient_zero(NN, gradient);
+	return 0;
+}
+
+void NeuralNetwork_gradient_zero(struct NeuralNetwork* NN, struct layer_gradient* gradient) {
+	for (uint32_t i = 0; i <= NN->num_hidden_layers; i++) {
+		if (!gradient[i].weight_gradient.M) continue;
+		memset(gradient[i].weight_gradient.M, 0, (size_t)gradient[i].weight_gradient.rows * gradient[i].weight_gradient.columns * sizeof(data_type));
+		memset(gradient[i].bias_gradient.V, 0, gradient[i].bias_gradient.size * sizeof(data_type));
+	}
+}
+
 short NeuralNetwork_gradient_free(struct NeuralNetwork* NeuralNetwork, struct layer_gradient* gradient) {
 	for (uint32_t i = 0; i <= NeuralNetwork->num_hidden_layers; i++) {
 		matrix_free(&gradient[i].weight_gradient);
@@ -363,14 +649,18 @@ short NeuralNetwork_gradient_free(struct NeuralNetwork* NeuralNetwork, struct la
 
 short NeuralNetwork_apply_gradient(struct NeuralNetwork* NeuralNetwork, struct layer_gradient* gradient, data_type lrate) {
 	struct NN_layer* layer;
+	Matrix parameters;
+	const NN_kernels* kernels = NN_kernels_current();
+	NeuralNetwork_write_begin(NeuralNetwork);
 	for (uint32_t i = 0; i <= NeuralNetwork->num_hidden_layers; i++) {
 		layer = (i == NeuralNetwork->num_hidden_layers) ? &NeuralNetwork->output_layer : &NeuralNetwork->hidden_layers[i];
-		uint32_t weights = gradient[i].weight_gradient.columns * gradient[i].weight_gradient.rows;
-		for (uint32_t weight = 0; weight < weights; weight++)
-			layer->weights.M[weight] -= lrate * gradient[i].weight_gradient.M[weight];
-		for (uint32_t neuron = 0; neuron < gradient[i].bias_gradient.size; neuron++)
-			layer->biases.V[neuron] -= lrate * gradient[i].bias_gradient.V[neuron];
+		if (layer->frozen || !gradient[i].weight_gradient.M) continue;
+		NN_layer_parameters(layer, &parameters);
+		size_t weights = (size_t)gradient[i].weight_gradient.columns * gradient[i].weight_gradient.rows;
+		kernels->axpy(weights, -lrate, gradient[i].weight_gradient.M, parameters.M);
+		kernels->axpy(gradient[i].bias_gradient.size, -lrate, gradient[i].bias_gradient.V, layer->biases.V);
 	}
+	NeuralNetwork_write_end(NeuralNetwork);
 	return 0;
 }
 
@@ -378,101 +668,17 @@ short NeuralNetwork_apply_gradient(struct NeuralNetwork* NeuralNetwork, struct l
 
 
 double NeuralNetwork_test(NN_args args) {
-	size_t endI = args.batch_start + args.batch_size;
-	Vector input, output, desired;
-	char gfailed = 1;
-	int gerr = 0;
-	int err = 0;
-	float highest_value, desired_highest_value;
-	uint32_t highest_answer, desired_highest_answer;
-	size_t correct = 0;
-
-	// loss calculation
-	float backup_loss = 0.0f; // loss variable to store the loss into if not given
-							  // instead of checking for NULL every loop cycle
-	float diff; // for calculating loss without additional vector
-	if (vector_init(&input, args.NN->input_size)) goto INPUT_VECTOR_INIT_err;
-	if (vector_init(&output, args.NN->output_layer.biases.size)) goto OUTPUT_VECTOR_INIT_err;
-	if (vector_init(&desired, args.NN->output_layer.biases.size)) goto DESIRED_VECTOR_INIT_err;
-	if (!args.loss) args.loss = &backup_loss;
-	*args.loss = 0.0f;
-	for (size_t example = args.batch_start; example < endI; example++) {
-		if (args.igen(example, &input)) goto INPUT_GEN_err;
-		if (args.lgen(example, &desired)) goto LABEL_GEN_err;
-		if (NeuralNetwork_feed(args.NN, &input, &output)) goto FEED_err;
-
-		// calculating loss without additional vector
-		for (uint32_t i = 0; i < output.size; i++) {
-			diff = output.V[i] - desired.V[i];
-			*args.loss += diff*diff; // added directly; no need for sqrt() the sum; squered length
-		}
-
-/*
-		highest_value = FLT_MIN;
-		desired_highest_value = FLT_MIN;
-		highest_answer = -1;
-		desired_highest_answer = -1;
-		for (uint32_t i = 0; i < desired.size; i++)
-			if (desired.V[i] > highest_value) {
-				desired_highest_value = output.V[i];
-				desired_highest_answer = i;
-			}
-		for (uint32_t i = 0; i < output.size; i++)
-			if (output.V[i] > highest_value) {
-				highest_value = output.V[i];
-				highest_answer = i;
-			}
-		if (highest_answer != -1 && desired_highest_answer != -1)
-			if (highest_answer == desired_highest_answer)
-				correct++;
-*/
-		switch ((int)desired.V[0]) {
-			case 0:
-				if (output.V[0] < 0.5)
-					correct++;
-				break;
-			case 1:
-				if (output.V[0] > 0.5)
-					correct++;
-				break;
-		}
-
-		continue;
-		FEED_err: err++;
-		LABEL_GEN_err: err++;
-		INPUT_GEN_err: err++;
-		char* msg[] = {
-			NULL,
-			"Failed to generate input",
-			"Failed to precalculate neural network state",
-			"Failed to generate a label",
-			"Failed to calculate the cost vector",
-			"Failed to scale the cost vector",
-			"Backpropagation failed",
-		};
-		printf(FG_GRAY "[Neural Network Testing] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", example, msg[err]);
-		err = 0;
-	}
-
-	*args.loss /= 1.0f/2.0f * (float)args.batch_size;
-
-	gfailed = 0;
-
-	vector_free(&desired);
-	DESIRED_VECTOR_INIT_err: gerr++;
-	vector_free(&output);
-	OUTPUT_VECTOR_INIT_err: gerr++;
-	vector_free(&input);
-	INPUT_VECTOR_INIT_err: gerr++;
-	char* msg[] = {
-		NULL,
-		"Failed to initialise input vector",
-		"Failed to initialise output vector",
-		"Failed to initialise desired vector",
-	};
-	if (gfailed)
-		printf(FG_GRAY "[Neural Network Testing] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg[err]);
-	else
-		return (double) correct / (double) args.batch_size;
-	return -1;
+	NN_eval_result result;
+	// single threaded, the generators passed here never had to be thread safe
+	if (NeuralNetwork_evaluate((NN_eval_args) {
+				.NN = args.NN,
+				.igen = args.igen,
+				.lgen = args.lgen,
+				.start = args.batch_start,
+				.size = args.batch_size,
+				.threads = 1,
+			}, &result))
+		return -1;
+	if (args.loss) *args.loss = result.loss;
+	return result.accuracy;
 }
@@ -0,0 +1,134 @@
+#include <perf-counters.h>
+#include <stdlib.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#define NN_PERF_CACHE(cache, result) ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | (result) << 16)
+
+static char* perf_names[NN_PERF_COUNTERS] = {
+	"cycles", "instructions", "L1d miss", "LLC miss", "dTLB miss", "FP vec ops",
+};
+
+// raw config of the vector FP event, 0 = none known for this cpu
+static uint64_t perf_fp_event(void) {
+	char* env = getenv("NN_PERF_FP_EVENT");
+	if (env) return strtoull(env, NULL, 16);
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	// "GenuineIntel", FP_ARITH_INST_RETIRED.{128B,256B}_PACKED_{SINGLE,DOUBLE}
+	if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) && ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e)
+		return 0x3cc7;
+#endif
+	return 0;
+}
+
+static int perf_open(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// never fails because of counters, a harness without them still has the clock
+short NN_perf_init(struct NN_perf* dst) {
+	if (!dst) return 11;
+	uint64_t fp = perf_fp_event();
+	struct { uint32_t type; uint64_t config; } events[NN_PERF_COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HW_CACHE, NN_PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+		{PERF_TYPE_HW_CACHE, NN_PERF_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+		{PERF_TYPE_HW_CACHE, NN_PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+		{PERF_TYPE_RAW, fp},
+	};
+	dst->available = 0;
+	dst->error = 0;
+	for (uint32_t c = 0; c < NN_PERF_COUNTERS; c++) {
+		dst->fd[c] = c == NN_PERF_FP_VECTOR && !fp ? -1 : perf_open(events[c].type, events[c].config);
+		if (dst->fd[c] >= 0)
+			dst->available |= 1u << c;
+		else if (!dst->error)
+			dst->error = c == NN_PERF_FP_VECTOR && !fp ? ENOENT : errno;
+	}
+	if (!dst->available)
+		printf(FG_GRAY "[Neural Network Perf] " C_RESET FG_YELLOW "Hardware counters unavailable (%s), wall clock only" C_RESET "\n", strerror(dst->error));
+	return 0;
+}
+
+void NN_perf_free(struct NN_perf* perf) {
+	for (uint32_t c = 0; c < NN_PERF_COUNTERS; c++)
+		if (perf->fd[c] >= 0) {
+			close(perf->fd[c]);
+			perf->fd[c] = -1;
+		}
+	perf->available = 0;
+}
+
+// counts scaled up for the time the counter was multiplexed out
+void NN_perf_read(struct NN_perf* perf, NN_perf_sample* dst) {
+	struct timespec now;
+	for (uint32_t c = 0; c < NN_PERF_COUNTERS; c++) {
+		uint64_t v[3];
+		dst->count[c] = 0;
+		if (!(perf->available & 1u << c) || read(perf->fd[c], v, sizeof(v)) != sizeof(v))
+			continue;
+		dst->count[c] = v[2] && v[2] < v[1] ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dst->seconds = now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void NN_perf_begin(struct NN_perf* perf, NN_perf_region* region) {
+	NN_perf_read(perf, &region->begin);
+}
+
+void NN_perf_end(struct NN_perf* perf, NN_perf_region* region, uint64_t calls) {
+	NN_perf_sample end;
+	NN_perf_read(perf, &end);
+	region->calls += calls;
+	region->total.seconds += end.seconds - region->begin.seconds;
+	for (uint32_t c = 0; c < NN_PERF_COUNTERS; c++)
+		region->total.count[c] += end.count[c] - region->begin.count[c];
+}
+
+static void report_value(FILE* out, struct NN_perf* perf, uint32_t mask, double value) {
+	if ((perf->available & mask) == mask)
+		fprintf(out, " %11.4g", value);
+	else
+		fprintf(out, " %11s", "n/a");
+}
+
+/*
+ * One line per region: time and counters per call, IPC, achieved GFLOP/s and
+ * GB/s from the nominal work, arithmetic intensity (flop per nominal byte) and
+ * the bandwidth the LLC misses account for (64 byte lines).
+ */
+void NN_perf_report(struct NN_perf* perf, NN_perf_region* regions, uint32_t count, FILE* out) {
+	if (!out) out = stdout;
+	fprintf(out, "%-18s %11s %11s %11s %11s %11s %11s", "region", "calls", "ns/call", "GFLOP/s", "GB/s", "flop/byte", "IPC");
+	for (uint32_t c = 0; c < NN_PERF_COUNTERS; c++)
+		fprintf(out, " %11.11s", perf_names[c]);
+	fprintf(out, " %11s\n", "LLC GB/s");
+	for (uint32_t r = 0; r < count; r++) {
+		NN_perf_region* region = &regions[r];
+		double calls = region->calls ? region->calls : 1, seconds = region->total.seconds;
+		fprintf(out, "%-18.18s %11lu %11.4g", region->name, (unsigned long)region->calls, seconds / calls * 1e9);
+		fprintf(out, " %11.4g %11.4g", seconds > 0 ? region->flops * calls / seconds / 1e9 : 0.0, seconds > 0 ? region->bytes * calls / seconds / 1e9 : 0.0);
+		fprintf(out, " %11.4g", region->bytes > 0 ? region->flops / region->bytes : 0.0);
+		report_value(out, perf, 1u << NN_PERF_CYCLES | 1u << NN_PERF_INSTRUCTIONS, region->total.count[NN_PERF_CYCLES] ?
+				(double)region->total.count[NN_PERF_INSTRUCTIONS] / region->total.count[NN_PERF_CYCLES] : 0.0);
+		for (uint32_t c = 0; c < NN_PERF_COUNTERS; c++)
+			report_value(out, perf, 1u << c, region->total.count[c] / calls);
+		report_value(out, perf, 1u << NN_PERF_LLC_MISSES, seconds > 0 ? region->total.count[NN_PERF_LLC_MISSES] * 64.0 / seconds / 1e9 : 0.0);
+		fputc('\n', out);
+	}
+}
@@ -0,0 +1,353 @@
+#include <pipeline-training.h>
+#include <low-rank.h>
+
+struct pipeline;
+
+struct pipeline_stage {
+	struct pipeline* pipeline;
+	pthread_t thread;
+	uint16_t id;
+	uint32_t first, last;		// owned layers, numbered like layer_vectors
+	uint32_t in_width, out_width;
+	size_t stride;				// stash floats per example
+	data_type* stash;			// one slot of micro_batch examples per stage
+	char* valid;				// per stash example, its input was generated
+	Vector dCda;
+	Vector temp_dCda;
+	Vector desired;				// last stage only
+	double loss;
+	size_t failed;				// last stage only, examples left out of the gradient
+};
+
+struct pipeline {
+	NN_args* args;
+	uint16_t stages;
+	uint32_t micro_batch;
+	uint32_t micro_batches;
+	uint32_t layers;
+	SPSC_queue* forward;		// forward[s]: stage s -> s+1
+	SPSC_queue* backward;		// backward[s]: stage s+1 -> s
+	struct pipeline_stage* stage;
+	atomic_char abort;
+};
+
+static void* wait_push(struct pipeline* p, SPSC_queue* q) {
+	void* slot;
+	for (uint32_t spins = 0; !(slot = spsc_push_slot(q)); spins++) {
+		if (atomic_load_explicit(&p->abort, memory_order_relaxed)) return NULL;
+		if (spins > 64) sched_yield();
+	}
+	return slot;
+}
+static void* wait_pop(struct pipeline* p, SPSC_queue* q) {
+	void* slot;
+	for (uint32_t spins = 0; !(slot = spsc_pop_slot(q)); spins++) {
+		if (atomic_load_explicit(&p->abort, memory_order_relaxed)) return NULL;
+		if (spins > 64) sched_yield();
+	}
+	return slot;
+}
+
+static uint32_t micro_batch_size(struct pipeline* p, uint32_t mb) {
+	size_t left = p->args->batch_size - (size_t)mb * p->micro_batch;
+	return left < p->micro_batch ? left : p->micro_batch;
+}
+
+static data_type* stash_slot(struct pipeline_stage* st, uint32_t mb) {
+	return st->stash + (size_t)(mb % st->pipeline->stages) * st->pipeline->micro_batch * st->stride;
+}
+
+static char* valid_slot(struct pipeline_stage* st, uint32_t mb) {
+	return st->valid + (size_t)(mb % st->pipeline->stages) * st->pipeline->micro_batch;
+}
+
+// a forward queue element is micro_batch activations, then their valid flags
+static char* queued_valid(struct pipeline* p, data_type* element, uint32_t width) {
+	return (char*)(element + (size_t)p->micro_batch * width);
+}
+
+static short stage_forward(struct pipeline_stage* st, uint32_t mb) {
+	struct pipeline* p = st->pipeline;
+	NN_args* args = p->args;
+	size_t example = args->batch_start + (size_t)mb * p->micro_batch;
+	uint32_t count = micro_batch_size(p, mb);
+	data_type* slot = stash_slot(st, mb);
+	char* valid = valid_slot(st, mb);
+	data_type* in = NULL;
+	data_type* out = NULL;
+	short err;
+	char* msg[] = {
+		NULL,
+		"Error multiplying weight matrix:",
+		"Error adding bias:",
+		"Error applying activation function:",
+	};
+
+	if (st->id && !(in = wait_pop(p, &p->forward[st->id-1]))) return 1;
+	if (st->id + 1 < p->stages && !(out = wait_push(p, &p->forward[st->id]))) return 1;
+
+	if (in) memcpy(valid, queued_valid(p, in, st->in_width), count);
+	for (uint32_t e = 0; e < count; e++) {
+		data_type* x = slot + e * st->stride;
+		Vector input = {.size = st->in_width, .V = x};
+		if (in)
+			memcpy(x, in + (size_t)e * st->in_width, st->in_width * sizeof(data_type));
+		else if (args->igen(example + e, &input)) {
+			valid[e] = 0;
+			printf(FG_GRAY "[Neural Network Pipeline] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate input" C_RESET "\n", example + e);
+			// still run forward on zeros, the last stage leaves it out of the gradient
+			memset(x, 0, st->in_width * sizeof(data_type));
+		} else valid[e] = 1;
+		x += st->in_width;
+		for (uint32_t l = st->first; l <= st->last; l++) {
+			struct NN_layer* layer = NeuralNetwork_layer(args->NN, l);
+			uint32_t width = layer->biases.size;
+			Vector z = {.size = width, .V = x};
+			Vector a = {.size = width, .V = x + width};
+			// the softmax output layer stops at the logits, see NeuralNetwork_output_delta
+			if ((err = NN_layer_forward(layer, &input, NULL, &z, l == p->layers && args->NN->output == NN_OUTPUT_SOFTMAX ? NULL : &a)))
+				printf(FG_GRAY "[Neural Network Pipeline] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET " layer=%u\n", msg[err], l);
+			input = a;
+			x += 2 * width;
+		}
+		if (out)
+			memcpy(out + (size_t)e * st->out_width, input.V, st->out_width * sizeof(data_type));
+	}
+
+	if (out) memcpy(queued_valid(p, out, st->out_width), valid, count);
+
+	if (in) spsc_pop_commit(&p->forward[st->id-1]);
+	if (out) spsc_push_commit(&p->forward[st->id]);
+	return 0;
+}
+
+static short stage_backward(struct pipeline_stage* st, uint32_t mb) {
+	struct pipeline* p = st->pipeline;
+	NN_args* args = p->args;
+	size_t example = args->batch_start + (size_t)mb * p->micro_batch;
+	uint32_t count = micro_batch_size(p, mb);
+	data_type* slot = stash_slot(st, mb);
+	char* valid = valid_slot(st, mb);
+	data_type* in = NULL;
+	data_type* out = NULL;
+	data_type* dp_temp;
+
+	if (st->id + 1 < p->stages && !(in = wait_pop(p, &p->backward[st->id]))) return 1;
+	if (st->id && !(out = wait_push(p, &p->backward[st->id-1]))) return 1;
+
+	for (uint32_t e = 0; e < count; e++) {
+		data_type* x = slot + e * st->stride;
+		// the activations of the last owned layer are the last thing in the example
+		data_type* top = x + st->stride - st->out_width;
+		st->dCda.size = st->out_width;
+		if (in)
+			memcpy(st->dCda.V, in + (size_t)e * st->out_width, st->out_width * sizeof(data_type));
+		else {
+			// like NeuralNetwork_train, an example without input or label adds no loss and no gradient
+			if (!valid[e] || args->lgen(example + e, &st->desired)) {
+				if (valid[e])
+					printf(FG_GRAY "[Neural Network Pipeline] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate a label" C_RESET "\n", example + e);
+				memset(st->dCda.V, 0, st->out_width * sizeof(data_type));
+				st->failed++;
+			} else {
+				struct layer_vectors output = {
+					.a = {.size = st->out_width, .V = top},
+					.z = {.size = st->out_width, .V = top - st->out_width},
+				};
+				st->loss += NeuralNetwork_output_delta(args->NN, &output, &st->desired, &st->dCda, (data_type)1/(args->normalize ? args->normalize : args->batch_size));
+			}
+		}
+
+		// walk the owned layers backwards, z and a of layer l sit right after
+		// the activations of layer l-1
+		data_type* z = top - st->out_width;
+		for (uint32_t l = st->last; l >= st->first; l--) {
+			struct NN_layer* layer = NeuralNetwork_layer(args->NN, l);
+			Vector zv = {.size = layer->biases.size, .V = z};
+			Vector prev = {.size = layer->weights.columns, .V = z - layer->weights.columns};
+			memset(st->temp_dCda.V, 0, layer->weights.columns * sizeof(data_type));
+			NN_layer_backward(layer, l == p->layers && args->NN->output == NN_OUTPUT_SOFTMAX ? NULL : &zv, &prev, &st->dCda, &st->temp_dCda,
+					&args->gradient[l-1].weight_gradient, &args->gradient[l-1].bias_gradient);
+			dp_temp = st->dCda.V;
+			st->dCda.V = st->temp_dCda.V;
+			st->temp_dCda.V = dp_temp;
+			st->dCda.size = st->temp_dCda.size;
+			if (l == st->first) break;
+			z = prev.V - NeuralNetwork_layer(args->NN, l-1)->biases.size;
+		}
+		if (out)
+			memcpy(out + (size_t)e * st->in_width, st->dCda.V, st->in_width * sizeof(data_type));
+	}
+
+	if (in) spsc_pop_commit(&p->backward[st->id]);
+	if (out) spsc_push_commit(&p->backward[st->id-1]);
+	return 0;
+}
+
+static void* pipeline_stage_run(void* arg) {
+	struct pipeline_stage* st = arg;
+	struct pipeline* p = st->pipeline;
+	uint32_t warmup = p->stages - 1 - st->id;
+	uint32_t f = 0, b = 0;
+	if (warmup > p->micro_batches) warmup = p->micro_batches;
+
+	// 1F1B: warm up, steady state, drain
+	for (; f < warmup; f++)
+		if (stage_forward(st, f)) return NULL;
+	while (f < p->micro_batches) {
+		if (stage_forward(st, f++)) return NULL;
+		if (stage_backward(st, b++)) return NULL;
+	}
+	while (b < p->micro_batches)
+		if (stage_backward(st, b++)) return NULL;
+	return NULL;
+}
+
+// contiguous split of the layers, balanced by weight count, at least one layer per stage
+static void pipeline_partition(struct NeuralNetwork* NN, struct pipeline_stage* stage, uint16_t stages) {
+	uint32_t n = NN->num_hidden_layers + 1;
+	double total = 0.0, acc = 0.0;
+	uint16_t s = 0;
+	for (uint32_t l = 1; l <= n; l++)
+		total += (double)NeuralNetwork_layer(NN, l)->weights.rows * NeuralNetwork_layer(NN, l)->weights.columns;
+	stage[0].first = 1;
+	for (uint32_t l = 1; l < n && s + 1 < stages; l++) {
+		acc += (double)NeuralNetwork_layer(NN, l)->weights.rows * NeuralNetwork_layer(NN, l)->weights.columns;
+		if (acc >= total * (s + 1) / stages || n - l == (uint32_t)(stages - 1 - s)) {
+			stage[s].last = l;
+			stage[++s].first = l + 1;
+		}
+	}
+	stage[stages-1].last = n;
+}
+
+short NeuralNetwork_train_pipeline(NN_args args, uint16_t stages, uint32_t micro_batch) {
+	if (!args.NN || !args.igen || !args.lgen || !args.batch_size || !args.gradient) return 11;
+	// the stages build no dropout masks
+	if (args.dropout > 0.0f) return 11;
+	// the stages keep no room for the inner vector of a factored layer
+	if (NeuralNetwork_is_factored(args.NN)) return 11;
+
+	struct NeuralNetwork* NN = args.NN;
+	uint32_t n = NN->num_hidden_layers + 1;
+	uint32_t max_layer_size = get_biggest_layer(NN);
+	struct pipeline p = {.args = &args};
+	struct pipeline_stage* last;
+	uint16_t allocated_queues = 0;
+	uint16_t allocated_stages = 0;
+	uint16_t started = 0;
+	double loss = 0.0;
+	int gerr = 0;
+	char gfailed = 1;
+
+	if (!stages) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		stages = cpus > 0 ? cpus : 1;
+	}
+	if (stages > n) stages = n;
+	if (!micro_batch) micro_batch = (args.batch_size + 4u * stages - 1) / (4u * stages);
+	if (micro_batch > args.batch_size) micro_batch = args.batch_size;
+	p.stages = stages;
+	p.micro_batch = micro_batch;
+	p.micro_batches = (args.batch_size + micro_batch - 1) / micro_batch;
+	p.layers = n;
+	atomic_init(&p.abort, 0);
+
+	// gradients, same contract as NeuralNetwork_train
+	if (!args.accumulate && NeuralNetwork_gradient_init(NN, args.gradient)) goto GRADIENT_INIT_err;
+
+	if (!(p.stage = calloc(stages, sizeof(struct pipeline_stage)))) goto STAGE_ALLOC_err;
+	if (!(p.forward = calloc(stages, sizeof(SPSC_queue)))) goto QUEUE_ALLOC_err;
+	if (!(p.backward = calloc(stages, sizeof(SPSC_queue)))) goto QUEUE_ALLOC_err;
+
+	pipeline_partition(NN, p.stage, stages);
+	// a stage writes its stash first, so it lands on the stage thread's node
+	char local = NN_mem_local(1);
+	for (; allocated_stages < stages; allocated_stages++) {
+		struct pipeline_stage* st = &p.stage[allocated_stages];
+		st->pipeline = &p;
+		st->id = allocated_stages;
+		st->in_width = st->first == 1 ? NN->input_size : NeuralNetwork_layer(NN, st->first - 1)->biases.size;
+		st->out_width = NeuralNetwork_layer(NN, st->last)->biases.size;
+		st->stride = st->in_width;
+		for (uint32_t l = st->first; l <= st->last; l++)
+			st->stride += 2 * NeuralNetwork_layer(NN, l)->biases.size;
+		if (!(st->stash = NN_mem_alloc((size_t)stages * micro_batch * st->stride * sizeof(data_type), __FILE__, __LINE__)) ||
+			!(st->valid = malloc((size_t)stages * micro_batch)) ||
+			vector_init(&st->dCda, max_layer_size) ||
+			vector_init(&st->temp_dCda, max_layer_size) ||
+			(st->id + 1 == stages && vector_init(&st->desired, NN->output_layer.biases.size))) {
+			allocated_stages++;
+			NN_mem_local(local);
+			goto STAGE_INIT_err;
+		}
+	}
+	NN_mem_local(local);
+
+	// a stage runs at most (stages - stage) micro batches ahead of the one it
+	// is draining, so that many elements per queue is enough to never stall 1F1B
+	for (; allocated_queues + 1 < stages; allocated_queues++) {
+		size_t bytes = (size_t)micro_batch * p.stage[allocated_queues].out_width * sizeof(data_type);
+		// the valid flags after the activations, rounded so the next element's stay aligned
+		size_t flagged = (bytes + micro_batch + SPSC_CACHE_LINE - 1) / SPSC_CACHE_LINE * SPSC_CACHE_LINE;
+		if (spsc_init(&p.forward[allocated_queues], stages, flagged)) goto QUEUE_INIT_err;
+		if (spsc_init(&p.backward[allocated_queues], stages, bytes)) {
+			spsc_free(&p.forward[allocated_queues]);
+			goto QUEUE_INIT_err;
+		}
+	}
+
+	for (; started < stages; started++)
+		if (pthread_create(&p.stage[started].thread, NULL, pipeline_stage_run, &p.stage[started])) {
+			atomic_store(&p.abort, 1);
+			break;
+		}
+	for (uint16_t s = 0; s < started; s++)
+		pthread_join(p.stage[s].thread, NULL);
+	if (started < stages) goto THREAD_err;
+
+	last = &p.stage[stages-1];
+	if (last->failed == args.batch_size) goto EXAMPLES_err;
+	loss = last->loss;
+	if (args.loss) *args.loss = loss / (double)args.batch_size;
+
+	gfailed = 0;
+
+	EXAMPLES_err: gerr++;
+	THREAD_err: gerr++;
+	QUEUE_INIT_err: gerr++;
+	for (uint16_t q = 0; q < allocated_queues; q++) {
+		spsc_free(&p.forward[q]);
+		spsc_free(&p.backward[q]);
+	}
+	STAGE_INIT_err: gerr++;
+	for (uint16_t s = 0; s < allocated_stages; s++) {
+		NN_mem_free(p.stage[s].stash);
+		sfree(p.stage[s].valid);
+		vector_free(&p.stage[s].dCda);
+		vector_free(&p.stage[s].temp_dCda);
+		vector_free(&p.stage[s].desired);
+	}
+	QUEUE_ALLOC_err: gerr++;
+	sfree(p.forward);
+	sfree(p.backward);
+	sfree(p.stage);
+	STAGE_ALLOC_err: gerr++;
+	// the gradients only survive a successful run
+	if (gfailed && !args.accumulate)
+		NeuralNetwork_gradient_free(NN, args.gradient);
+	GRADIENT_INIT_err: gerr++;
+
+	char* gmsg[] = {
+		NULL,
+		"Failed to allocate the gradient",
+		"Failed to allocate the stage array",
+		"Failed to allocate the queue arrays",
+		"Failed to initialise a stage",
+		"Failed to initialise a queue",
+		"Failed to start a stage thread",
+		"Every example of the batch failed",
+	};
+	if (gfailed) printf(FG_GRAY "[Neural Network Pipeline] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", gmsg[gerr]);
+	return gfailed ? gerr : 0;
+}
@@ -0,0 +1,333 @@
+#include <preprocess.h>
+
+#define IDX_UBYTE 0x08
+#define PREPROCESS_DEPTH 2
+
+typedef uint8_t u8x4 __attribute__((vector_size(4)));
+typedef data_type datax4 __attribute__((vector_size(4 * sizeof(data_type))));
+
+struct preprocess_worker {
+	struct NN_preprocess* pp;
+	pthread_t thread;
+	uint16_t id;
+	SPSC_queue batches;
+	data_type* pixels;		// converted image, + the zero augmentation pads with
+	data_type* noise;
+};
+
+static short preprocess_err(char* msg, short code) {
+	printf(FG_GRAY "[Neural Network Preprocessing] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg);
+	return code;
+}
+
+
+
+
+short NN_idx_load(char* file, struct NN_idx* dst) {
+	if (!file || !dst) return 11;
+	int err = 0;
+	struct stat st;
+	const uint8_t* bytes;
+	memset(dst, 0, sizeof(struct NN_idx));
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) goto OPEN_err;
+	if (fstat(fd, &st) || st.st_size < 4) goto FORMAT_err;
+	dst->map_size = st.st_size;
+	if ((dst->map = mmap(NULL, dst->map_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		dst->map = NULL;
+		goto MAP_err;
+	}
+	bytes = dst->map;
+	dst->type = bytes[2];
+	dst->dims = bytes[3];
+	if (bytes[0] || bytes[1] || dst->type != IDX_UBYTE || !dst->dims || dst->dims > 4 ||
+		(size_t)st.st_size < 4 + 4u * dst->dims)
+		goto HEADER_err;
+	dst->item_size = 1;
+	for (uint8_t d = 0; d < dst->dims; d++) {
+		uint32_t be;
+		memcpy(&be, bytes + 4 + 4 * d, 4);
+		dst->shape[d] = be32toh(be);
+		if (d) dst->item_size *= dst->shape[d];
+	}
+	dst->count = dst->shape[0];
+	dst->data = bytes + 4 + 4 * dst->dims;
+	if ((size_t)st.st_size - (4 + 4 * dst->dims) < dst->count * dst->item_size) goto HEADER_err;
+	close(fd);
+	return 0;
+
+HEADER_err: err++;
+	munmap(dst->map, dst->map_size);
+	dst->map = NULL;
+MAP_err: err++;
+FORMAT_err: err++;
+	close(fd);
+OPEN_err: err++;
+	char* msg[] = {
+		NULL,
+		"Failed to open",
+		"Not an IDX file:",
+		"Failed to map",
+		"Unsupported or truncated IDX file:",
+	};
+	printf(FG_GRAY "[Neural Network Preprocessing] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET " %s\n", msg[err], file);
+	return err;
+}
+
+void NN_idx_free(struct NN_idx* idx) {
+	if (idx->map) munmap(idx->map, idx->map_size);
+	idx->map = NULL;
+	idx->data = NULL;
+}
+
+void NN_u8_to_data(const uint8_t* restrict src, data_type* restrict dst, size_t count, data_type scale, data_type offset) {
+	datax4 s = {scale, scale, scale, scale};
+	datax4 o = {offset, offset, offset, offset};
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		u8x4 in;
+		memcpy(&in, src + i, sizeof(in));
+		datax4 out = __builtin_convertvector(in, datax4) * s + o;
+		memcpy(dst + i, &out, sizeof(out));
+	}
+	for (; i < count; i++)
+		dst[i] = src[i] * scale + offset;
+}
+
+
+
+
+short NN_augment_init(struct NN_augment* dst, uint32_t height, uint32_t width, NN_augment_config config, uint64_t seed) {
+	if (!dst || !height || !width) return 11;
+	size_t pixels = (size_t)height * width;
+	memset(dst, 0, sizeof(struct NN_augment));
+	dst->height = height;
+	dst->width = width;
+	dst->config = config;
+	dst->seed = seed;
+	if (!config.grids) return 0;
+	if (!(dst->index = malloc(config.grids * pixels * 4 * sizeof(uint32_t))) ||
+		!(dst->weight = malloc(config.grids * pixels * 4 * sizeof(data_type)))) {
+		NN_augment_free(dst);
+		return preprocess_err("Failed to allocate the sampling grids", 1);
+	}
+
+	float cy = (height - 1) / 2.0f, cx = (width - 1) / 2.0f;
+	for (uint32_t g = 0; g < config.grids; g++) {
+		// uniforms in (0, 1) -> (-1, 1)
+		data_type u[4];
+		rng_fill_uniform(seed, NN_RNG_STREAM(NN_RNG_AUGMENT, 0), 4 * (uint64_t)g, u, 4);
+		float angle = (2 * u[0] - 1) * config.rotation * (float)M_PI / 180.0f;
+		float zoom = 1 + (2 * u[1] - 1) * config.zoom;
+		float tx = (2 * u[2] - 1) * config.shift, ty = (2 * u[3] - 1) * config.shift;
+		float c = cosf(angle) / zoom, s = sinf(angle) / zoom;
+		uint32_t* index = dst->index + g * pixels * 4;
+		data_type* weight = dst->weight + g * pixels * 4;
+		// inverse map: output pixel -> where it is sampled in the source
+		for (uint32_t y = 0; y < height; y++)
+			for (uint32_t x = 0; x < width; x++, index += 4, weight += 4) {
+				float dx = x - cx - tx, dy = y - cy - ty;
+				float sx = c * dx + s * dy + cx, sy = -s * dx + c * dy + cy;
+				float fx = floorf(sx), fy = floorf(sy);
+				float wx = sx - fx, wy = sy - fy;
+				int64_t x0 = fx, y0 = fy;
+				float w[4] = {(1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy};
+				for (int k = 0; k < 4; k++) {
+					int64_t px = x0 + (k & 1), py = y0 + (k >> 1);
+					char inside = px >= 0 && px < width && py >= 0 && py < height;
+					index[k] = inside ? (uint32_t)(py * width + px) : pixels;
+					weight[k] = w[k];
+				}
+			}
+	}
+	return 0;
+}
+
+void NN_augment_free(struct NN_augment* augment) {
+	sfree(augment->index);
+	sfree(augment->weight);
+}
+
+void NN_augment_apply(struct NN_augment* augment, data_type* src, data_type* dst, uint64_t sample) {
+	size_t pixels = (size_t)augment->height * augment->width;
+	data_type pick;
+	rng_fill_uniform(augment->seed, NN_RNG_STREAM(NN_RNG_AUGMENT, 1), sample, &pick, 1);
+	uint32_t g = pick * augment->config.grids;
+	if (g >= augment->config.grids) g = augment->config.grids - 1;
+	uint32_t* index = augment->index + g * pixels * 4;
+	data_type* weight = augment->weight + g * pixels * 4;
+	for (size_t p = 0; p < pixels; p++, index += 4, weight += 4)
+		dst[p] = weight[0] * src[index[0]] + weight[1] * src[index[1]] +
+				 weight[2] * src[index[2]] + weight[3] * src[index[3]];
+}
+
+
+
+
+static void build_batch(struct preprocess_worker* w, NN_batch* batch, uint64_t number) {
+	struct NN_preprocess* pp = w->pp;
+	NN_preprocess_config* config = &pp->config;
+	size_t pixels = config->images->item_size;
+	size_t label_size = config->labels->item_size;
+	uint32_t classes = config->classes;
+	char augment = config->augment.grids != 0;
+
+	batch->first = number * config->batch_size;
+	batch->count = config->batch_size;
+	for (uint32_t row = 0; row < batch->count; row++) {
+		uint64_t sample = batch->first + row;
+		size_t example = config->start + sample % config->size;
+		data_type* input = batch->inputs.M + (size_t)row * pixels;
+		data_type* label = batch->labels.M + (size_t)row * batch->labels.columns;
+		const uint8_t* image = config->images->data + example * pixels;
+
+		if (augment) {
+			NN_u8_to_data(image, w->pixels, pixels, config->scale, config->offset);
+			NN_augment_apply(&pp->augment, w->pixels, input, sample);
+		} else NN_u8_to_data(image, input, pixels, config->scale, config->offset);
+		if (config->augment.noise > 0.0f) {
+			rng_fill_normal(config->seed, NN_RNG_STREAM(NN_RNG_NOISE, 0), sample * pixels, w->noise, pixels, 0.0f, config->augment.noise);
+			size_t i = 0;
+			for (; i + 4 <= pixels; i += 4) {
+				datax4 a, n;
+				memcpy(&a, input + i, sizeof(a));
+				memcpy(&n, w->noise + i, sizeof(n));
+				a += n;
+				memcpy(input + i, &a, sizeof(a));
+			}
+			for (; i < pixels; i++)
+				input[i] += w->noise[i];
+		}
+
+		const uint8_t* raw = config->labels->data + example * label_size;
+		if (classes) {
+			memset(label, 0, classes * sizeof(data_type));
+			if (*raw < classes) label[*raw] = 1.0f;
+		} else NN_u8_to_data(raw, label, label_size, 1.0f, 0.0f);
+	}
+}
+
+static void* preprocess_worker_run(void* arg) {
+	struct preprocess_worker* w = arg;
+	struct NN_preprocess* pp = w->pp;
+	struct timespec nap = {0, 100000};
+	NN_batch* batch;
+
+	for (uint64_t number = w->id; ; number += pp->config.workers) {
+		while (!(batch = spsc_push_slot(&w->batches))) {
+			if (atomic_load_explicit(&pp->stop, memory_order_relaxed)) return NULL;
+			nanosleep(&nap, NULL);
+		}
+		if (atomic_load_explicit(&pp->stop, memory_order_relaxed)) return NULL;
+		build_batch(w, batch, number);
+		spsc_push_commit(&w->batches);
+	}
+	return NULL;
+}
+
+// a slot is the batch header followed by its inputs and labels
+static size_t batch_header_size(void) {
+	return (sizeof(NN_batch) + SPSC_CACHE_LINE - 1) / SPSC_CACHE_LINE * SPSC_CACHE_LINE;
+}
+
+short NN_preprocess_init(struct NN_preprocess* dst, NN_preprocess_config config) {
+	if (!dst || !config.images || !config.labels || !config.batch_size) return 11;
+	int err = 0;
+	uint16_t allocated = 0;
+	memset(dst, 0, sizeof(struct NN_preprocess));
+	atomic_init(&dst->stop, 0);
+
+	if (config.images->count != config.labels->count || config.start >= config.images->count) goto CONFIG_err;
+	if (!config.size || config.start + config.size > config.images->count)
+		config.size = config.images->count - config.start;
+	if (config.scale == 0.0f) config.scale = 1.0f / 255.0f;
+	if (!config.depth) config.depth = PREPROCESS_DEPTH;
+	if (!config.workers) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		config.workers = cpus > 0 ? cpus : 1;
+	}
+	if (config.augment.grids && config.images->dims != 3) goto CONFIG_err;
+	dst->config = config;
+
+	size_t pixels = config.images->item_size;
+	uint32_t label_width = config.classes ? config.classes : config.labels->item_size;
+	size_t slot = batch_header_size() + (size_t)config.batch_size * (pixels + label_width) * sizeof(data_type);
+	// every header starts on a cache line, like the first one
+	slot = (slot + SPSC_CACHE_LINE - 1) / SPSC_CACHE_LINE * SPSC_CACHE_LINE;
+
+	if (config.augment.grids &&
+		NN_augment_init(&dst->augment, config.images->shape[1], config.images->shape[2], config.augment, config.seed))
+		goto AUGMENT_err;
+	if (!(dst->worker = calloc(config.workers, sizeof(struct preprocess_worker)))) goto WORKER_ALLOC_err;
+	for (; allocated < config.workers; allocated++) {
+		struct preprocess_worker* w = &dst->worker[allocated];
+		w->pp = dst;
+		w->id = allocated;
+		if (!(w->pixels = calloc(pixels + 1, sizeof(data_type))) ||
+			!(w->noise = malloc(pixels * sizeof(data_type))) ||
+			spsc_init(&w->batches, config.depth, slot)) {
+			allocated++;
+			goto WORKER_INIT_err;
+		}
+		// the matrices point into their own slot, set them once
+		for (size_t s = 0; s <= w->batches.mask; s++) {
+			NN_batch* batch = (NN_batch*)(w->batches.slots + s * slot);
+			data_type* data = (data_type*)((char*)batch + batch_header_size());
+			batch->inputs = (Matrix) {.rows = config.batch_size, .columns = pixels, .M = data};
+			batch->labels = (Matrix) {.rows = config.batch_size, .columns = label_width, .M = data + (size_t)config.batch_size * pixels};
+		}
+	}
+	for (; dst->started < config.workers; dst->started++)
+		if (pthread_create(&dst->worker[dst->started].thread, NULL, preprocess_worker_run, &dst->worker[dst->started]))
+			goto THREAD_err;
+	return 0;
+
+THREAD_err: err++;
+	atomic_store(&dst->stop, 1);
+	while (dst->started--)
+		pthread_join(dst->worker[dst->started].thread, NULL);
+WORKER_INIT_err: err++;
+	while (allocated--) {
+		sfree(dst->worker[allocated].pixels);
+		sfree(dst->worker[allocated].noise);
+		spsc_free(&dst->worker[allocated].batches);
+	}
+	sfree(dst->worker);
+WORKER_ALLOC_err: err++;
+	NN_augment_free(&dst->augment);
+AUGMENT_err: err++;
+CONFIG_err: err++;
+	char* msg[] = {
+		NULL,
+		"Images and labels don't match the configuration",
+		"Failed to set up augmentation",
+		"Failed to allocate the worker array",
+		"Failed to initialise a worker",
+		"Failed to start a worker thread",
+	};
+	return preprocess_err(msg[err], err);
+}
+
+// the batch stays valid until NN_preprocess_release
+NN_batch* NN_preprocess_next(struct NN_preprocess* pp) {
+	return spsc_pop_slot_wait(&pp->worker[pp->next % pp->config.workers].batches);
+}
+
+void NN_preprocess_release(struct NN_preprocess* pp) {
+	spsc_pop_commit(&pp->worker[pp->next % pp->config.workers].batches);
+	pp->next++;
+}
+
+void NN_preprocess_free(struct NN_preprocess* pp) {
+	atomic_store(&pp->stop, 1);
+	for (uint16_t w = 0; w < pp->started; w++)
+		pthread_join(pp->worker[w].thread, NULL);
+	for (uint16_t w = 0; w < pp->config.workers; w++) {
+		sfree(pp->worker[w].pixels);
+		sfree(pp->worker[w].noise);
+		spsc_free(&pp->worker[w].batches);
+	}
+	sfree(pp->worker);
+	NN_augment_free(&pp->augment);
+}
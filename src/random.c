@@ -0,0 +1,142 @@
+#include <random.h>
+#include <time.h>
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+// blocks handled per step of the normal generator, the lane loops over them vectorise
+#define RNG_BLOCKS 4
+
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+	for (int round = 0; round < PHILOX_ROUNDS; round++) {
+		uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+		uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+uint64_t rng_time_seed(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static inline void philox_block(uint64_t seed, uint64_t stream, uint64_t block, uint32_t out[4]) {
+	uint32_t counter[4] = {(uint32_t)block, (uint32_t)(block >> 32), (uint32_t)stream, (uint32_t)(stream >> 32)};
+	uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+	philox4x32(counter, key, out);
+}
+
+// 24 random bits into (0, 1), never 0 so log() is always finite
+static inline float to_uniform(uint32_t x) {
+	return (float)(x >> 8) * 0x1p-24f + 0x1p-25f;
+}
+
+void rng_fill_uniform(uint64_t seed, uint64_t stream, uint64_t offset, data_type* dst, size_t count) {
+	uint32_t out[4];
+	size_t i = 0;
+	while (i < count) {
+		uint64_t index = offset + i;
+		philox_block(seed, stream, index >> 2, out);
+		for (uint32_t lane = index & 3; lane < 4 && i < count; lane++, i++)
+			dst[i] = to_uniform(out[lane]);
+	}
+}
+
+// normals of blocks [first, first + RNG_BLOCKS) in sequence order
+static void normal_blocks(uint64_t seed, uint64_t stream, uint64_t first, float normals[4 * RNG_BLOCKS]) {
+	float u1[2 * RNG_BLOCKS], u2[2 * RNG_BLOCKS], r[2 * RNG_BLOCKS], theta[2 * RNG_BLOCKS];
+	uint32_t out[4];
+	for (int b = 0; b < RNG_BLOCKS; b++) {
+		philox_block(seed, stream, first + b, out);
+		u1[2*b] = to_uniform(out[0]); u2[2*b] = to_uniform(out[1]);
+		u1[2*b+1] = to_uniform(out[2]); u2[2*b+1] = to_uniform(out[3]);
+	}
+	for (int j = 0; j < 2 * RNG_BLOCKS; j++) {
+		r[j] = sqrtf(-2.0f * logf(u1[j]));
+		theta[j] = 2.0f * (float)M_PI * u2[j];
+	}
+	for (int j = 0; j < 2 * RNG_BLOCKS; j++) {
+		normals[2*j] = r[j] * cosf(theta[j]);
+		normals[2*j+1] = r[j] * sinf(theta[j]);
+	}
+}
+
+void rng_fill_normal(uint64_t seed, uint64_t stream, uint64_t offset, data_type* dst, size_t count, data_type mean, data_type stddev) {
+	float normals[4 * RNG_BLOCKS];
+	size_t i = 0;
+	while (i < count) {
+		uint64_t index = offset + i;
+		uint64_t first = index >> 2;
+		normal_blocks(seed, stream, first, normals);
+		for (uint32_t k = index - (first << 2); k < 4 * RNG_BLOCKS && i < count; k++, i++)
+			dst[i] = mean + stddev * normals[k];
+	}
+}
+
+struct fill_job {
+	uint64_t seed, stream, offset;
+	data_type* dst;
+	size_t count;
+	data_type mean, stddev;
+};
+
+static void* fill_worker(void* arg) {
+	struct fill_job* job = arg;
+	rng_fill_normal(job->seed, job->stream, job->offset, job->dst, job->count, job->mean, job->stddev);
+	return NULL;
+}
+
+short rng_fill_normal_parallel(uint64_t seed, uint64_t stream, data_type* dst, size_t count, data_type mean, data_type stddev, uint16_t threads) {
+	if (!dst) return 11;
+	if (threads <= 1 || count < NN_RNG_PARALLEL_MIN) {
+		rng_fill_normal(seed, stream, 0, dst, count, mean, stddev);
+		return 0;
+	}
+	pthread_t* thread = malloc(threads * sizeof(pthread_t));
+	struct fill_job* jobs = malloc(threads * sizeof(struct fill_job));
+	if (!thread || !jobs) {
+		free(thread);
+		free(jobs);
+		rng_fill_normal(seed, stream, 0, dst, count, mean, stddev);
+		return 0;
+	}
+	// chunks start on a generator step so no block is computed twice
+	size_t step = 4 * RNG_BLOCKS;
+	size_t chunk = (count / threads + step - 1) / step * step;
+	uint16_t used = 0;
+	for (; used < threads && used * chunk < count; used++) {
+		size_t start = used * chunk;
+		jobs[used] = (struct fill_job) {seed, stream, start, dst + start, count - start < chunk ? count - start : chunk, mean, stddev};
+	}
+	// a chunk whose thread can't be started is done here, count = 0 marks it
+	for (uint16_t t = 1; t < used; t++)
+		if (pthread_create(&thread[t], NULL, fill_worker, &jobs[t])) {
+			fill_worker(&jobs[t]);
+			jobs[t].count = 0;
+		}
+	fill_worker(&jobs[0]);
+	for (uint16_t t = 1; t < used; t++)
+		if (jobs[t].count) pthread_join(thread[t], NULL);
+	free(thread);
+	free(jobs);
+	return 0;
+}
+
+void rng_dropout_mask(uint64_t seed, uint64_t stream, uint64_t index, float rate, Vector* mask) {
+	data_type keep = 1.0f - rate, scale = 1.0f / keep;
+	rng_fill_uniform(seed, stream, index * mask->size, mask->V, mask->size);
+	for (uint32_t i = 0; i < mask->size; i++)
+		mask->V[i] = mask->V[i] < keep ? scale : 0.0f;
+}
@@ -3,6 +3,9 @@
 #include <sys/stat.h>
 //#define NO_LINEAR_CHECKS
 #include <neural-network.h>
+#include <trainer.h>
+#include <benchmark.h>
+#include <autotune.h>
 #include <errno.h>
 #include <signal.h>
 
@@ -84,16 +87,38 @@ void generate_circular_data(float** input, float* output, size_t size) {
 
 FILE* graph;
 FILE* gnuplot;
+struct NN_trainer trainer;
+
+void interrupt(int signal) {
+	(void)signal;
+	NN_trainer_stop(&trainer);
+}
 
 int main(int argc, char** argv) {
 
-	struct layer_gradient gradient[3];
-	float train_loss;
-	float test_loss;
 	int err = 0;
 	char failed = 1;
+	char visualise = 0;
+	char async = 0;
+	char bench = 0;
+	char backends = 0;
+	char tune = 0;
+
+	for (int a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "-v")) visualise = 1;
+		else if (!strcmp(argv[a], "-a")) async = 1;
+		else if (!strcmp(argv[a], "-b")) bench = 1;
+		else if (!strcmp(argv[a], "-B")) bench = backends = 1;
+		else if (!strcmp(argv[a], "-t")) tune = 1;
+	}
+	// kernel and training phase timings with hardware counters where available,
+	// -B once per kernel backend
+	if (bench)
+		return NN_benchmark((NN_bench_config) {.seed = 1, .backends = backends}) ? 1 : 0;
 
 	new();
+	// kernel blocking for the network's shapes, measured once per CPU model and cached
+	if (tune) NN_autotune(&network, (NN_autotune_config) {0});
 	train_input = calloc(TRAIN_DATASET_SIZE, sizeof(float*));
 	for (size_t i = 0; i < TRAIN_DATASET_SIZE; i++)
 		train_input[i] = calloc(2, sizeof(float));
@@ -109,7 +134,7 @@ int main(int argc, char** argv) {
 	if (!(gnuplot = popen("gnuplot -persist", "w")))
 		goto gnuplot_err;
 
-	if (argc > 1 && !strcmp(argv[1], "-v")) {
+	if (visualise) {
 		fprintf(gnuplot, "set terminal qt 2\n");
 		fprintf(gnuplot, "set title 'Training set'\n");
 		fprintf(gnuplot, "unset key\n");
@@ -135,56 +160,36 @@ int main(int argc, char** argv) {
 	fflush(gnuplot);
 
 	sleep(1);
-	time_t last_replot = time(NULL);
-	time_t current_time = time(NULL);
-	short n_batches = TRAIN_DATASET_SIZE / BATCH_SIZE;
-	short batch;
-	uint32_t batch_start;
-	char plotted = 0;
-	float learning_rate = 0.01f;
-	for (int i = 0; ; i++) {
-//		generate_circular_data(train_input, train_output, TRAIN_DATASET_SIZE);
-//		generate_circular_data(test_input, test_output, TEST_DATASET_SIZE);
-		batch = i % n_batches;
-		batch_start = batch * BATCH_SIZE;
-		if (NeuralNetwork_train((NN_args) {
-					.NN = &network,
-					.igen = trainDataGen,
-					.lgen = trainLabelGen,
-					.batch_start = batch_start,
-					.batch_size = BATCH_SIZE,
-					.gradient = gradient,
-					.loss = &train_loss
-				}))
-			continue;
-		NeuralNetwork_apply_gradient(&network, gradient, learning_rate);
-//		generate_circular_data();
-		NeuralNetwork_test((NN_args) {
+	// NN_trainer_init reports its own failures
+	if (!NN_trainer_init(&trainer, (NN_trainer_config) {
 				.NN = &network,
-				.igen = &testDataGen,
-				.lgen = &testLabelGen,
-				.batch_start = 0,
-				.batch_size = TEST_DATASET_SIZE,
-				.loss = &test_loss
-			});
-		fprintf(graph, "%d\t%lf\t%lf\n", i, train_loss, test_loss);
-		fflush(graph);
-		current_time = time(NULL);
-		if (i % 1000 == 0) {
-			learning_rate -= 0.000001f;
-			if (learning_rate < 0.000001f)
-				learning_rate = 0.000001f;
-		}
-		if (current_time - last_replot > 1) {
-			if (plotted)
-				fwrite("replot\n", 1, 7, gnuplot);
-			else
-				fprintf(gnuplot, "plot 'graph' u 1:2 w l t 'Training loss',"
-									  "'graph' u 1:3 w l t 'Test loss'\n");
-			plotted = 1;
-			fflush(gnuplot);
-			last_replot = time(NULL);
-		}
+				.igen = trainDataGen,
+				.lgen = trainLabelGen,
+				.train_size = TRAIN_DATASET_SIZE,
+				.batch_size = BATCH_SIZE,
+				.test_igen = testDataGen,
+				.test_lgen = testLabelGen,
+				.test_size = TEST_DATASET_SIZE,
+				.eval_interval = 1,
+				// one hogwild epoch per step, updates are applied as they are computed
+				.async = async,
+				// the 2-4-2-1 net fits the structure of arrays path
+				.soa = 1,
+				.schedule = NN_LR_LINEAR,
+				.lrate = 0.01f,
+				.min_lrate = 0.000001f,
+				.lr_step = 1000,
+				.lr_gamma = 0.000001f,
+				.log = graph,
+				.plot = gnuplot,
+				.log_name = "graph",
+				.plot_interval = 1,
+			})) {
+		signal(SIGINT, interrupt);
+		// a gnuplot that died (or never started) shouldn't take training with it
+		signal(SIGPIPE, SIG_IGN);
+		NN_trainer_run(&trainer);
+		NN_trainer_free(&trainer);
 	}
 
 	NeuralNetwork_free(&network);
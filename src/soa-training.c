@@ -0,0 +1,292 @@
+#include <soa-training.h>
+#include <low-rank.h>
+
+char NeuralNetwork_is_narrow(struct NeuralNetwork* NN) {
+	if (NN->input_size > NN_SOA_MAX_WIDTH || NeuralNetwork_is_factored(NN)) return 0;
+	for (uint32_t l = 1; l <= NN->num_hidden_layers + 1u; l++)
+		if (NeuralNetwork_layer(NN, l)->biases.size > NN_SOA_MAX_WIDTH)
+			return 0;
+	return 1;
+}
+
+struct soa_workspace {
+	NN_lanes* a;			// per layer [neurons][NN_SOA_VECTORS], a[0] is the input block
+	NN_lanes* z;
+	NN_lanes* desired;
+	NN_lanes* delta;		// widest layer x NN_SOA_VECTORS
+	NN_lanes* temp_delta;
+	NN_lanes* valid;		// 1 for lanes holding an example, 0 for padding and failed generators
+	NN_lanes* acc;			// per lane sums of every weight and bias gradient
+	size_t* activations;	// offset of layer l in a and z
+	size_t* gradients;		// offset of layer l in acc, biases after the weights
+	size_t bytes;
+};
+
+static data_type* soa_slot(NN_lanes* row, uint32_t k) {
+	return (data_type*)row + k;
+}
+
+static void soa_forward(struct NeuralNetwork* NN, struct soa_workspace* ws, uint32_t l) {
+	struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+	uint32_t rows = layer->weights.rows, columns = layer->weights.columns;
+	NN_lanes* A = ws->a + ws->activations[l-1];
+	NN_lanes* Z = ws->z + ws->activations[l];
+	NN_lanes* out = ws->a + ws->activations[l];
+	const data_type* w = layer->weights.M;
+	for (uint32_t r = 0; r < rows; r++) {
+		NN_lanes acc[NN_SOA_VECTORS] = {};
+		for (uint32_t c = 0; c < columns; c++, w++)
+			for (uint32_t v = 0; v < NN_SOA_VECTORS; v++)
+				acc[v] += *w * A[c * NN_SOA_VECTORS + v];
+		for (uint32_t v = 0; v < NN_SOA_VECTORS; v++)
+			Z[r * NN_SOA_VECTORS + v] = acc[v] + layer->biases.V[r];
+	}
+	if (l == NN->num_hidden_layers + 1u && NN->output == NN_OUTPUT_SOFTMAX)
+		return;
+	for (uint32_t i = 0; i < rows * NN_SOA_VECTORS; i++)
+		out[i] = activation_lanes(Z[i]);
+}
+
+// loss summed over the block's valid lanes, delta like NeuralNetwork_output_delta
+static data_type soa_output_delta(struct NeuralNetwork* NN, struct soa_workspace* ws, data_type scale) {
+	uint32_t n = NN->num_hidden_layers + 1, outputs = NN->output_layer.biases.size;
+	NN_lanes* A = ws->a + ws->activations[n];
+	NN_lanes* Z = ws->z + ws->activations[n];
+	NN_lanes* Y = ws->desired;
+	NN_lanes* D = ws->delta;
+	NN_lanes loss = {};
+	for (uint32_t v = 0; v < NN_SOA_VECTORS; v++) {
+		NN_lanes valid = ws->valid[v];
+		if (NN->output == NN_OUTPUT_SOFTMAX) {
+			// the fused kernel of activation-function.c, one example per lane
+			NN_lanes max = Z[v], sum = {}, dot = {}, mass = {};
+			for (uint32_t r = 1; r < outputs; r++)
+				max = NN_lanes_max(max, Z[r * NN_SOA_VECTORS + v]);
+			for (uint32_t r = 0; r < outputs; r++) {
+				NN_lanes x = Z[r * NN_SOA_VECTORS + v], y = Y[r * NN_SOA_VECTORS + v], p;
+				dot += y * (max - x);
+				mass += y;
+				for (uint32_t k = 0; k < NN_LANES; k++)
+					p[k] = exp(x[k] - max[k]);
+				sum += A[r * NN_SOA_VECTORS + v] = p;
+			}
+			NN_lanes inv = 1.0f / sum, log_sum;
+			for (uint32_t k = 0; k < NN_LANES; k++)
+				log_sum[k] = log(sum[k]);
+			for (uint32_t r = 0; r < outputs; r++) {
+				NN_lanes* p = &A[r * NN_SOA_VECTORS + v];
+				*p *= inv;
+				D[r * NN_SOA_VECTORS + v] = scale * (*p - Y[r * NN_SOA_VECTORS + v]) * valid;
+			}
+			loss += (dot + mass * log_sum) * valid;
+		} else {
+			NN_lanes squares = {};
+			for (uint32_t r = 0; r < outputs; r++) {
+				NN_lanes d = (A[r * NN_SOA_VECTORS + v] - Y[r * NN_SOA_VECTORS + v]) * valid;
+				squares += d*d;
+				D[r * NN_SOA_VECTORS + v] = scale*d;
+			}
+			loss += 2.0f * squares;
+		}
+	}
+	return NN_lanes_sum(loss);
+}
+
+// adds layer l's gradient to the accumulators, temp_delta gets the derivative for layer l-1
+static void soa_backward(struct NeuralNetwork* NN, struct soa_workspace* ws, uint32_t l) {
+	struct NN_layer* layer = NeuralNetwork_layer(NN, l);
+	uint32_t rows = layer->weights.rows, columns = layer->weights.columns;
+	NN_lanes* A = ws->a + ws->activations[l-1];
+	NN_lanes* Z = ws->z + ws->activations[l];
+	NN_lanes* D = ws->delta;
+	NN_lanes* T = ws->temp_delta;
+	NN_lanes* WG = ws->acc + ws->gradients[l];
+	NN_lanes* BG = WG + (size_t)rows * columns;
+	const data_type* w = layer->weights.M;
+
+	if (l != NN->num_hidden_layers + 1u || NN->output != NN_OUTPUT_SOFTMAX)
+		for (uint32_t i = 0; i < rows * NN_SOA_VECTORS; i++)
+			D[i] = activation_derivative_lanes(Z[i]) * D[i];
+	if (l > 1)
+		memset(T, 0, (size_t)columns * NN_SOA_VECTORS * sizeof(NN_lanes));
+	for (uint32_t r = 0; r < rows; r++) {
+		NN_lanes* d = D + r * NN_SOA_VECTORS;
+		for (uint32_t v = 0; v < NN_SOA_VECTORS; v++)
+			BG[r] += d[v];
+		for (uint32_t c = 0; c < columns; c++, w++, WG++) {
+			NN_lanes* a = A + c * NN_SOA_VECTORS;
+			for (uint32_t v = 0; v < NN_SOA_VECTORS; v++)
+				*WG += a[v] * d[v];
+			if (l > 1)
+				for (uint32_t v = 0; v < NN_SOA_VECTORS; v++)
+					T[c * NN_SOA_VECTORS + v] += *w * d[v];
+		}
+	}
+}
+
+static short soa_workspace_init(struct NeuralNetwork* NN, struct soa_workspace* dst) {
+	uint32_t n = NN->num_hidden_layers + 1, biggest = NN->input_size;
+	size_t activations = 0, gradients = 0;
+	memset(dst, 0, sizeof(struct soa_workspace));
+	dst->activations = malloc((n + 1) * sizeof(size_t));
+	dst->gradients = malloc((n + 1) * sizeof(size_t));
+	if (!dst->activations || !dst->gradients)
+		goto ALLOC_err;
+	for (uint32_t l = 0; l <= n; l++) {
+		uint32_t size = l ? NeuralNetwork_layer(NN, l)->biases.size : NN->input_size;
+		dst->activations[l] = activations;
+		activations += (size_t)size * NN_SOA_VECTORS;
+		if (size > biggest) biggest = size;
+		if (!l) continue;
+		dst->gradients[l] = gradients;
+		gradients += (size_t)size * NeuralNetwork_layer(NN, l)->weights.columns + size;
+	}
+	size_t outputs = (size_t)NN->output_layer.biases.size * NN_SOA_VECTORS;
+	size_t vectors = 2 * activations + outputs + 2 * (size_t)biggest * NN_SOA_VECTORS + NN_SOA_VECTORS + gradients;
+	dst->bytes = vectors * sizeof(NN_lanes);
+	if (!(dst->a = aligned_alloc(sizeof(NN_lanes), dst->bytes)))
+		goto ALLOC_err;
+	memset(dst->a, 0, dst->bytes);
+	dst->z = dst->a + activations;
+	dst->desired = dst->z + activations;
+	dst->delta = dst->desired + outputs;
+	dst->temp_delta = dst->delta + (size_t)biggest * NN_SOA_VECTORS;
+	dst->valid = dst->temp_delta + (size_t)biggest * NN_SOA_VECTORS;
+	dst->acc = dst->valid + NN_SOA_VECTORS;
+	return 0;
+
+ALLOC_err:
+	sfree(dst->activations);
+	sfree(dst->gradients);
+	return 1;
+}
+
+static void soa_workspace_free(struct soa_workspace* ws) {
+	sfree(ws->a);
+	sfree(ws->activations);
+	sfree(ws->gradients);
+}
+
+// example into lane k, a failed generator leaves the lane to be zeroed
+static short soa_load(NN_args* args, struct soa_workspace* ws, Vector* input, Vector* desired, size_t example, uint32_t k) {
+	if (!args->igen)
+		input->V = args->inputs->M + (example - args->batch_start) * args->inputs->columns;
+	else if (args->igen(example, input)) {
+		printf(FG_GRAY "[Neural Network Learning] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate input" C_RESET "\n", example);
+		return 1;
+	}
+	if (!args->lgen)
+		desired->V = args->labels->M + (example - args->batch_start) * args->labels->columns;
+	else if (args->lgen(example, desired)) {
+		printf(FG_GRAY "[Neural Network Learning] " C_RESET FG_GREEN FG_BRIGHT "Example %zu - " C_RESET FG_RED FG_BRIGHT "Failed to generate a label" C_RESET "\n", example);
+		return 2;
+	}
+	for (uint32_t c = 0; c < input->size; c++)
+		*soa_slot(ws->a + c * NN_SOA_VECTORS, k) = input->V[c];
+	for (uint32_t r = 0; r < desired->size; r++)
+		*soa_slot(ws->desired + r * NN_SOA_VECTORS, k) = desired->V[r];
+	return 0;
+}
+
+// the block's count examples into the lanes, padding lanes are zero and invalid
+// returns how many of the count examples failed
+static uint32_t soa_gather(NN_args* args, struct soa_workspace* ws, Vector* input, Vector* desired, size_t first, uint32_t count) {
+	uint32_t failed = 0;
+	for (uint32_t k = 0; k < NN_SOA_BLOCK; k++) {
+		char valid = k < count && !soa_load(args, ws, input, desired, first + k, k);
+		failed += k < count && !valid;
+		if (!valid) {
+			for (uint32_t c = 0; c < input->size; c++)
+				*soa_slot(ws->a + c * NN_SOA_VECTORS, k) = 0.0f;
+			for (uint32_t r = 0; r < desired->size; r++)
+				*soa_slot(ws->desired + r * NN_SOA_VECTORS, k) = 0.0f;
+		}
+		*soa_slot(ws->valid, k) = valid;
+	}
+	return failed;
+}
+
+short NeuralNetwork_train_soa(NN_args args) {
+	int gerr = 0;
+	char gfailed = 1;
+	struct soa_workspace ws;
+	Vector input = {0}, desired = {0};
+	data_type* own_input = NULL;
+	data_type* own_desired = NULL;
+	uint32_t n;
+	size_t failed_examples = 0;
+	if (!args.NN || !args.gradient || !args.batch_size || !NeuralNetwork_is_narrow(args.NN)) goto ARG_err;
+	if ((!args.igen && !args.inputs) || (!args.lgen && !args.labels)) goto ARG_err;
+	n = args.NN->num_hidden_layers + 1;
+	if (!args.igen && (args.inputs->columns != args.NN->input_size || args.inputs->rows < args.batch_size)) goto ARG_err;
+	if (!args.lgen && (args.labels->columns != args.NN->output_layer.biases.size || args.labels->rows < args.batch_size)) goto ARG_err;
+
+	data_type scale = (data_type)1 / (args.normalize ? args.normalize : args.batch_size);
+	double loss = 0.0;
+
+	if (!args.accumulate && NeuralNetwork_gradient_init(args.NN, args.gradient))
+		goto GRADIENT_INIT_err;
+	if (soa_workspace_init(args.NN, &ws))
+		goto WS_INIT_err;
+	if (vector_init(&input, args.NN->input_size))
+		goto VECTOR_INIT_err;
+	own_input = input.V;
+	if (vector_init(&desired, args.NN->output_layer.biases.size))
+		goto VECTOR_INIT_err;
+	own_desired = desired.V;
+	if (args.workspace_bytes) *args.workspace_bytes = ws.bytes;
+
+	for (size_t first = args.batch_start; first < args.batch_start + args.batch_size; first += NN_SOA_BLOCK) {
+		size_t left = args.batch_start + args.batch_size - first;
+		failed_examples += soa_gather(&args, &ws, &input, &desired, first, left < NN_SOA_BLOCK ? left : NN_SOA_BLOCK);
+		for (uint32_t l = 1; l <= n; l++)
+			soa_forward(args.NN, &ws, l);
+		loss += soa_output_delta(args.NN, &ws, scale);
+		for (uint32_t l = n; l >= 1; l--) {
+			soa_backward(args.NN, &ws, l);
+			NN_lanes* swap = ws.delta;
+			ws.delta = ws.temp_delta;
+			ws.temp_delta = swap;
+		}
+	}
+
+	for (uint32_t l = 1; l <= n; l++) {
+		NN_lanes* acc = ws.acc + ws.gradients[l];
+		struct layer_gradient* g = &args.gradient[l-1];
+		if (!g->weight_gradient.M) continue;
+		size_t weights = (size_t)g->weight_gradient.rows * g->weight_gradient.columns;
+		for (size_t i = 0; i < weights; i++)
+			g->weight_gradient.M[i] += NN_lanes_sum(acc[i]);
+		for (uint32_t i = 0; i < g->bias_gradient.size; i++)
+			g->bias_gradient.V[i] += NN_lanes_sum(acc[weights + i]);
+	}
+	if (failed_examples == args.batch_size) goto EXAMPLES_err;
+	if (args.loss) *args.loss = loss / args.batch_size;
+
+	gfailed = 0;
+
+EXAMPLES_err: gerr += gfailed;
+VECTOR_INIT_err: gerr += gfailed;
+	input.V = own_input;
+	desired.V = own_desired;
+	vector_free(&input);
+	vector_free(&desired);
+	soa_workspace_free(&ws);
+WS_INIT_err: gerr++;
+	if (gfailed && !args.accumulate)
+		NeuralNetwork_gradient_free(args.NN, args.gradient);
+GRADIENT_INIT_err: gerr++;
+ARG_err: gerr++;
+
+	char* gmsg[] = {
+		NULL,
+		"Invalid arguments",
+		"Failed to allocate the gradient",
+		"Failed to allocate the structure of arrays workspace",
+		"Failed to allocate the example vectors",
+		"Every example of the batch failed",
+	};
+
+	if (gfailed) printf(FG_GRAY "[Neural Network Training] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", gmsg[gerr]);
+	return gfailed ? gerr : 0;
+}
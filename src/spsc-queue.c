@@ -0,0 +1,79 @@
+#include <spsc-queue.h>
+#include <string.h>
+
+short spsc_init(SPSC_queue* dst, size_t capacity, size_t element_size) {
+	if (!dst || !capacity || !element_size) return 11;
+	size_t slots = 1;
+	while (slots < capacity) slots <<= 1;
+	// slots start on their own cache line so neighbouring elements written by
+	// the two sides don't share one more than they have to
+	size_t bytes = (slots * element_size + SPSC_CACHE_LINE - 1) / SPSC_CACHE_LINE * SPSC_CACHE_LINE;
+	if (!(dst->slots = aligned_alloc(SPSC_CACHE_LINE, bytes))) {
+		puts(FG_GRAY "[SPSC Queue] " C_RESET FG_RED FG_BRIGHT "Failed to allocate the ring" C_RESET);
+		return 1;
+	}
+	atomic_init(&dst->head, 0);
+	atomic_init(&dst->tail, 0);
+	dst->mask = slots - 1;
+	dst->element_size = element_size;
+	return 0;
+}
+
+void spsc_free(SPSC_queue* queue) {
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+void* spsc_push_slot(SPSC_queue* queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) > queue->mask)
+		return NULL;
+	return queue->slots + (head & queue->mask) * queue->element_size;
+}
+void spsc_push_commit(SPSC_queue* queue) {
+	atomic_store_explicit(&queue->head, atomic_load_explicit(&queue->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+void* spsc_pop_slot(SPSC_queue* queue) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&queue->head, memory_order_acquire))
+		return NULL;
+	return queue->slots + (tail & queue->mask) * queue->element_size;
+}
+void spsc_pop_commit(SPSC_queue* queue) {
+	atomic_store_explicit(&queue->tail, atomic_load_explicit(&queue->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+short spsc_push(SPSC_queue* queue, void* element) {
+	void* slot = spsc_push_slot(queue);
+	if (!slot) return 1;
+	memcpy(slot, element, queue->element_size);
+	spsc_push_commit(queue);
+	return 0;
+}
+short spsc_pop(SPSC_queue* queue, void* dst) {
+	void* slot = spsc_pop_slot(queue);
+	if (!slot) return 1;
+	memcpy(dst, slot, queue->element_size);
+	spsc_pop_commit(queue);
+	return 0;
+}
+
+// spin a little before giving the core away, stages are usually only a few
+// microseconds apart
+void* spsc_push_slot_wait(SPSC_queue* queue) {
+	void* slot;
+	for (uint32_t spins = 0; !(slot = spsc_push_slot(queue)); spins++)
+		if (spins > 64) sched_yield();
+	return slot;
+}
+void* spsc_pop_slot_wait(SPSC_queue* queue) {
+	void* slot;
+	for (uint32_t spins = 0; !(slot = spsc_pop_slot(queue)); spins++)
+		if (spins > 64) sched_yield();
+	return slot;
+}
+
+size_t spsc_size(SPSC_queue* queue) {
+	return atomic_load_explicit(&queue->head, memory_order_acquire) - atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
@@ -0,0 +1,240 @@
+#include <stream-training.h>
+
+#define STREAM_POLL_MS 100			// how often a reader blocked on the fd checks stop
+#define STREAM_NAP_NS 200000
+#define STREAM_DISCARD 4096			// bytes skipped per read of a bad record
+
+enum stream_read {
+	STREAM_READ_OK,
+	STREAM_READ_EOF,			// before the first byte
+	STREAM_READ_TRUNCATED,		// after some of them
+	STREAM_READ_FAILED,			// a read error, or stop
+};
+
+// spins, then yields, then naps: either side can wait on the other for hours
+static void backoff(uint32_t* spins) {
+	if (++*spins < 64) return;
+	if (*spins < 128) sched_yield();
+	else nanosleep(&(struct timespec) {0, STREAM_NAP_NS}, NULL);
+}
+
+static enum stream_read read_full(struct NN_stream* stream, void* dst, size_t bytes) {
+	struct pollfd pfd = {.fd = stream->config.fd, .events = POLLIN};
+	size_t got = 0;
+	while (got < bytes) {
+		if (atomic_load_explicit(&stream->stop, memory_order_relaxed)) return STREAM_READ_FAILED;
+		int ready = poll(&pfd, 1, STREAM_POLL_MS);
+		if (ready < 0 && errno != EINTR) return STREAM_READ_FAILED;
+		if (ready <= 0) continue;
+		ssize_t r = read(stream->config.fd, (char*)dst + got, bytes - got);
+		if (!r) return got ? STREAM_READ_TRUNCATED : STREAM_READ_EOF;
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+			return STREAM_READ_FAILED;
+		}
+		got += r;
+	}
+	return STREAM_READ_OK;
+}
+
+// NULL after a stop
+static void* push_wait(struct NN_stream* stream) {
+	void* slot;
+	uint32_t spins = 0;
+	while (!(slot = spsc_push_slot(&stream->ring))) {
+		if (atomic_load_explicit(&stream->stop, memory_order_relaxed)) return NULL;
+		backoff(&spins);
+	}
+	return slot;
+}
+
+static void* reader(void* arg) {
+	struct NN_stream* stream = arg;
+	size_t example = stream->ring.element_size;
+	enum stream_read r;
+	uint32_t length;
+	data_type* slot;
+
+	while (!(r = read_full(stream, &length, sizeof(length)))) {
+		if (length != example) {
+			atomic_fetch_add_explicit(&stream->rejected, 1, memory_order_relaxed);
+			for (size_t left = length, chunk; left && !r; left -= chunk) {
+				chunk = left < STREAM_DISCARD ? left : STREAM_DISCARD;
+				r = read_full(stream, stream->discard, chunk);
+			}
+			// counted already
+			if (r == STREAM_READ_TRUNCATED) r = STREAM_READ_EOF;
+			if (r) break;
+			continue;
+		}
+		// the ring is full: training is behind, stop reading until it catches up
+		if (!(slot = spsc_push_slot(&stream->ring))) {
+			atomic_fetch_add_explicit(&stream->stalls, 1, memory_order_relaxed);
+			if (!(slot = push_wait(stream))) {
+				r = STREAM_READ_FAILED;
+				break;
+			}
+		}
+		if ((r = read_full(stream, slot, example))) break;
+		spsc_push_commit(&stream->ring);
+		atomic_fetch_add_explicit(&stream->received, 1, memory_order_relaxed);
+	}
+	if (r == STREAM_READ_TRUNCATED)
+		atomic_fetch_add_explicit(&stream->rejected, 1, memory_order_relaxed);
+	if (r == STREAM_READ_FAILED && !atomic_load_explicit(&stream->stop, memory_order_relaxed))
+		atomic_store_explicit(&stream->failed, 1, memory_order_relaxed);
+	atomic_store_explicit(&stream->done, 1, memory_order_release);
+	return NULL;
+}
+
+short NN_stream_init(struct NN_stream* dst, NN_stream_config config) {
+	if (!dst || !config.NN || config.fd < 0) return 11;
+	if (!config.batch_size) config.batch_size = 32;
+	if (!config.capacity) config.capacity = 4 * config.batch_size;
+	int err = 0;
+	uint32_t inputs = config.NN->input_size, outputs = config.NN->output_layer.biases.size;
+	memset(dst, 0, sizeof(struct NN_stream));
+	dst->config = config;
+	atomic_init(&dst->stop, 0);
+	atomic_init(&dst->done, 0);
+	atomic_init(&dst->failed, 0);
+
+	if (spsc_init(&dst->ring, config.capacity, (inputs + outputs) * sizeof(data_type))) goto RING_INIT_err;
+	if (matrix_init(&dst->inputs, config.batch_size, inputs)) goto INPUTS_INIT_err;
+	if (matrix_init(&dst->labels, config.batch_size, outputs)) goto LABELS_INIT_err;
+	if (!(dst->gradient = calloc(config.NN->num_hidden_layers + 1, sizeof(struct layer_gradient)))) goto GRADIENT_ALLOC_err;
+	if (NeuralNetwork_gradient_init(config.NN, dst->gradient)) goto GRADIENT_INIT_err;
+	if (!(dst->discard = malloc(STREAM_DISCARD))) goto DISCARD_ALLOC_err;
+	if (pthread_create(&dst->reader, NULL, reader, dst)) goto READER_START_err;
+	return 0;
+
+READER_START_err: err++;
+	sfree(dst->discard);
+DISCARD_ALLOC_err: err++;
+	NeuralNetwork_gradient_free(config.NN, dst->gradient);
+GRADIENT_INIT_err: err++;
+	sfree(dst->gradient);
+GRADIENT_ALLOC_err: err++;
+	matrix_free(&dst->labels);
+LABELS_INIT_err: err++;
+	matrix_free(&dst->inputs);
+INPUTS_INIT_err: err++;
+	spsc_free(&dst->ring);
+RING_INIT_err: err++;
+	char* msg[] = {
+		NULL,
+		"Failed to allocate the example ring",
+		"Failed to allocate the batch inputs",
+		"Failed to allocate the batch labels",
+		"Failed to allocate the gradient array",
+		"Failed to allocate the gradient",
+		"Failed to allocate the discard buffer",
+		"Failed to start the reader thread",
+	};
+	printf(FG_GRAY "[Neural Network Stream] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg[err]);
+	return err;
+}
+
+static double ms_since(struct timespec* since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/*
+ * The next example, NULL once the stream is over or stopped and, with
+ * partial, once flush_ms passed without one.
+ */
+static data_type* stream_next(struct NN_stream* stream, char partial) {
+	struct timespec since;
+	uint32_t spins = 0;
+	data_type* slot;
+	clock_gettime(CLOCK_MONOTONIC, &since);
+	while (!(slot = spsc_pop_slot(&stream->ring))) {
+		if (atomic_load_explicit(&stream->stop, memory_order_relaxed)) return NULL;
+		// everything pushed before done was set is visible now
+		if (atomic_load_explicit(&stream->done, memory_order_acquire)) return spsc_pop_slot(&stream->ring);
+		if (partial && stream->config.flush_ms && ms_since(&since) >= stream->config.flush_ms) return NULL;
+		backoff(&spins);
+	}
+	return slot;
+}
+
+static short stream_batch(struct NN_stream* stream, uint32_t count) {
+	NN_stream_config* config = &stream->config;
+	Matrix inputs = {.rows = count, .columns = stream->inputs.columns, .M = stream->inputs.M};
+	Matrix labels = {.rows = count, .columns = stream->labels.columns, .M = stream->labels.M};
+	float loss;
+	NeuralNetwork_gradient_zero(config->NN, stream->gradient);
+	if (NeuralNetwork_train((NN_args) {
+				.NN = config->NN,
+				.inputs = &inputs,
+				.labels = &labels,
+				.batch_size = count,
+				.gradient = stream->gradient,
+				.loss = &loss,
+				.accumulate = 1,
+				.soa = config->soa,
+			}))
+		return 1;
+	NeuralNetwork_apply_gradient(config->NN, stream->gradient, config->lrate);
+	atomic_fetch_add_explicit(&stream->examples, count, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stream->batches, 1, memory_order_relaxed);
+	if (count < config->batch_size) atomic_fetch_add_explicit(&stream->partial, 1, memory_order_relaxed);
+	atomic_store_explicit(&stream->loss, loss, memory_order_relaxed);
+	NN_mem_step();
+	return 0;
+}
+
+short NN_stream_run(struct NN_stream* stream) {
+	if (!stream) return 11;
+	uint32_t inputs = stream->inputs.columns, outputs = stream->labels.columns;
+	data_type* slot;
+	while (1) {
+		uint32_t count = 0;
+		while (count < stream->config.batch_size && (slot = stream_next(stream, count > 0))) {
+			memcpy(stream->inputs.M + (size_t)count * inputs, slot, inputs * sizeof(data_type));
+			memcpy(stream->labels.M + (size_t)count * outputs, slot + inputs, outputs * sizeof(data_type));
+			spsc_pop_commit(&stream->ring);
+			count++;
+		}
+		if (count && stream_batch(stream, count)) {
+			printf(FG_GRAY "[Neural Network Stream] " C_RESET FG_RED FG_BRIGHT "Failed to train a batch" C_RESET "\n");
+			return 2;
+		}
+		if (atomic_load_explicit(&stream->stop, memory_order_relaxed)) break;
+		if (atomic_load_explicit(&stream->done, memory_order_acquire) && !spsc_size(&stream->ring)) break;
+	}
+	if (atomic_load_explicit(&stream->failed, memory_order_relaxed)) {
+		printf(FG_GRAY "[Neural Network Stream] " C_RESET FG_RED FG_BRIGHT "Failed to read the stream" C_RESET "\n");
+		return 1;
+	}
+	return 0;
+}
+
+void NN_stream_stop(struct NN_stream* stream) {
+	atomic_store_explicit(&stream->stop, 1, memory_order_relaxed);
+}
+
+void NN_stream_get_stats(struct NN_stream* stream, NN_stream_stats* dst) {
+	*dst = (NN_stream_stats) {
+		.received = atomic_load_explicit(&stream->received, memory_order_relaxed),
+		.rejected = atomic_load_explicit(&stream->rejected, memory_order_relaxed),
+		.stalls = atomic_load_explicit(&stream->stalls, memory_order_relaxed),
+		.examples = atomic_load_explicit(&stream->examples, memory_order_relaxed),
+		.batches = atomic_load_explicit(&stream->batches, memory_order_relaxed),
+		.partial = atomic_load_explicit(&stream->partial, memory_order_relaxed),
+		.loss = atomic_load_explicit(&stream->loss, memory_order_relaxed),
+	};
+}
+
+void NN_stream_free(struct NN_stream* stream) {
+	NN_stream_stop(stream);
+	pthread_join(stream->reader, NULL);
+	sfree(stream->discard);
+	NeuralNetwork_gradient_free(stream->config.NN, stream->gradient);
+	sfree(stream->gradient);
+	matrix_free(&stream->labels);
+	matrix_free(&stream->inputs);
+	spsc_free(&stream->ring);
+}
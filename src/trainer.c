@@ -0,0 +1,247 @@
+#include <trainer.h>
+
+// how long the logger sleeps once the ring is empty
+#define TRAINER_LOGGER_NAP_NS 1000000
+
+static double elapsed(struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+data_type NN_trainer_lrate(NN_trainer_config* config, uint64_t step) {
+	data_type lrate = config->lrate;
+	uint64_t period = config->lr_step ? config->lr_step : 1;
+	switch (config->schedule) {
+		case NN_LR_CONSTANT:
+			break;
+		case NN_LR_LINEAR:
+			lrate -= config->lr_gamma * (step / period);
+			break;
+		case NN_LR_STEP:
+			lrate *= powf(config->lr_gamma, step / period);
+			break;
+		case NN_LR_EXPONENTIAL:
+			lrate *= powf(config->lr_gamma, step);
+			break;
+		case NN_LR_COSINE: {
+			double t = step < period ? (double)step / period : 1.0;
+			lrate = config->min_lrate + (config->lrate - config->min_lrate) * 0.5 * (1 + cos(M_PI * t));
+			break;
+		}
+	}
+	return lrate < config->min_lrate ? config->min_lrate : lrate;
+}
+
+static void logger_write(NN_trainer_config* config, NN_metric* metric) {
+	if (config->log)
+		fprintf(config->log, "%lu\t%lf\t%lf\n", metric->step, metric->train_loss, metric->test_loss);
+}
+
+static void* logger(void* arg) {
+	struct NN_trainer* trainer = arg;
+	NN_trainer_config* config = &trainer->config;
+	struct timespec nap = {0, TRAINER_LOGGER_NAP_NS}, last_plot;
+	char plotted = 0;
+	NN_metric* metric;
+
+	clock_gettime(CLOCK_MONOTONIC, &last_plot);
+	while (1) {
+		// check done before draining, so nothing pushed before it was set is lost
+		char done = atomic_load_explicit(&trainer->done, memory_order_acquire);
+		char wrote = 0;
+		while ((metric = spsc_pop_slot(&trainer->metrics))) {
+			logger_write(config, metric);
+			spsc_pop_commit(&trainer->metrics);
+			wrote = 1;
+		}
+		if (wrote && config->log) fflush(config->log);
+		if (config->plot && config->log_name && (done || elapsed(&last_plot) > config->plot_interval)) {
+			if (plotted)
+				fputs("replot\n", config->plot);
+			else
+				fprintf(config->plot, "plot '%s' u 1:2 w l t 'Training loss',"
+									  "'%s' u 1:3 w l t 'Test loss'\n", config->log_name, config->log_name);
+			plotted = 1;
+			fflush(config->plot);
+			clock_gettime(CLOCK_MONOTONIC, &last_plot);
+		}
+		if (done) break;
+		nanosleep(&nap, NULL);
+	}
+	return NULL;
+}
+
+short NN_trainer_init(struct NN_trainer* dst, NN_trainer_config config) {
+	if (!dst || !config.NN) return 11;
+	if (config.features && (config.async || config.preprocess || config.dropout > 0.0f || config.features->config.NN != config.NN))
+		return 11;
+	// hogwild epochs take neither dropout masks nor checkpoints
+	if (config.async && (config.dropout > 0.0f || config.checkpoint_interval)) return 11;
+	if (config.preprocess) {
+		if (config.async) return 11;
+		config.batch_size = config.train_size = config.preprocess->config.batch_size;
+	} else if (!config.igen || !config.lgen || !config.batch_size || config.batch_size > config.train_size) return 11;
+	if (config.eval_interval && (!config.test_igen || !config.test_lgen || !config.test_size)) return 11;
+	int err = 0;
+	memset(dst, 0, sizeof(struct NN_trainer));
+	dst->config = config;
+	atomic_init(&dst->stop, 0);
+	atomic_init(&dst->done, 0);
+	atomic_init(&dst->dropped, 0);
+
+	if (!(dst->gradient = calloc(config.NN->num_hidden_layers + 1, sizeof(struct layer_gradient)))) goto GRADIENT_ALLOC_err;
+	// one gradient for the whole run, every step accumulates into it
+	if (!config.async && NeuralNetwork_gradient_init(config.NN, dst->gradient)) goto GRADIENT_INIT_err;
+	if (spsc_init(&dst->metrics, config.ring ? config.ring : NN_TRAINER_RING, sizeof(NN_metric))) goto RING_INIT_err;
+	if (pthread_create(&dst->logger, NULL, logger, dst)) goto LOGGER_START_err;
+	return 0;
+
+LOGGER_START_err: err++;
+	spsc_free(&dst->metrics);
+RING_INIT_err: err++;
+	NeuralNetwork_gradient_free(config.NN, dst->gradient);
+GRADIENT_INIT_err: err++;
+	sfree(dst->gradient);
+GRADIENT_ALLOC_err: err++;
+	char* msg[] = {
+		NULL,
+		"Failed to allocate the gradient array",
+		"Failed to allocate the gradient",
+		"Failed to allocate the metric ring",
+		"Failed to start the logger thread",
+	};
+	printf(FG_GRAY "[Neural Network Trainer] " C_RESET FG_RED FG_BRIGHT "%s" C_RESET "\n", msg[err]);
+	return err;
+}
+
+// a seed per epoch, so an example gets a new dropout mask every time it comes round
+static uint64_t epoch_seed(uint64_t seed, uint64_t epoch) {
+	uint32_t counter[4] = {(uint32_t)epoch, (uint32_t)(epoch >> 32), 0, 0};
+	uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+	uint32_t out[4];
+	philox4x32(counter, key, out);
+	return (uint64_t)out[1] << 32 | out[0];
+}
+
+static short trainer_step(struct NN_trainer* trainer, size_t batch_start, uint64_t epoch, data_type lrate, float* loss) {
+	NN_trainer_config* config = &trainer->config;
+	NN_batch* batch = NULL;
+	if (config->async)
+		return NeuralNetwork_train_async((NN_async_args) {
+				.NN = config->NN,
+				.igen = config->igen,
+				.lgen = config->lgen,
+				.start = batch_start,
+				.size = config->batch_size,
+				.epochs = 1,
+				.threads = config->threads,
+				.lrate = lrate,
+				.loss = loss,
+			});
+	size_t micro_batch = config->micro_batch ? config->micro_batch : config->batch_size;
+	float micro_loss;
+	double total = 0.0;
+	short err = 0;
+	Matrix inputs, labels;
+	if (config->preprocess) {
+		batch = NN_preprocess_next(config->preprocess);
+		batch_start = batch->first;
+	}
+	NeuralNetwork_gradient_zero(config->NN, trainer->gradient);
+	for (size_t done = 0; done < config->batch_size && !err; done += micro_batch) {
+		size_t size = config->batch_size - done < micro_batch ? config->batch_size - done : micro_batch;
+		// views of this micro batch's rows
+		if (batch) {
+			inputs = (Matrix) {.rows = size, .columns = batch->inputs.columns, .M = batch->inputs.M + done * batch->inputs.columns};
+			labels = (Matrix) {.rows = size, .columns = batch->labels.columns, .M = batch->labels.M + done * batch->labels.columns};
+		}
+		NN_args args = {
+			.NN = config->NN,
+			.igen = batch ? NULL : config->igen,
+			.lgen = batch ? NULL : config->lgen,
+			.inputs = &inputs,
+			.labels = &labels,
+			.batch_start = batch_start + done,
+			.batch_size = size,
+			.gradient = trainer->gradient,
+			.loss = &micro_loss,
+			.accumulate = 1,
+			.normalize = config->batch_size,
+			.dropout = config->dropout,
+			.seed = epoch_seed(config->seed, epoch),
+			.checkpoint_interval = config->checkpoint_interval,
+			.soa = config->soa,
+		};
+		err = config->features ? NN_feature_cache_train(config->features, args) : NeuralNetwork_train(args);
+		total += (double)micro_loss * size;
+	}
+	if (batch) NN_preprocess_release(config->preprocess);
+	if (err) return 1;
+	*loss = total / config->batch_size;
+	NeuralNetwork_apply_gradient(config->NN, trainer->gradient, lrate);
+	return 0;
+}
+
+short NN_trainer_run(struct NN_trainer* trainer) {
+	if (!trainer) return 11;
+	NN_trainer_config* config = &trainer->config;
+	size_t batches = config->train_size / config->batch_size;
+	NN_eval_result evaluation;
+	struct timespec start;
+	NN_metric* slot;
+	uint32_t failing = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!atomic_load_explicit(&trainer->stop, memory_order_relaxed) &&
+			(!config->steps || trainer->step < config->steps)) {
+		uint64_t step = trainer->step++;
+		NN_metric* metric = &trainer->last;
+		metric->step = step;
+		metric->lrate = NN_trainer_lrate(config, step);
+		metric->evaluated = 0;
+		if (trainer_step(trainer, config->train_start + (step % batches) * config->batch_size, step / batches, metric->lrate, &metric->train_loss)) {
+			trainer->failed++;
+			// a step that failed is skipped, a run where every step fails is over
+			if (++failing < NN_TRAINER_MAX_FAILURES) continue;
+			printf(FG_GRAY "[Neural Network Trainer] " C_RESET FG_RED FG_BRIGHT "%u steps in a row failed, giving up at step %lu" C_RESET "\n", failing, (unsigned long)step);
+			return 1;
+		}
+		failing = 0;
+		if (config->eval_interval && step % config->eval_interval == 0 &&
+				!NeuralNetwork_evaluate((NN_eval_args) {
+					.NN = config->NN,
+					.igen = config->test_igen,
+					.lgen = config->test_lgen,
+					.start = config->test_start,
+					.size = config->test_size,
+					.threads = config->eval_threads,
+				}, &evaluation)) {
+			metric->test_loss = evaluation.loss;
+			metric->accuracy = evaluation.accuracy;
+			metric->evaluated = 1;
+		}
+		metric->seconds = elapsed(&start);
+		NN_mem_step();
+		// never wait for the logger
+		if ((slot = spsc_push_slot(&trainer->metrics))) {
+			*slot = *metric;
+			spsc_push_commit(&trainer->metrics);
+		} else atomic_fetch_add_explicit(&trainer->dropped, 1, memory_order_relaxed);
+	}
+	return 0;
+}
+
+// only an atomic store, safe from a signal handler
+void NN_trainer_stop(struct NN_trainer* trainer) {
+	atomic_store_explicit(&trainer->stop, 1, memory_order_relaxed);
+}
+
+void NN_trainer_free(struct NN_trainer* trainer) {
+	atomic_store_explicit(&trainer->done, 1, memory_order_release);
+	pthread_join(trainer->logger, NULL);
+	spsc_free(&trainer->metrics);
+	if (!trainer->config.async)
+		NeuralNetwork_gradient_free(trainer->config.NN, trainer->gradient);
+	sfree(trainer->gradient);
+}